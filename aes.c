@@ -0,0 +1,340 @@
+#include <string.h>
+#include <pthread.h>
+#include "util.h"
+#include "aes.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AES_HAVE_AESNI
+#endif
+
+/* whole counter blocks from (hi, lo), the keystream is xored into data in place */
+typedef void (*aes_ctr_kernel_t)(const aes_key_t *key, uint64_t hi, uint64_t lo, uint8_t *data, uint32_t blocks);
+
+static uint8_t s_sbox[256];
+static uint32_t s_te[4][256];
+static aes_ctr_kernel_t s_aes_kernel;
+static const char *s_aes_kernel_name;
+static pthread_once_t s_aes_once = PTHREAD_ONCE_INIT;
+
+#define ROL8(x, n)  ((uint8_t)(((x) << (n)) | ((x) >> (8 - (n)))))
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define XTIME(x)    ((uint8_t)(((x) << 1) ^ (((x) & 0x80) ? 0x1B : 0)))
+
+static uint64_t get_u64 (const uint8_t *p)
+{
+    return ((uint64_t)get_u32((void *)p) << 32) | get_u32((void *)(p + 4));
+}
+
+/* S-box from the multiplicative inverse and the affine map, then the combined SubBytes / MixColumns tables */
+static void aes_tables_init (void)
+{
+    uint8_t p = 1, q = 1, s;
+    uint32_t i, t;
+
+    do
+    {
+        p = p ^ (uint8_t)(p << 1) ^ ((p & 0x80) ? 0x1B : 0);     /* p * 3 */
+        q ^= (uint8_t)(q << 1);                                 /* q / 3 */
+        q ^= (uint8_t)(q << 2);
+        q ^= (uint8_t)(q << 4);
+        if (q & 0x80)
+        {
+            q ^= 0x09;
+        }
+        s_sbox[p] = q ^ ROL8(q, 1) ^ ROL8(q, 2) ^ ROL8(q, 3) ^ ROL8(q, 4) ^ 0x63;
+    } while (p != 1);
+    s_sbox[0] = 0x63;
+
+    for (i = 0; i < 256; i++)
+    {
+        s = s_sbox[i];
+        t = ((uint32_t)XTIME(s) << 24) | ((uint32_t)s << 16) | ((uint32_t)s << 8) | (uint8_t)(XTIME(s) ^ s);
+        s_te[0][i] = t;
+        s_te[1][i] = ROR32(t, 8);
+        s_te[2][i] = ROR32(t, 16);
+        s_te[3][i] = ROR32(t, 24);
+    }
+}
+
+static void aes_encrypt_c (const aes_key_t *key, const uint8_t *in, uint8_t *out)
+{
+    const uint32_t *rk = key->ek;
+    uint32_t s0, s1, s2, s3, t0, t1, t2, t3, r;
+
+    s0 = get_u32((void *)(in + 0)) ^ rk[0];
+    s1 = get_u32((void *)(in + 4)) ^ rk[1];
+    s2 = get_u32((void *)(in + 8)) ^ rk[2];
+    s3 = get_u32((void *)(in + 12)) ^ rk[3];
+    for (r = 1; r < key->rounds; r++)
+    {
+        rk += 4;
+        t0 = s_te[0][s0 >> 24] ^ s_te[1][(s1 >> 16) & 0xFF] ^ s_te[2][(s2 >> 8) & 0xFF] ^ s_te[3][s3 & 0xFF] ^ rk[0];
+        t1 = s_te[0][s1 >> 24] ^ s_te[1][(s2 >> 16) & 0xFF] ^ s_te[2][(s3 >> 8) & 0xFF] ^ s_te[3][s0 & 0xFF] ^ rk[1];
+        t2 = s_te[0][s2 >> 24] ^ s_te[1][(s3 >> 16) & 0xFF] ^ s_te[2][(s0 >> 8) & 0xFF] ^ s_te[3][s1 & 0xFF] ^ rk[2];
+        t3 = s_te[0][s3 >> 24] ^ s_te[1][(s0 >> 16) & 0xFF] ^ s_te[2][(s1 >> 8) & 0xFF] ^ s_te[3][s2 & 0xFF] ^ rk[3];
+        s0 = t0; s1 = t1; s2 = t2; s3 = t3;
+    }
+    rk += 4;
+    put_u32(out + 0,  (((uint32_t)s_sbox[s0 >> 24] << 24) | ((uint32_t)s_sbox[(s1 >> 16) & 0xFF] << 16) |
+                       ((uint32_t)s_sbox[(s2 >> 8) & 0xFF] << 8) | s_sbox[s3 & 0xFF]) ^ rk[0]);
+    put_u32(out + 4,  (((uint32_t)s_sbox[s1 >> 24] << 24) | ((uint32_t)s_sbox[(s2 >> 16) & 0xFF] << 16) |
+                       ((uint32_t)s_sbox[(s3 >> 8) & 0xFF] << 8) | s_sbox[s0 & 0xFF]) ^ rk[1]);
+    put_u32(out + 8,  (((uint32_t)s_sbox[s2 >> 24] << 24) | ((uint32_t)s_sbox[(s3 >> 16) & 0xFF] << 16) |
+                       ((uint32_t)s_sbox[(s0 >> 8) & 0xFF] << 8) | s_sbox[s1 & 0xFF]) ^ rk[2]);
+    put_u32(out + 12, (((uint32_t)s_sbox[s3 >> 24] << 24) | ((uint32_t)s_sbox[(s0 >> 16) & 0xFF] << 16) |
+                       ((uint32_t)s_sbox[(s1 >> 8) & 0xFF] << 8) | s_sbox[s2 & 0xFF]) ^ rk[3]);
+}
+
+static void aes_ctr_c (const aes_key_t *key, uint64_t hi, uint64_t lo, uint8_t *data, uint32_t blocks)
+{
+    uint8_t ctr[AES_BLOCK_LEN], ks[AES_BLOCK_LEN];
+    uint32_t i;
+
+    while (blocks--)
+    {
+        put_u32(&ctr[0], (uint32_t)(hi >> 32));
+        put_u32(&ctr[4], (uint32_t)hi);
+        put_u32(&ctr[8], (uint32_t)(lo >> 32));
+        put_u32(&ctr[12], (uint32_t)lo);
+        aes_encrypt_c (key, ctr, ks);
+        for (i = 0; i < AES_BLOCK_LEN; i++)
+        {
+            data[i] ^= ks[i];
+        }
+        data += AES_BLOCK_LEN;
+        if (++lo == 0)
+        {
+            hi++;
+        }
+    }
+}
+
+#ifdef AES_HAVE_AESNI
+/* big endian 128 bit counter as loaded from memory */
+#define AES_CTR_BLOCK(hi, lo)   _mm_set_epi64x((long long)__builtin_bswap64(lo), (long long)__builtin_bswap64(hi))
+#define AES_CTR_INC(hi, lo)     do { if (++(lo) == 0) (hi)++; } while (0)
+
+/* 8 independent blocks in flight hide the aesenc latency */
+__attribute__((target("aes,sse2")))
+static void aes_ctr_aesni (const aes_key_t *key, uint64_t hi, uint64_t lo, uint8_t *data, uint32_t blocks)
+{
+    __m128i rk[AES_MAX_ROUNDS + 1], b[8];
+    uint32_t i, j, nr = key->rounds;
+
+    for (i = 0; i <= nr; i++)
+    {
+        rk[i] = _mm_loadu_si128((const __m128i *)&key->rk[i * AES_BLOCK_LEN]);
+    }
+    for (; blocks >= 8; blocks -= 8)
+    {
+        for (j = 0; j < 8; j++)
+        {
+            b[j] = _mm_xor_si128(AES_CTR_BLOCK(hi, lo), rk[0]);
+            AES_CTR_INC(hi, lo);
+        }
+        for (i = 1; i < nr; i++)
+        {
+            for (j = 0; j < 8; j++)
+            {
+                b[j] = _mm_aesenc_si128(b[j], rk[i]);
+            }
+        }
+        for (j = 0; j < 8; j++)
+        {
+            b[j] = _mm_aesenclast_si128(b[j], rk[nr]);
+            b[j] = _mm_xor_si128(b[j], _mm_loadu_si128((const __m128i *)(data + j * AES_BLOCK_LEN)));
+            _mm_storeu_si128((__m128i *)(data + j * AES_BLOCK_LEN), b[j]);
+        }
+        data += 8 * AES_BLOCK_LEN;
+    }
+    for (; blocks > 0; blocks--)
+    {
+        b[0] = _mm_xor_si128(AES_CTR_BLOCK(hi, lo), rk[0]);
+        AES_CTR_INC(hi, lo);
+        for (i = 1; i < nr; i++)
+        {
+            b[0] = _mm_aesenc_si128(b[0], rk[i]);
+        }
+        b[0] = _mm_aesenclast_si128(b[0], rk[nr]);
+        b[0] = _mm_xor_si128(b[0], _mm_loadu_si128((const __m128i *)data));
+        _mm_storeu_si128((__m128i *)data, b[0]);
+        data += AES_BLOCK_LEN;
+    }
+}
+
+/* VAES, two blocks per ymm register and 16 blocks per round, the tail goes through AES-NI */
+__attribute__((target("vaes,avx2,aes")))
+static void aes_ctr_vaes (const aes_key_t *key, uint64_t hi, uint64_t lo, uint8_t *data, uint32_t blocks)
+{
+    __m256i rk[AES_MAX_ROUNDS + 1], b[8];
+    __m128i c0;
+    uint32_t i, j, nr = key->rounds;
+
+    for (i = 0; i <= nr; i++)
+    {
+        rk[i] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)&key->rk[i * AES_BLOCK_LEN]));
+    }
+    for (; blocks >= 16; blocks -= 16)
+    {
+        for (j = 0; j < 8; j++)
+        {
+            c0 = AES_CTR_BLOCK(hi, lo);
+            AES_CTR_INC(hi, lo);
+            b[j] = _mm256_xor_si256(_mm256_set_m128i(AES_CTR_BLOCK(hi, lo), c0), rk[0]);
+            AES_CTR_INC(hi, lo);
+        }
+        for (i = 1; i < nr; i++)
+        {
+            for (j = 0; j < 8; j++)
+            {
+                b[j] = _mm256_aesenc_epi128(b[j], rk[i]);
+            }
+        }
+        for (j = 0; j < 8; j++)
+        {
+            b[j] = _mm256_aesenclast_epi128(b[j], rk[nr]);
+            b[j] = _mm256_xor_si256(b[j], _mm256_loadu_si256((const __m256i *)(data + j * 2 * AES_BLOCK_LEN)));
+            _mm256_storeu_si256((__m256i *)(data + j * 2 * AES_BLOCK_LEN), b[j]);
+        }
+        data += 16 * AES_BLOCK_LEN;
+    }
+    if (blocks > 0)
+    {
+        aes_ctr_aesni (key, hi, lo, data, blocks);
+    }
+}
+#endif
+
+static void aes_kernel_init (void)
+{
+    aes_tables_init ();
+    s_aes_kernel = aes_ctr_c;
+    s_aes_kernel_name = "c";
+#ifdef AES_HAVE_AESNI
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2"))
+    {
+        s_aes_kernel = aes_ctr_aesni;
+        s_aes_kernel_name = "aes-ni";
+        if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx2"))
+        {
+            s_aes_kernel = aes_ctr_vaes;
+            s_aes_kernel_name = "vaes";
+        }
+    }
+#endif
+}
+
+const char *aes_kernel_name (void)
+{
+    pthread_once(&s_aes_once, aes_kernel_init);
+    return s_aes_kernel_name;
+}
+
+/* FIPS-197 key expansion, len 16 or 32, -1 otherwise */
+int aes_set_key (aes_key_t *key, const uint8_t *raw, uint32_t len)
+{
+    uint32_t nk = len / 4, i, t, rcon = 1;
+
+    if ((len != 16) && (len != 32))
+    {
+        return -1;
+    }
+    pthread_once(&s_aes_once, aes_kernel_init);
+    key->rounds = nk + 6;
+    for (i = 0; i < nk; i++)
+    {
+        key->ek[i] = get_u32((void *)(raw + 4 * i));
+    }
+    for (i = nk; i < 4 * (key->rounds + 1); i++)
+    {
+        t = key->ek[i - 1];
+        if (i % nk == 0)
+        {
+            t = (t << 8) | (t >> 24);
+        }
+        if ((i % nk == 0) || ((nk > 6) && (i % nk == 4)))
+        {
+            t = ((uint32_t)s_sbox[t >> 24] << 24) | ((uint32_t)s_sbox[(t >> 16) & 0xFF] << 16) |
+                ((uint32_t)s_sbox[(t >> 8) & 0xFF] << 8) | s_sbox[t & 0xFF];
+        }
+        if (i % nk == 0)
+        {
+            t ^= rcon << 24;
+            rcon = XTIME(rcon);
+        }
+        key->ek[i] = key->ek[i - nk] ^ t;
+    }
+    for (i = 0; i < 4 * (key->rounds + 1); i++)
+    {
+        put_u32(&key->rk[i * 4], key->ek[i]);
+    }
+    return 0;
+}
+
+/*
+    first counter block of download seq (counted from the nonce) at addr, both move the nonce's high half,
+    so neither two regions nor a second download of the same region share keystream
+*/
+void aes_ctr_start (uint8_t ctr[AES_BLOCK_LEN], const uint8_t nonce[AES_BLOCK_LEN], uint32_t seq, uint32_t addr)
+{
+    uint64_t hi = get_u64 (nonce) + ((uint64_t)seq << 32) + addr;
+
+    put_u32(&ctr[0], (uint32_t)(hi >> 32));
+    put_u32(&ctr[4], (uint32_t)hi);
+    memcpy (&ctr[8], &nonce[8], 8);
+}
+
+/* encrypt or decrypt len bytes in place, off is their position in the counter stream that starts at ctr */
+void aes_ctr_xor (const aes_key_t *key, const uint8_t ctr[AES_BLOCK_LEN], uint64_t off, uint8_t *data, uint32_t len)
+{
+    uint8_t ks[AES_BLOCK_LEN];
+    uint64_t hi = get_u64 (ctr), lo = get_u64 (ctr + 8), blk = off / AES_BLOCK_LEN;
+    uint32_t skip = off % AES_BLOCK_LEN, blocks, n, i;
+
+    pthread_once(&s_aes_once, aes_kernel_init);
+    lo += blk;
+    if (lo < blk)
+    {
+        hi++;
+    }
+    if (skip != 0)
+    {
+        /* the head of a block that started in an earlier piece */
+        memset (ks, 0, sizeof(ks));
+        s_aes_kernel (key, hi, lo, ks, 1);
+        n = my_min(AES_BLOCK_LEN - skip, len);
+        for (i = 0; i < n; i++)
+        {
+            data[i] ^= ks[skip + i];
+        }
+        data += n;
+        len -= n;
+        if (++lo == 0)
+        {
+            hi++;
+        }
+    }
+    blocks = len / AES_BLOCK_LEN;
+    if (blocks > 0)
+    {
+        s_aes_kernel (key, hi, lo, data, blocks);
+        data += (size_t)blocks * AES_BLOCK_LEN;
+        len -= blocks * AES_BLOCK_LEN;
+        lo += blocks;
+        if (lo < blocks)
+        {
+            hi++;
+        }
+    }
+    if (len > 0)
+    {
+        memset (ks, 0, sizeof(ks));
+        s_aes_kernel (key, hi, lo, ks, 1);
+        for (i = 0; i < len; i++)
+        {
+            data[i] ^= ks[i];
+        }
+    }
+}
@@ -0,0 +1,30 @@
+#ifndef _AES_H_
+#define _AES_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+
+#define AES_BLOCK_LEN       16
+#define AES_MAX_ROUNDS      14
+
+/* expanded encryption key, CTR never needs the decryption schedule */
+typedef struct
+{
+    uint32_t rounds;                                /* 10 : AES-128, 14 : AES-256 */
+    uint32_t ek[4 * (AES_MAX_ROUNDS + 1)];          /* round key words, portable kernel */
+    uint8_t  rk[AES_BLOCK_LEN * (AES_MAX_ROUNDS + 1)]; /* the same in byte order, AES-NI / VAES */
+} aes_key_t;
+
+int aes_set_key (aes_key_t *key, const uint8_t *raw, uint32_t len);
+void aes_ctr_start (uint8_t ctr[AES_BLOCK_LEN], const uint8_t nonce[AES_BLOCK_LEN], uint32_t seq, uint32_t addr);
+void aes_ctr_xor (const aes_key_t *key, const uint8_t ctr[AES_BLOCK_LEN], uint64_t off, uint8_t *data, uint32_t len);
+const char *aes_kernel_name (void);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "util.h"
+
+/*
+    crc_bench [size_mb]
+    make_crc32_mt() throughput from 1 thread up to one thread per online cpu
+*/
+
+static double now_sec (void)
+{
+    struct timespec tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return tm.tv_sec + tm.tv_nsec / 1e9;
+}
+
+int main (int argc, char *argv[])
+{
+    uint32_t size_mb = (argc > 1) ? (uint32_t)atoi(argv[1]) : 512;
+    uint32_t len, i, crc, ref;
+    uint8_t *buf;
+    int ncpu, n, rep;
+    double t, best;
+
+    if ((size_mb == 0) || (size_mb > 4095))
+    {
+        printf ("usage: %s [size_mb(1..4095)]\n", argv[0]);
+        return 1;
+    }
+    len = size_mb * 1024 * 1024;
+    buf = malloc (len);
+    if (buf == NULL)
+    {
+        printf ("malloc fail (%u MB)\n", size_mb);
+        return 1;
+    }
+    for (i = 0; i < len; i++)
+    {
+        buf[i] = (uint8_t)(i * 2654435761u >> 24);
+    }
+
+    ncpu = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    ref = make_crc32(0xFFFFFFFF, buf, len);
+    printf ("kernel = %s, size = %u MB, cpus = %d, crc = 0x%08X\n", crc32_kernel_name(), size_mb, ncpu, ref);
+
+    for (n = 1; n <= ncpu; n++)
+    {
+        best = 1e9;
+        for (rep = 0; rep < 3; rep++)
+        {
+            t = now_sec();
+            crc = make_crc32_mt(0xFFFFFFFF, buf, len, n);
+            t = now_sec() - t;
+            if (t < best)
+            {
+                best = t;
+            }
+            if (crc != ref)
+            {
+                printf ("threads = %d, crc mismatch 0x%08X != 0x%08X\n", n, crc, ref);
+                return 1;
+            }
+        }
+        printf ("threads = %2d, %8.1f MB/s\n", n, size_mb / best);
+    }
+    free (buf);
+    return 0;
+}
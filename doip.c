@@ -0,0 +1,477 @@
+#define _GNU_SOURCE     /* accept4() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "util.h"
+#include "doip.h"
+
+#define DOIP_VERSION            0x02
+#define DOIP_GENERIC_NACK       0x0000
+#define DOIP_ROUTING_REQ        0x0005
+#define DOIP_ROUTING_RSP        0x0006
+#define DOIP_DIAG_MSG           0x8001
+#define DOIP_DIAG_ACK           0x8002
+#define DOIP_DIAG_NACK          0x8003
+
+#define DOIP_NACK_PATTERN       0x00    /* generic header nack codes */
+#define DOIP_NACK_TYPE          0x01
+#define DOIP_NACK_TOO_LARGE     0x02
+#define DOIP_NACK_LENGTH        0x04
+
+#define DOIP_DIAG_BAD_SA        0x02    /* diagnostic message nack codes */
+#define DOIP_DIAG_BAD_TA        0x03
+
+#define DOIP_ROUTING_OK         0x10
+
+static void doip_nodelay (int fd)
+{
+    int on = 1;
+
+    setsockopt (fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+static void doip_loopback (struct sockaddr_in *sa, uint16_t port)
+{
+    memset (sa, 0, sizeof(*sa));
+    sa->sin_family = AF_INET;
+    sa->sin_port = htons (port);
+    sa->sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+}
+
+/* non-blocking listener on 127.0.0.1, port 0 picks a free one and returns it in port */
+int doip_listen (uint16_t *port)
+{
+    struct sockaddr_in sa;
+    socklen_t sa_len = sizeof(sa);
+    int fd, on = 1;
+
+    fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+    {
+        perror ("doip: socket");
+        return -1;
+    }
+    setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    doip_loopback (&sa, *port);
+    if ((bind (fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) || (listen (fd, 4) != 0) ||
+        (getsockname (fd, (struct sockaddr *)&sa, &sa_len) != 0))
+    {
+        perror ("doip: listen");
+        close (fd);
+        return -1;
+    }
+    *port = ntohs (sa.sin_port);
+    return fd;
+}
+
+/* the listener's backlog completes the handshake, the socket is non-blocking afterwards */
+int doip_connect (uint16_t port)
+{
+    struct sockaddr_in sa;
+    int fd;
+
+    fd = socket (AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        perror ("doip: socket");
+        return -1;
+    }
+    doip_loopback (&sa, port);
+    if (connect (fd, (struct sockaddr *)&sa, sizeof(sa)) != 0)
+    {
+        perror ("doip: connect");
+        close (fd);
+        return -1;
+    }
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    doip_nodelay (fd);
+    return fd;
+}
+
+/* -1 while no tester is waiting */
+int doip_accept (int listen_fd)
+{
+    int fd = accept4 (listen_fd, NULL, NULL, SOCK_NONBLOCK);
+
+    if (fd >= 0)
+    {
+        doip_nodelay (fd);
+    }
+    return fd;
+}
+
+/* the buffers of an earlier connection are reused */
+int doip_conn_init (doip_conn_t *c, int fd, int entity, uint16_t sa, uint16_t ta, uint32_t max_len)
+{
+    uint32_t rx_cap = 2 * (DOIP_HDR_LEN + 4 + max_len);
+
+    if (c->rx_cap < rx_cap)
+    {
+        free (c->rx_buf);
+        c->rx_buf = malloc (rx_cap);
+        c->rx_cap = (c->rx_buf != NULL) ? rx_cap : 0;
+        if (c->rx_buf == NULL)
+        {
+            return -1;
+        }
+    }
+    c->fd = fd;
+    c->entity = entity;
+    c->active = 0;
+    c->sa = sa;
+    c->ta = ta;
+    c->rx_off = 0;
+    c->rx_len = 0;
+    c->tx_off = 0;
+    c->tx_len = 0;
+    c->max_len = max_len;
+    return 0;
+}
+
+void doip_close (doip_conn_t *c)
+{
+    if (c->fd >= 0)
+    {
+        close (c->fd);
+    }
+    c->fd = -1;
+    c->active = 0;
+    c->rx_off = 0;
+    c->rx_len = 0;
+    c->tx_off = 0;
+    c->tx_len = 0;
+}
+
+/* copies what sendmsg() left of the iovecs, skip bytes were sent */
+static int doip_queue (doip_conn_t *c, const struct iovec *iov, int cnt, uint32_t skip)
+{
+    uint32_t need = 0, n, cap;
+    uint8_t *buf;
+    int i;
+
+    for (i = 0; i < cnt; i++)
+    {
+        need += (uint32_t)iov[i].iov_len;
+    }
+    need -= skip;
+    if (c->tx_len + need > c->tx_cap)
+    {
+        cap = (c->tx_cap != 0) ? c->tx_cap : (64 * 1024);
+        while (cap < c->tx_len + need)
+        {
+            cap *= 2;
+        }
+        buf = realloc (c->tx_buf, cap);
+        if (buf == NULL)
+        {
+            return -1;
+        }
+        c->tx_buf = buf;
+        c->tx_cap = cap;
+    }
+    for (i = 0; i < cnt; i++)
+    {
+        n = (uint32_t)iov[i].iov_len;
+        if (skip >= n)
+        {
+            skip -= n;
+            continue;
+        }
+        memcpy (c->tx_buf + c->tx_len, (const uint8_t *)iov[i].iov_base + skip, n - skip);
+        c->tx_len += n - skip;
+        skip = 0;
+    }
+    c->stats.queued += need;
+    return 0;
+}
+
+/* the backlog goes out first and only once routing is active */
+static int doip_flush (doip_conn_t *c)
+{
+    ssize_t n;
+
+    while (c->active && (c->tx_off < c->tx_len))
+    {
+        n = send (c->fd, c->tx_buf + c->tx_off, c->tx_len - c->tx_off, MSG_NOSIGNAL);
+        c->stats.calls++;
+        if (n < 0)
+        {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            {
+                return 0;
+            }
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror ("doip: send");
+            doip_close (c);
+            return -1;
+        }
+        c->stats.bytes += (uint64_t)n;
+        c->tx_off += (uint32_t)n;
+    }
+    if (c->tx_off == c->tx_len)
+    {
+        c->tx_off = 0;
+        c->tx_len = 0;
+    }
+    return 0;
+}
+
+/* header and address bytes from a stack buffer, data from where the caller has it, never joined */
+static int doip_send_msg (doip_conn_t *c, uint16_t type, const uint8_t *pre, uint32_t pre_len, const uint8_t *data, uint32_t len)
+{
+    uint8_t hdr[DOIP_HDR_LEN + 16];
+    struct iovec iov[2];
+    struct msghdr mh;
+    ssize_t n = 0;
+    int cnt = (len > 0) ? 2 : 1;
+
+    if ((c->fd < 0) || (doip_flush (c) != 0))
+    {
+        return -1;
+    }
+    hdr[0] = DOIP_VERSION;
+    hdr[1] = (uint8_t)~DOIP_VERSION;
+    put_u16(&hdr[2], type);
+    put_u32(&hdr[4], pre_len + len);
+    memcpy (&hdr[DOIP_HDR_LEN], pre, pre_len);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = DOIP_HDR_LEN + pre_len;
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = len;
+
+    /* diagnostic messages wait for routing activation, nothing may overtake the backlog */
+    if ((c->tx_len == 0) && (c->active || (type != DOIP_DIAG_MSG)))
+    {
+        memset (&mh, 0, sizeof(mh));
+        mh.msg_iov = iov;
+        mh.msg_iovlen = cnt;
+        do
+        {
+            n = sendmsg (c->fd, &mh, MSG_NOSIGNAL);
+            c->stats.calls++;
+        } while ((n < 0) && (errno == EINTR));
+        if (n < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                perror ("doip: sendmsg");
+                doip_close (c);
+                return -1;
+            }
+            n = 0;
+        }
+        c->stats.bytes += (uint64_t)n;
+    }
+    if ((uint32_t)n < iov[0].iov_len + len)
+    {
+        return doip_queue (c, iov, cnt, (uint32_t)n);
+    }
+    return 0;
+}
+
+static void doip_generic_nack (doip_conn_t *c, uint8_t code)
+{
+    printf ("doip: generic header nack 0x%02X sent, closing\n", code);
+    doip_send_msg (c, DOIP_GENERIC_NACK, &code, 1, NULL, 0);
+    doip_close (c);
+}
+
+static void doip_diag_reply (doip_conn_t *c, uint16_t type, uint8_t code)
+{
+    uint8_t buf[5];
+
+    put_u16(&buf[0], c->sa);
+    put_u16(&buf[2], c->ta);
+    buf[4] = code;
+    doip_send_msg (c, type, buf, sizeof(buf), NULL, 0);
+}
+
+/* tester side, the request goes out at once, diagnostic messages queue until the entity answers */
+int doip_activate (doip_conn_t *c)
+{
+    uint8_t buf[7];
+
+    put_u16(&buf[0], c->sa);
+    buf[2] = 0x00;      /* default activation */
+    memset (&buf[3], 0, 4);
+    return doip_send_msg (c, DOIP_ROUTING_REQ, buf, sizeof(buf), NULL, 0);
+}
+
+/* one message, the UDS length for a diagnostic message, 0 when it was handled here, -1 when the connection went */
+static int doip_handle (doip_conn_t *c, uint16_t type, const uint8_t *p, uint32_t len, uint8_t *payload)
+{
+    uint8_t buf[9];
+
+    switch (type)
+    {
+        case DOIP_ROUTING_REQ:
+            if (!c->entity)
+            {
+                break;
+            }
+            if (len < 7)
+            {
+                doip_generic_nack (c, DOIP_NACK_LENGTH);
+                return -1;
+            }
+            c->ta = get_u16((void *)p);
+            c->active = 1;
+            put_u16(&buf[0], c->ta);
+            put_u16(&buf[2], c->sa);
+            buf[4] = DOIP_ROUTING_OK;
+            memset (&buf[5], 0, 4);
+            return doip_send_msg (c, DOIP_ROUTING_RSP, buf, sizeof(buf), NULL, 0);
+
+        case DOIP_ROUTING_RSP:
+            if (c->entity)
+            {
+                break;
+            }
+            if (len < 5)
+            {
+                doip_generic_nack (c, DOIP_NACK_LENGTH);
+                return -1;
+            }
+            if (p[4] != DOIP_ROUTING_OK)
+            {
+                printf ("doip: routing activation refused, code 0x%02X\n", p[4]);
+                doip_close (c);
+                return -1;
+            }
+            c->active = 1;
+            return doip_flush (c);
+
+        case DOIP_DIAG_MSG:
+            if (len <= 4)
+            {
+                doip_generic_nack (c, DOIP_NACK_LENGTH);
+                return -1;
+            }
+            if (!c->active || (get_u16((void *)p) != c->ta))
+            {
+                doip_diag_reply (c, DOIP_DIAG_NACK, DOIP_DIAG_BAD_SA);
+                return 0;
+            }
+            if (get_u16((void *)&p[2]) != c->sa)
+            {
+                doip_diag_reply (c, DOIP_DIAG_NACK, DOIP_DIAG_BAD_TA);
+                return 0;
+            }
+            if (c->entity)
+            {
+                doip_diag_reply (c, DOIP_DIAG_ACK, 0x00);
+            }
+            memcpy (payload, &p[4], len - 4);
+            return (int)(len - 4);
+
+        case DOIP_DIAG_ACK:
+            c->stats.acks++;
+            return 0;
+
+        case DOIP_DIAG_NACK:
+            printf ("doip: diagnostic message refused, code 0x%02X\n", (len >= 5) ? p[4] : 0);
+            return 0;
+
+        case DOIP_GENERIC_NACK:
+            printf ("doip: generic header nack 0x%02X received\n", (len >= 1) ? p[0] : 0);
+            return 0;
+    }
+    doip_generic_nack (c, DOIP_NACK_TYPE);
+    return -1;
+}
+
+/* the next diagnostic message in payload, 0 when none is complete yet or the connection is gone */
+int doip_receive (doip_conn_t *c, uint8_t *payload)
+{
+    uint32_t avail, len;
+    uint8_t *m;
+    ssize_t n;
+    int ret;
+
+    if ((c->fd < 0) || (doip_flush (c) != 0))
+    {
+        return 0;
+    }
+    for (;;)
+    {
+        avail = c->rx_len - c->rx_off;
+        m = c->rx_buf + c->rx_off;
+        if (avail >= DOIP_HDR_LEN)
+        {
+            if ((m[0] != DOIP_VERSION) || (m[1] != (uint8_t)~DOIP_VERSION))
+            {
+                doip_generic_nack (c, DOIP_NACK_PATTERN);
+                return 0;
+            }
+            len = get_u32(&m[4]);
+            if (len > 4 + c->max_len)
+            {
+                doip_generic_nack (c, DOIP_NACK_TOO_LARGE);
+                return 0;
+            }
+            if (avail >= DOIP_HDR_LEN + len)
+            {
+                c->rx_off += DOIP_HDR_LEN + len;
+                ret = doip_handle (c, get_u16(&m[2]), &m[DOIP_HDR_LEN], len, payload);
+                if (ret != 0)
+                {
+                    return (ret > 0) ? ret : 0;
+                }
+                continue;
+            }
+        }
+        if (c->rx_off > 0)
+        {
+            memmove (c->rx_buf, m, avail);
+            c->rx_off = 0;
+            c->rx_len = avail;
+        }
+        n = recv (c->fd, c->rx_buf + c->rx_len, c->rx_cap - c->rx_len, 0);
+        if (n == 0)
+        {
+            printf ("doip: connection closed by the peer\n");
+            doip_close (c);
+            return 0;
+        }
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                perror ("doip: recv");
+                doip_close (c);
+            }
+            return 0;
+        }
+        c->rx_len += (uint32_t)n;
+    }
+}
+
+/* a UDS message as a diagnostic message from sa to ta */
+int doip_send (doip_conn_t *c, const uint8_t *data, uint32_t len)
+{
+    uint8_t addr[4];
+
+    put_u16(&addr[0], c->sa);
+    put_u16(&addr[2], c->ta);
+    if (doip_send_msg (c, DOIP_DIAG_MSG, addr, sizeof(addr), data, len) != 0)
+    {
+        return -1;
+    }
+    c->stats.msgs++;
+    return 0;
+}
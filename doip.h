@@ -0,0 +1,64 @@
+#ifndef _DOIP_H_
+#define _DOIP_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+
+/*
+    ISO 13400-2 over TCP, one connection between a tester and a DoIP entity
+    header  : version 02, inverse FD, payload type (2), payload length (4)
+    0005    : routing activation request    SA (2), activation type (1), reserved (4)
+    0006    : routing activation response   tester (2), entity (2), code (1), reserved (4)
+    8001    : diagnostic message            SA (2), TA (2), UDS message
+    8002/3  : diagnostic message ack / nack SA (2), TA (2), code (1)
+*/
+#define DOIP_PORT               13400
+#define DOIP_HDR_LEN            8
+#define DOIP_ADDR_TESTER        0x0E00
+#define DOIP_ADDR_ENTITY        0x1001
+
+typedef struct
+{
+    uint64_t msgs;                  /* diagnostic messages sent */
+    uint64_t bytes;                 /* bytes handed to the socket, headers included */
+    uint64_t calls;                 /* sendmsg() calls */
+    uint64_t queued;                /* bytes the socket refused and that were copied to the backlog */
+    uint64_t acks;                  /* diagnostic message acks received */
+} doip_stats_t;
+
+typedef struct
+{
+    int fd;                         /* -1 when not connected */
+    int entity;                     /* 1 on the ECU side, it activates routing and acks diagnostic messages */
+    int active;                     /* routing activated */
+    uint16_t sa;                    /* own logical address */
+    uint16_t ta;                    /* peer logical address */
+    uint8_t *rx_buf;
+    uint32_t rx_cap;
+    uint32_t rx_off;                /* first unparsed byte */
+    uint32_t rx_len;
+    uint8_t *tx_buf;                /* backlog the socket did not take yet, sent before anything new */
+    uint32_t tx_cap;
+    uint32_t tx_off;
+    uint32_t tx_len;
+    uint32_t max_len;               /* largest UDS message accepted */
+    doip_stats_t stats;
+} doip_conn_t;
+
+int doip_listen (uint16_t *port);
+int doip_connect (uint16_t port);
+int doip_accept (int listen_fd);
+int doip_conn_init (doip_conn_t *c, int fd, int entity, uint16_t sa, uint16_t ta, uint32_t max_len);
+int doip_activate (doip_conn_t *c);
+int doip_send (doip_conn_t *c, const uint8_t *data, uint32_t len);
+int doip_receive (doip_conn_t *c, uint8_t *payload);
+void doip_close (doip_conn_t *c);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+#!/bin/sh
+# recovery paths of the tester driven by injected faults (-F of the UDS_FAULT_TEST build), run by 'make test'
+# every case runs in a scratch directory and must leave out.dat equal to the image
+
+BIN="$(cd "$(dirname "$0")" && pwd)/uds_fw_update_test"
+KEY=000102030405060708090a0b0c0d0e0f
+DIR=$(mktemp -d)
+FAIL=0
+
+trap 'rm -rf "$DIR"' EXIT
+cd "$DIR" || exit 1
+
+head -c 3000000 /dev/urandom > a.bin
+head -c 6000000 /dev/urandom > b.bin
+cp a.bin c.bin
+printf 'XYZ' | dd of=c.bin bs=1 seek=1000000 conv=notrunc 2>/dev/null
+
+# name, image, expected line in the log, tester options
+run ()
+{
+    name=$1 img=$2 want=$3
+    shift 3
+    "$BIN" "$@" "$img" > log.txt 2>&1
+    if cmp -s out.dat "$img" && grep -a -q -- "$want" log.txt; then
+        echo "PASS  $name"
+    else
+        echo "FAIL  $name ($*)"
+        grep -a "fault:\|resend\|damaged\|timeout\|abort" log.txt | head -5
+        FAIL=1
+    fi
+}
+
+fresh ()
+{
+    rm -f out.dat out.jnl
+}
+
+fresh; run "block tag, damaged block resent"        a.bin "damaged on the way, resending" -c -F flip,3
+fresh; run "streamed, damaged block read again"     a.bin "damaged on the way, resending" -s -c -L 65000 -F flip,17
+fresh; run "window, refused block resent"           a.bin "not acknowledged, resending"   -c -w 8 -F flip,5
+fresh; run "window, lost block resent"              a.bin "resending from offset"         -w 8 -F drop,5
+fresh; run "window, compressed block resent"        a.bin "resending from compressed"     -z -c -w 8 -F flip,5
+fresh; run "window, encrypted block resent"         a.bin "not acknowledged, resending"   -K $KEY -c -w 8 -F flip,5
+fresh; run "hash tree repair of a damaged block"    a.bin "damaged blocks of"             -F flip,3
+fresh; run "hash tree repair, encrypted"            a.bin "damaged blocks of"             -K $KEY -w 8 -F flip,7
+
+# a lost block in stop-and-wait ends the run, -r goes on from the journal
+fresh; "$BIN" -L 65000 -F drop,80 b.bin > /dev/null 2>&1
+run "resume after a lost block"                     b.bin "resume: "                      -L 65000 -r
+
+# the installed image differs from c.bin in one block
+fresh; "$BIN" a.bin > /dev/null 2>&1
+run "delta update of one changed block"             c.bin "unchanged data skipped"        -d
+
+exit $FAIL
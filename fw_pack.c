@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "img_src.h"
+#include "fwpkg.h"
+#include "uds_hal.h"
+
+#define FW_START_ADDR   0x1D0000
+#define SEND_BLK_SIZE   3836    /* fills the default maxNumberOfBlockLength 0xF02 with the -c CRC32 trailer */
+
+static void usage (char *name)
+{
+    printf ("usage: %s [-a start_addr] [-b block_len] image package\n", name);
+    printf ("  -a    download address (default 0x%X)\n", FW_START_ADDR);
+    printf ("  -b    TransferData payload bytes per block (default %u)\n", SEND_BLK_SIZE);
+}
+
+int main (int argc, char *argv[])
+{
+    uint32_t start_addr = FW_START_ADDR;
+    uint32_t block_len = SEND_BLK_SIZE;
+    img_src_t src;
+    int c;
+
+    while ((c = getopt(argc, argv, "a:b:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'a':
+                start_addr = (uint32_t)strtoul (optarg, NULL, 0);
+                break;
+            case 'b':
+                block_len = (uint32_t)strtoul (optarg, NULL, 0);
+                break;
+            default:
+                usage (argv[0]);
+                return 1;
+        }
+    }
+    if ((argc - optind != 2) || (block_len == 0) || (block_len > UDS_TP_MAX_LEN - 2))
+    {
+        usage (argv[0]);
+        return 1;
+    }
+    if (img_src_open (&src, argv[optind], 0) != 0)
+    {
+        printf ("[%s] open fail\n", argv[optind]);
+        return 1;
+    }
+    if (fwpkg_write (argv[optind + 1], src.base, (uint32_t)src.size, start_addr, block_len) != 0)
+    {
+        printf ("[%s] write fail\n", argv[optind + 1]);
+        img_src_close (&src);
+        return 1;
+    }
+    printf ("[%s] %u bytes, addr 0x%08X, block %u -> [%s]\n", argv[optind], (uint32_t)src.size, start_addr, block_len, argv[optind + 1]);
+    img_src_close (&src);
+    return 0;
+}
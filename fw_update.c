@@ -1,30 +1,129 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include "uds.h"
 #include "util.h"
 #include "fw_update.h"
+#include "img_src.h"
+#include "verify.h"
+#include "fwpkg.h"
+#include "image_fmt.h"
+#include "lz.h"
+#include "aes.h"
+#include "merkle.h"
 
 #define FW_START_ADDR   0x1D0000
-#define SEND_BLK_SIZE   1024
+#define BLANK_BLK_SIZE  1024    /* granularity of the erased block scan */
+#define SEG_MAX_GAP     4096    /* segments closer than this are sent as one, gap filled with 0xFF */
+#define ERASED_VALUE    0xFF
+#define BLANK_MIN_RUN   (4 * BLANK_BLK_SIZE) /* shorter erased runs cost more in RequestDownload round trips than they save */
+#define WINDOW_P2_MS    50      /* P2 server, a window without any answer for this long lost a request */
+#define BLK_RETRY       3       /* resends of the same block before the download is given up */
+#define BLK_TAG_LEN     4       /* CRC32 trailer of a TransferData request, negotiated with DID_BLOCK_TAG */
+#define Z_BATCH_LEN     (64 * LZ_CHUNK_LEN) /* raw bytes handed to the compression workers at a time */
+#define MK_REPAIR_MAX   2       /* damaged ranges downloaded again before a failed CheckMemory aborts */
+#define MK_STACK_LEN    (MERKLE_MAX_LEVELS * MERKLE_FANOUT) /* mismatching nodes not opened yet, depth first */
+#define LOCAL_COPY_MAX  (16 * 1024 * 1024)  /* bytes per local copy request, well inside the response timeout */
 
+/* a TransferData block in flight, with the digests as they were before it */
 typedef struct
 {
-    uint8_t *buf;
+    uint32_t off;               /* segment offset */
+    uint32_t end;
+    uint32_t blk_idx;           /* package block */
+    uint32_t z_off;             /* compressed stream offset */
+    uint8_t  seq;
+    uint32_t crc;
+    verify_ctx_t vfy;
+    sha256_ctx_t sha;
+} fw_blk_t;
+
+typedef struct
+{
+    img_src_t src;
+    const fwpkg_hdr_t *pkg;         /* precompiled package, frames are sent straight from the mapping */
+    img_seg_list_t segs;            /* one RequestDownload cycle per segment */
+    uint32_t seg_idx;
+    const uint8_t *seg_data;        /* current segment, NULL when read through src */
+    uint32_t addr;
     uint32_t len;
+    uint32_t dl_start;              /* current RequestDownload region, offset in the segment */
+    uint32_t dl_end;
+    uint32_t blk_max;               /* TransferData payload per block, from maxNumberOfBlockLength */
+    uint8_t *tx_buf;                /* TransferData request, grown to blk_max + 2 */
+    uint32_t tx_cap;
     uint32_t crc;
+    const verify_alg_t *vfy_alg;    /* CheckMemory algorithm, negotiated with DID_VERIFY_ALG */
+    verify_ctx_t vfy;
+    sha256_ctx_t sha;               /* always sent with ROUTINE_CHECK_DIGEST */
     uint32_t send_len;
+    uint32_t blk_idx;
     uint32_t tm;
-    uint8_t  blk_cnt;
+    uint8_t  blk_cnt;                /* ISO 14229 block sequence counter, 1 .. 0xFF, 0x00, .. */
+    uint32_t window;                /* TransferData blocks in flight, negotiated with DID_TRANSFER_WINDOW */
+    uint32_t inflight;              /* requests sent and not answered yet */
+    uint32_t win_head;              /* oldest unacknowledged block in win[] */
+    uint32_t win_count;
+    int rewind;                     /* a block was refused, resend from it once the window has drained */
+    uint32_t retry;
+    uint32_t tag_len;               /* per-block CRC32 trailer, 0 when not negotiated */
+    int resend;                     /* stop-and-wait, the server refused the block's trailer */
+    uint32_t jnl_addr;              /* server transfer journal, read with DID_TRANSFER_JOURNAL */
+    uint32_t jnl_size;
+    uint32_t jnl_off;               /* committed bytes, 0 when there is nothing to resume */
+    uint32_t jnl_crc;
+    uint8_t  comp;                  /* dataFormatIdentifier compression method, 0 = plain */
+    uint8_t *z_buf;                 /* compressed stream from z_base, the blocks not acknowledged yet and the next batch */
+    uint32_t z_cap;
+    uint32_t z_len;
+    uint32_t z_base;
+    uint32_t z_off;                 /* next byte to send, counted from the start of the region's stream */
+    uint8_t  enc;                   /* dataFormatIdentifier encryption method, 0 = plain */
+    uint8_t  nonce[AES_BLOCK_LEN];  /* fresh for every run, written with DID_CIPHER_NONCE */
+    uint8_t  ctr[AES_BLOCK_LEN];    /* first counter block of the current region */
+    uint32_t ctr_seq;               /* encrypted downloads the server accepted under this nonce */
+    int delta;                      /* patch the installed image, only changed blocks are sent */
+    uint8_t *same;                  /* per hash block of the segment, 1 when the server already holds it */
+    uint32_t same_cnt;              /* 0 when there is no block hash table */
+    uint32_t same_blk;
+    int mk_walk;                    /* after a failed CheckMemory, 1 : searching the hash tree, 2 : patching the damage */
+    uint32_t mk_tries;
+    merkle_t mk;                    /* the segment's tree, built when it is needed */
+    uint8_t  mk_lvl[MK_STACK_LEN];
+    uint32_t mk_idx[MK_STACK_LEN];
+    uint32_t mk_sp;
+    uint32_t mk_bad;                /* damaged leaves found */
+    int readback;                   /* every region is uploaded again and compared after its download */
+    int rb_active;                  /* TransferData answers carry the upload */
+    uint32_t rb_off;                /* segment offset of the next uploaded block */
+    uint32_t rb_end;
+    uint32_t rb_max;                /* upload payload per block */
+    uint8_t  rb_cnt;
+    int local;                      /* plain regions are copied by the server from the image file */
+    int local_sock;                 /* connection to the server's local socket, -1 until the first copy */
+    uint32_t local_len;             /* bytes of the local copy request in flight */
+    fw_blk_t win[FW_WINDOW_MAX];
     uint32_t state;
     int done;
 } fw_info_t;
 
 static fw_info_t s_fw;
+static uint32_t s_opt;
+static uint32_t s_seg_gap = SEG_MAX_GAP;
+static uint32_t s_window = 1;
 static int s_res;
 static uint32_t s_key;
+static aes_key_t s_aes;
+static uint32_t s_aes_len;
+
+static void update_digest (const uint8_t *data, uint32_t len);
 
 static char *err_str (uint8_t code)
 {
@@ -51,6 +150,7 @@ static char *err_str (uint8_t code)
         case 0x7F: return "service not supported in active session";
         case 0x92: return "voltage too high";
         case 0x93: return "voltage too low";
+        case 0xF0: return "block crc trailer mismatch";
     }
     return "unknown error code";
 }
@@ -58,13 +158,75 @@ static char *err_str (uint8_t code)
 static void INT_tp_send (uint8_t *buf, uint32_t len)
 {
     s_res = -1;
-    uds_tp_send_client(buf, (uint16_t)len);
+    uds_tp_send_client(buf, len);
     s_fw.tm = os_get_tick();
     s_fw.state++;
 }
 
-static void parse_read_did (uint8_t *data, uint16_t size)
+/* TransferData, in windowed mode the state stays put and the answer is taken by parse_transfer_data() */
+static void send_block (uint8_t *buf, uint32_t len)
+{
+    if (s_fw.window <= 1)
+    {
+        INT_tp_send (buf, len);
+        return;
+    }
+    if (uds_tp_send_client(buf, len) != 0)
+    {
+        s_res = 0x7F;
+        s_fw.state++;
+        return;
+    }
+    s_fw.inflight++;
+    s_fw.tm = os_get_tick();
+}
+
+/* block hashes of the installed image, compared with the segment once it arrives */
+static void parse_block_hash (uint8_t *data, uint32_t size)
+{
+    uint32_t blk_len = get_u32(&data[3]);
+    uint32_t n = (size - 7) / 4, i, pos, len, same = 0;
+    uint8_t *map;
+
+    if ((blk_len == 0) || (size != 7 + n * 4) || (n != (s_fw.len + blk_len - 1) / blk_len))
+    {
+        printf ("client: block hash table does not match the segment, every block is sent\n");
+        return;
+    }
+    map = realloc (s_fw.same, n);
+    if (map == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        pos = i * blk_len;
+        len = my_min(s_fw.len - pos, blk_len);
+        map[i] = ((uint32_t)xxh64 (s_fw.seg_data + pos, len, 0) == get_u32(&data[7 + i * 4]));
+        same += map[i];
+    }
+    s_fw.same = map;
+    s_fw.same_cnt = n;
+    s_fw.same_blk = blk_len;
+    printf ("client: %u of %u blocks (%u bytes) changed\n", n - same, n, blk_len);
+}
+
+static void parse_read_did (uint8_t *data, uint32_t size)
 {
+    if ((size >= 7) && (get_u16(&data[1]) == DID_BLOCK_HASH))
+    {
+        parse_block_hash (data, size);
+        return;
+    }
+    if ((size == 19) && (get_u16(&data[1]) == DID_TRANSFER_JOURNAL))
+    {
+        s_fw.jnl_addr = get_u32(&data[3]);
+        s_fw.jnl_size = get_u32(&data[7]);
+        s_fw.jnl_off  = get_u32(&data[11]);
+        s_fw.jnl_crc  = get_u32(&data[15]);
+        printf ("client: journal 0x%08X, %u of %u bytes committed\n", s_fw.jnl_addr, s_fw.jnl_off, s_fw.jnl_size);
+        return;
+    }
     if (size != 7)
     {
         printf ("client: read did response length error, expected = 7, received = %u\n", size);
@@ -90,7 +252,277 @@ static uint32_t uds_calc_secure_access_key (uint32_t seedx, uint32_t seedy)
     return key;
 }
 
-static void uds_parse_client (uint8_t *data, uint16_t size)
+static int merkle_push (uint32_t level, uint32_t idx)
+{
+    if (s_fw.mk_sp == MK_STACK_LEN)
+    {
+        return -1;
+    }
+    s_fw.mk_lvl[s_fw.mk_sp] = (uint8_t)level;
+    s_fw.mk_idx[s_fw.mk_sp++] = idx;
+    return 0;
+}
+
+/* the server's root, every leaf starts out as good */
+static int parse_merkle_root (uint8_t *data, uint32_t size)
+{
+    uint8_t d[MERKLE_DIGEST_LEN];
+    merkle_t *t = &s_fw.mk;
+    uint8_t *map;
+
+    if ((size != 26) || (get_u32(&data[5]) != s_fw.addr) || (get_u32(&data[9]) != s_fw.len) ||
+        (get_u32(&data[13]) != MERKLE_LEAF_LEN) || (data[17] != t->levels))
+    {
+        printf ("client: hash tree does not cover the segment\n");
+        return -1;
+    }
+    put_u64(d, merkle_level (t, t->levels - 1)[0]);
+    if (memcmp (d, &data[18], sizeof(d)) == 0)
+    {
+        printf ("client: hash tree root matches, nothing to repair\n");
+        return -1;
+    }
+    map = realloc (s_fw.same, t->cnt[0]);
+    if (map == NULL)
+    {
+        return -1;
+    }
+    memset (map, 1, t->cnt[0]);
+    s_fw.same = map;
+    s_fw.same_cnt = t->cnt[0];
+    s_fw.same_blk = MERKLE_LEAF_LEN;
+    if (t->levels == 1)
+    {
+        s_fw.same[0] = 0;
+        s_fw.mk_bad++;
+        return 0;
+    }
+    return merkle_push (t->levels - 1, 0);
+}
+
+/* children of a mismatching node, the ones that differ are opened next or are damaged leaves */
+static int parse_merkle_node (uint8_t *data, uint32_t size)
+{
+    uint8_t d[MERKLE_DIGEST_LEN];
+    merkle_t *t = &s_fw.mk;
+    const uint64_t *child;
+    uint32_t level, idx, first, n, i;
+
+    if ((size >= 5) && (data[4] == MERKLE_ROOT_QUERY))
+    {
+        return parse_merkle_root (data, size);
+    }
+    if (size < 10)
+    {
+        return -1;
+    }
+    level = data[4];
+    idx = get_u32(&data[5]);
+    n = data[9];
+    if ((level == 0) || (level >= t->levels) || (idx >= t->cnt[level]) || (size != 10 + n * MERKLE_DIGEST_LEN) ||
+        (n != my_min(t->cnt[level - 1] - idx * MERKLE_FANOUT, MERKLE_FANOUT)))
+    {
+        printf ("client: hash tree node response format error\n");
+        return -1;
+    }
+    child = merkle_level (t, level - 1);
+    first = idx * MERKLE_FANOUT;
+    for (i = n; i-- > 0; )
+    {
+        put_u64(d, child[first + i]);
+        if (memcmp (d, &data[10 + i * MERKLE_DIGEST_LEN], sizeof(d)) == 0)
+        {
+            continue;
+        }
+        if (level == 1)
+        {
+            s_fw.same[first + i] = 0;
+            s_fw.mk_bad++;
+        }
+        else if (merkle_push (level - 1, first + i) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void parse_routine_control (uint8_t *data, uint32_t size)
+{
+    uint16_t routine_id;
+
+    if (size < 5)
+    {
+        printf ("client: routine control response length error (%u)\n", size);
+        return;
+    }
+    routine_id = get_u16(&data[2]);
+    if (routine_id == ROUTINE_MERKLE_NODE)
+    {
+        if (parse_merkle_node (data, size) != 0)
+        {
+            s_res = 0x7F;
+        }
+        return;
+    }
+    if ((routine_id == ROUTINE_CHECK_MEMORY) && (data[4] != 0))
+    {
+        printf ("client: check memory fail (%s)\n", s_fw.vfy_alg->name);
+        s_res = 0x7F;
+        return;
+    }
+    if ((routine_id == ROUTINE_CHECK_DIGEST) && (data[4] != 0))
+    {
+        printf ("client: check digest fail (sha256)\n");
+        s_res = 0x7F;
+        return;
+    }
+    if (routine_id == ROUTINE_LOCAL_COPY)
+    {
+        if (data[4] != 0)
+        {
+            printf ("client: local copy fail\n");
+            s_res = 0x7F;
+            return;
+        }
+        /* the digests still run over the image, CheckMemory compares them with what the server stored */
+        update_digest (s_fw.seg_data + s_fw.send_len, s_fw.local_len);
+        s_fw.send_len += s_fw.local_len;
+        s_fw.local_len = 0;
+    }
+    printf ("client: okay, SID=0x%02X, routine=0x%04X\n", data[0] - 0x40, routine_id);
+}
+
+/* lengthFormatIdentifier + maxNumberOfBlockLength, the block length counts SID and sequence counter, 0 on error */
+static uint32_t parse_block_len (uint8_t *data, uint32_t size, uint32_t min_len)
+{
+    uint32_t n = data[1] >> 4;
+    uint32_t blk_len = 0;
+    uint32_t i;
+
+    if ((n == 0) || (n > 4) || (size != 2 + n))
+    {
+        printf ("client: SID=0x%02X response format error (lfi = 0x%02X, len = %u)\n", data[0] - 0x40, data[1], size);
+        s_res = 0x7F;
+        return 0;
+    }
+    for (i = 0; i < n; i++)
+    {
+        blk_len = (blk_len << 8) | data[2 + i];
+    }
+    blk_len = my_min(blk_len, uds_tp_max_len());
+    if (blk_len < min_len)
+    {
+        printf ("client: maxNumberOfBlockLength too small (%u)\n", blk_len);
+        s_res = 0x7F;
+        return 0;
+    }
+    printf ("client: okay, SID=0x%02X, maxNumberOfBlockLength = %u\n", data[0] - 0x40, blk_len);
+    return blk_len;
+}
+
+static void parse_request_download (uint8_t *data, uint32_t size)
+{
+    uint32_t blk_len = parse_block_len (data, size, 3 + s_fw.tag_len);
+
+    if (blk_len != 0)
+    {
+        s_fw.blk_max = blk_len - 2 - s_fw.tag_len;
+    }
+}
+
+static void parse_request_upload (uint8_t *data, uint32_t size)
+{
+    uint32_t blk_len = parse_block_len (data, size, 3);
+
+    if (blk_len != 0)
+    {
+        s_fw.rb_max = blk_len - 2;
+        s_fw.rb_active = 1;
+    }
+}
+
+/* an uploaded block against the image, the first differing byte is reported */
+static void parse_upload_data (uint8_t *data, uint32_t size)
+{
+    uint32_t len = size - 2;
+    uint32_t i;
+
+    if ((data[1] != s_fw.rb_cnt) || (len == 0) || (len > my_min(s_fw.rb_max, s_fw.rb_end - s_fw.rb_off)))
+    {
+        printf ("client: upload block seq = %u, len = %u unexpected\n", data[1], len);
+        s_res = 0x7F;
+        return;
+    }
+    i = mem_diff (s_fw.seg_data + s_fw.rb_off, &data[2], len);
+    if (i < len)
+    {
+        printf ("client: readback mismatch at 0x%08X (segment offset %u), %02X expected, %02X read\n",
+                s_fw.addr + s_fw.rb_off + i, s_fw.rb_off + i, s_fw.seg_data[s_fw.rb_off + i], data[2 + i]);
+        s_res = 0x7F;
+        return;
+    }
+    s_fw.rb_off += len;
+    s_fw.rb_cnt++;
+}
+
+/* negative TransferData responses the client recovers from by sending the block again */
+static int is_block_resend (uint8_t *data, uint32_t size)
+{
+    if ((size != 3) || (data[1] != SRV_TRANSFER_DATA))
+    {
+        return 0;
+    }
+    return (data[2] == ERROR_REQUEST_SEQUENCE) || (data[2] == ERROR_WRONG_BLOCK_SEQUENCE_COUNTER) ||
+           ((data[2] == ERROR_BLOCK_TAG_MISMATCH) && (s_fw.tag_len != 0));
+}
+
+/* where a block starts, a compressed region is resent from its stream position */
+static const char *blk_where (void)
+{
+    return s_fw.comp ? "compressed offset" : "offset";
+}
+
+static uint32_t blk_off (const fw_blk_t *blk)
+{
+    return s_fw.comp ? blk->z_off : blk->off;
+}
+
+/* windowed mode, responses come in sequence order and each one answers the oldest block in flight */
+static void parse_transfer_data (uint8_t *data, uint32_t size)
+{
+    fw_blk_t *blk = &s_fw.win[s_fw.win_head];
+    uint32_t i;
+
+    s_fw.inflight--;
+    s_fw.tm = os_get_tick();
+    if (s_fw.rewind)
+    {
+        return;     /* answers to blocks sent after the refused one */
+    }
+    if (data[0] == 0x7F)
+    {
+        printf ("client: block seq = %u not acknowledged, resending from %s %u\n", blk->seq, blk_where (), blk_off (blk));
+        s_fw.rewind = 1;
+        return;
+    }
+    /* the server only accepts blocks in order, an answer covers every older block whose answer was lost */
+    for (i = 0; i < s_fw.win_count; i++)
+    {
+        blk = &s_fw.win[(s_fw.win_head + i) % FW_WINDOW_MAX];
+        if (blk->seq == data[1])
+        {
+            s_fw.win_head = (s_fw.win_head + i + 1) % FW_WINDOW_MAX;
+            s_fw.win_count -= i + 1;
+            s_fw.inflight = s_fw.win_count;
+            s_fw.retry = 0;
+            img_src_release (&s_fw.src, blk->end);
+            return;
+        }
+    }
+}
+
+static void uds_parse_client (uint8_t *data, uint32_t size)
 {
     uint8_t sid;
     uint16_t P2, P2_;
@@ -102,6 +534,22 @@ static void uds_parse_client (uint8_t *data, uint16_t size)
         return;
     }
 
+    if ((s_fw.window > 1) && (s_fw.inflight > 0) && (((data[0] & ~0x40) == SRV_TRANSFER_DATA) || (data[0] == 0x7F)))
+    {
+        /* only a sequence error is recovered, anything else aborts the download */
+        if ((data[0] != 0x7F) || is_block_resend (data, size))
+        {
+            parse_transfer_data (data, size);
+            return;
+        }
+    }
+    if ((s_fw.window <= 1) && (data[0] == 0x7F) && is_block_resend (data, size) && (data[2] == ERROR_BLOCK_TAG_MISMATCH))
+    {
+        printf ("client: block seq = %u damaged on the way, resending\n", s_fw.win[0].seq);
+        s_fw.resend = 1;
+        return;
+    }
+
     s_res = data[0];
     if (data[0] == 0x7F)
     {
@@ -131,14 +579,32 @@ static void uds_parse_client (uint8_t *data, uint16_t size)
             }
             break;
 
+        case SRV_ROUTINE_CONTROL:
+            parse_routine_control (data, size);
+            break;
+
+        case SRV_REQUEST_DOWNLOAD:
+            parse_request_download (data, size);
+            break;
+
+        case SRV_REQUEST_UPLOAD:
+            parse_request_upload (data, size);
+            break;
+
         case SRV_ECU_RESET:
         case SRV_COMM_CONTROL:
         case SRV_WRITE_DID:
+        case SRV_TRANSFER_DATA:
+            if (s_fw.rb_active)
+            {
+                parse_upload_data (data, size);
+                break;
+            }
+            printf ("client: okay, SID=0x%02X\n", data[0] - 0x40);
+            break;
+
         case SRV_TESTER_PRESENT:
         case SRV_CONTROL_DTC:
-        case SRV_ROUTINE_CONTROL:
-        case SRV_REQUEST_DOWNLOAD:
-        case SRV_TRANSFER_DATA:
         case SRV_REQ_TRANSFER_EXIT:
             printf ("client: okay, SID=0x%02X\n", data[0] - 0x40);
             break;
@@ -205,6 +671,16 @@ static void send_key (uint32_t key)
     INT_tp_send (cmd, sizeof(cmd));
 }
 
+/* the digests cover the whole erased segment, even when it is downloaded in several regions */
+static void digest_reset (void)
+{
+    s_fw.send_len = 0;
+    s_fw.blk_idx = 0;
+    s_fw.crc = (s_fw.pkg != NULL) ? s_fw.pkg->crc32 : 0xFFFFFFFF;
+    s_fw.vfy_alg->init (&s_fw.vfy);
+    sha256_init (&s_fw.sha);
+}
+
 static void erase_memory (uint32_t file_start_addr, uint32_t file_size)
 {
     uint8_t cmd[13];
@@ -217,6 +693,7 @@ static void erase_memory (uint32_t file_start_addr, uint32_t file_size)
     put_u32(&cmd[5], file_start_addr);
     put_u32(&cmd[9], file_size);
     INT_tp_send (cmd, sizeof(cmd));
+    digest_reset ();
 }
 
 static void request_download (uint32_t file_start_addr, uint32_t file_size)
@@ -224,142 +701,1078 @@ static void request_download (uint32_t file_start_addr, uint32_t file_size)
     uint8_t cmd[11];
 
     cmd[0] = SRV_REQUEST_DOWNLOAD;
-    cmd[1] = 0x00;
+    cmd[1] = (uint8_t)((s_fw.comp << 4) | s_fw.enc);
     cmd[2] = 0x44;
     put_u32(&cmd[3], file_start_addr);
     put_u32(&cmd[7], file_size);
     INT_tp_send (cmd, sizeof(cmd));
-    s_fw.send_len = 0;
+    if (s_fw.enc)
+    {
+        aes_ctr_start (s_fw.ctr, s_fw.nonce, s_fw.ctr_seq, file_start_addr);
+    }
+    s_fw.blk_cnt = 1;
+    s_fw.inflight = 0;
+    s_fw.win_head = 0;
+    s_fw.win_count = 0;
+    s_fw.rewind = 0;
+    s_fw.retry = 0;
 }
 
-static void transfer_data (void *buf, uint32_t len)
+static void update_digest (const uint8_t *data, uint32_t len)
 {
-    static uint8_t cmd[2 + 4095];
-
-    if (len > 4095)
+    s_fw.crc = make_crc32(s_fw.crc, data, len);
+    if ((s_fw.vfy_alg->id != VERIFY_CRC32) && (s_fw.vfy_alg->id != VERIFY_SHA256))
     {
-        printf ("transfer_data: length error (%u)\n", len);
-        return;
+        s_fw.vfy_alg->update (&s_fw.vfy, data, len);
     }
-    cmd[0] = SRV_TRANSFER_DATA;
-    cmd[1] = s_fw.blk_cnt;
-    s_fw.blk_cnt++;
-    memcpy (&cmd[2], buf, len);
-    INT_tp_send (cmd, len + 2);
+    sha256_update (&s_fw.sha, data, len);
 }
 
-static void request_transfer_exit (void)
+/* erased blocks from off on, the last block of the segment may be partial */
+static uint32_t blank_run (uint32_t off)
 {
-    uint8_t cmd[1];
+    uint32_t run = mem_span (s_fw.seg_data + off, s_fw.len - off, ERASED_VALUE);
 
-    cmd[0] = SRV_REQ_TRANSFER_EXIT;
-    INT_tp_send (cmd, sizeof(cmd));
+    if (off + run == s_fw.len)
+    {
+        return run;
+    }
+    return run - (run % BLANK_BLK_SIZE);
 }
 
-static void check_memory (uint32_t start_addr, uint32_t size, uint32_t crc)
+/* blocks from off on the server already holds, patch mode */
+static uint32_t same_run (uint32_t off)
 {
-    uint8_t cmd[18];
+    uint32_t pos;
 
-    cmd[0] = SRV_ROUTINE_CONTROL;
-    cmd[1] = ROUTINE_START;
-    cmd[2] = (uint8_t)(ROUTINE_CHECK_MEMORY >> 8);
-    cmd[3] = (uint8_t)(ROUTINE_CHECK_MEMORY & 0xFF);
-    put_u32(&cmd[4], start_addr);
-    put_u32(&cmd[8], size);
-    put_u16(&cmd[12], sizeof(crc));
-    put_u32(&cmd[14], crc);
-    INT_tp_send (cmd, sizeof(cmd));
+    if (off % s_fw.same_blk)
+    {
+        return 0;
+    }
+    for (pos = off; (pos < s_fw.len) && s_fw.same[pos / s_fw.same_blk]; pos += s_fw.same_blk)
+    {
+    }
+    return my_min(pos, s_fw.len) - off;
 }
 
-static void check_prog_dependency (void)
+/* data from off on that does not have to be sent, whole blocks except at the end of the segment */
+static uint32_t skip_run (uint32_t off)
 {
-    uint8_t cmd[4];
-
-    cmd[0] = SRV_ROUTINE_CONTROL;
-    cmd[1] = ROUTINE_START;
-    cmd[2] = (uint8_t)(ROUTINE_CHECK_PROG_DEPENDENCY >> 8);
-    cmd[3] = (uint8_t)(ROUTINE_CHECK_PROG_DEPENDENCY & 0xFF);
-    INT_tp_send (cmd, sizeof(cmd));
+    return (s_fw.same_cnt != 0) ? same_run (off) : blank_run (off);
 }
 
-static void ecu_reset (uint8_t reset_type)
+/* skip the erased or unchanged run at send_len and size the next region up to the following one, 0 when nothing is left */
+static uint32_t next_region (void)
 {
-    uint8_t cmd[2];
+    uint32_t pos, run;
+    uint32_t blk = (s_fw.same_cnt != 0) ? s_fw.same_blk : BLANK_BLK_SIZE;
+    uint32_t min_run = (s_fw.same_cnt != 0) ? s_fw.same_blk : BLANK_MIN_RUN;
 
-    cmd[0] = SRV_ROUTINE_CONTROL;
-    cmd[1] = reset_type;
-    INT_tp_send (cmd, sizeof(cmd));
+    /* a patched segment is not erased, without a hash table every byte goes out */
+    if ((s_fw.seg_data == NULL) || (s_fw.pkg != NULL) ||
+        ((s_fw.same_cnt == 0) && ((s_opt & FW_OPT_SEND_BLANK) || s_fw.delta)))
+    {
+        return s_fw.len - s_fw.send_len;
+    }
+    run = skip_run (s_fw.send_len);
+    if ((run >= min_run) || (s_fw.send_len + run == s_fw.len))
+    {
+        update_digest (s_fw.seg_data + s_fw.send_len, run);
+        s_fw.send_len += run;
+    }
+    for (pos = s_fw.send_len; pos < s_fw.len; pos += my_min (run, s_fw.len - pos))
+    {
+        run = skip_run (pos);
+        if ((run >= min_run) || ((run > 0) && (pos + run == s_fw.len)))
+        {
+            break;
+        }
+        if (run == 0)
+        {
+            run = blk - (pos % blk);
+        }
+    }
+    if ((pos > s_fw.send_len) && ((pos != s_fw.len) || (s_fw.send_len != 0)))
+    {
+        printf ("region 0x%08X, len = %u (%s data skipped)\n", s_fw.addr + s_fw.send_len, pos - s_fw.send_len,
+                (s_fw.same_cnt != 0) ? "unchanged" : "erased");
+    }
+    return pos - s_fw.send_len;
 }
 
-/*********************************************************************/
-/*********************************************************************/
-/*********************************************************************/
-
-void uds_poll_client (void)
+/* TransferData request of len bytes, the buffer only grows */
+static uint8_t *tx_reserve (uint32_t len)
 {
-    static uint8_t buf[4096];
-    uint16_t len;
+    uint8_t *cmd;
 
-    len = uds_tp_receive_client(buf);
-    if (len > 0)
+    if (len > s_fw.tx_cap)
     {
-        uds_parse_client(buf, len);
+        cmd = realloc (s_fw.tx_buf, len);
+        if (cmd == NULL)
+        {
+            printf ("transfer_data: out of memory (%u)\n", len);
+            s_res = 0x7F;
+            s_fw.state++;
+            return NULL;
+        }
+        s_fw.tx_buf = cmd;
+        s_fw.tx_cap = len;
     }
+    return s_fw.tx_buf;
 }
 
-static uint32_t file_length (FILE *fp)
+/* AES-CTR over a payload about to be sent, positioned by where it starts in the region's stream */
+static void encrypt_payload (uint8_t *data, uint32_t len)
 {
-    struct stat buf;
+    if (s_fw.enc)
+    {
+        aes_ctr_xor (&s_aes, s_fw.ctr, s_fw.comp ? s_fw.z_off : s_fw.send_len - s_fw.dl_start, data, len);
+    }
+}
 
-    fstat(fileno(fp), &buf);
-    return (uint32_t)buf.st_size;
+/* SID, sequence counter and the optional CRC32 trailer around the len payload bytes at cmd[2] */
+static void send_data_block (uint8_t *cmd, uint32_t len)
+{
+    encrypt_payload (&cmd[2], len);
+    cmd[0] = SRV_TRANSFER_DATA;
+    cmd[1] = s_fw.blk_cnt;
+    s_fw.blk_cnt++;
+    if (s_fw.tag_len != 0)
+    {
+        put_u32(&cmd[2 + len], make_crc32(0xFFFFFFFF, &cmd[2], len));
+    }
+    send_block (cmd, 2 + len + s_fw.tag_len);
 }
 
-void fw_update_start (char *file)
+/* next len bytes of the image, read straight from the image source into the request */
+static void transfer_data (uint32_t len)
 {
-    FILE *fp;
-    uint32_t len;
+    uint8_t *cmd = tx_reserve (2 + len + s_fw.tag_len);
 
-    fp = fopen (file, "rb");
-    if (fp != NULL)
+    if (cmd == NULL)
     {
-        len = file_length (fp);
-        if (len > 0)
-        {
-            s_fw.buf = malloc (len);
-            if (s_fw.buf != NULL)
-            {
-                len = fread (s_fw.buf, 1, len, fp);
-                fclose (fp);
-                s_fw.len = len;
-                s_fw.send_len = 0;
-                s_fw.state = 10;
-                s_fw.crc = make_crc32(0xFFFFFFFF, s_fw.buf, len);
-                s_fw.done = 0;
-            }
-        }
+        return;
     }
-    else
+    if (s_fw.seg_data != NULL)
     {
-        printf ("[%s] open fail\n", file);
+        memcpy (&cmd[2], s_fw.seg_data + s_fw.send_len, len);
     }
+    else if (img_src_read (&s_fw.src, s_fw.send_len, &cmd[2], len) != 0)
+    {
+        printf ("transfer_data: image read error (offset %u)\n", s_fw.send_len);
+        s_res = 0x7F;
+        s_fw.state++;
+        return;
+    }
+    update_digest (&cmd[2], len);
+    send_data_block (cmd, len);
+}
+
+/* compressed bytes ready to send */
+static uint32_t z_avail (void)
+{
+    return s_fw.z_base + s_fw.z_len - s_fw.z_off;
+}
+
+/*
+    compressed download, the region goes through lz_compress() Z_BATCH_LEN raw bytes at a time as the blocks need them,
+    send_len and the digests follow the compressor, z_buf only keeps what may still be sent again
+*/
+static int compress_batch (void)
+{
+    static uint8_t buf[Z_BATCH_LEN];
+    const uint8_t *raw;
+    uint32_t keep, len, need;
+    uint8_t *z;
+
+    keep = (s_fw.win_count > 0) ? s_fw.win[s_fw.win_head].z_off : s_fw.z_off;
+    memmove (s_fw.z_buf, s_fw.z_buf + (keep - s_fw.z_base), s_fw.z_base + s_fw.z_len - keep);
+    s_fw.z_len -= keep - s_fw.z_base;
+    s_fw.z_base = keep;
+
+    len = my_min(s_fw.dl_end - s_fw.send_len, Z_BATCH_LEN);
+    need = s_fw.z_len + lz_stream_bound (len);
+    if (need > s_fw.z_cap)
+    {
+        z = realloc (s_fw.z_buf, need);
+        if (z == NULL)
+        {
+            printf ("compress: out of memory (%u)\n", need);
+            return -1;
+        }
+        s_fw.z_buf = z;
+        s_fw.z_cap = need;
+    }
+    if (s_fw.seg_data != NULL)
+    {
+        raw = s_fw.seg_data + s_fw.send_len;
+    }
+    else if (img_src_read (&s_fw.src, s_fw.send_len, buf, len) == 0)
+    {
+        raw = buf;
+    }
+    else
+    {
+        printf ("compress: image read error (offset %u)\n", s_fw.send_len);
+        return -1;
+    }
+    update_digest (raw, len);
+    s_fw.z_len += lz_compress (raw, len, s_fw.z_buf + s_fw.z_len, 0);
+    img_src_release (&s_fw.src, s_fw.send_len + len);
+    s_fw.send_len += len;
+    if (s_fw.send_len == s_fw.dl_end)
+    {
+        printf ("region 0x%08X: %u bytes compressed to %u\n", s_fw.addr + s_fw.dl_start, s_fw.dl_end - s_fw.dl_start,
+                s_fw.z_base + s_fw.z_len);
+    }
+    return 0;
+}
+
+/* next block of the compressed region, a batch is compressed first when less than a block is ready */
+static void transfer_compressed (void)
+{
+    uint8_t *cmd;
+    uint32_t len;
+
+    while ((z_avail () < s_fw.blk_max) && (s_fw.send_len < s_fw.dl_end))
+    {
+        if (compress_batch () != 0)
+        {
+            s_res = 0x7F;
+            s_fw.state++;
+            return;
+        }
+    }
+    len = my_min(z_avail (), s_fw.blk_max);
+    cmd = tx_reserve (2 + len + s_fw.tag_len);
+    if (cmd == NULL)
+    {
+        return;
+    }
+    memcpy (&cmd[2], s_fw.z_buf + (s_fw.z_off - s_fw.z_base), len);
+    send_data_block (cmd, len);
+    s_fw.z_off += len;
+}
+
+/* bytes of the region still to go, counted in the compressed stream when compressing */
+static uint32_t transfer_left (void)
+{
+    if (s_fw.comp)
+    {
+        return z_avail () + (s_fw.dl_end - s_fw.send_len);
+    }
+    return s_fw.dl_end - s_fw.send_len;
+}
+
+/* package mode, the next pre-encoded request goes out as stored */
+static uint32_t transfer_frame (void)
+{
+    const fwpkg_blk_t *blk = fwpkg_block (s_fw.pkg, s_fw.blk_idx);
+    uint8_t *frame = (uint8_t *)s_fw.pkg + blk->frame_off;
+
+    if (blk->frame_len > s_fw.blk_max + 2)
+    {
+        printf ("transfer_frame: package block %u bytes, server takes %u%s\n", blk->raw_len, s_fw.blk_max,
+                (s_fw.tag_len != 0) ? " with the -c trailer, repack with fw_pack -b" : "");
+        s_res = 0x7F;
+        s_fw.state++;
+        return 0;
+    }
+    if ((s_fw.tag_len != 0) || (frame[1] != s_fw.blk_cnt) || s_fw.enc)
+    {
+        /* the trailer is the block crc stored in the package index, a resumed download numbers its blocks from 1 */
+        frame = tx_reserve (blk->frame_len + s_fw.tag_len);
+        if (frame == NULL)
+        {
+            return 0;
+        }
+        memcpy (frame, (uint8_t *)s_fw.pkg + blk->frame_off, blk->frame_len);
+        frame[1] = s_fw.blk_cnt;
+        encrypt_payload (&frame[2], blk->raw_len);
+        if (s_fw.tag_len != 0)
+        {
+            put_u32(&frame[blk->frame_len], s_fw.enc ? make_crc32(0xFFFFFFFF, &frame[2], blk->raw_len) : blk->crc32);
+        }
+    }
+    s_fw.blk_idx++;
+    s_fw.blk_cnt++;
+    send_block (frame, blk->frame_len + s_fw.tag_len);
+    return blk->raw_len;
+}
+
+static void transfer_next (void)
+{
+    uint32_t blk_len;
+
+    if (s_fw.pkg != NULL)
+    {
+        s_fw.send_len += transfer_frame ();
+        return;
+    }
+    if (s_fw.comp)
+    {
+        transfer_compressed ();
+        return;
+    }
+    blk_len = my_min ((s_fw.dl_end - s_fw.send_len), s_fw.blk_max);
+    transfer_data (blk_len);
+    s_fw.send_len += blk_len;
+}
+
+static void blk_save (fw_blk_t *blk)
+{
+    blk->off = s_fw.send_len;
+    blk->blk_idx = s_fw.blk_idx;
+    blk->z_off = s_fw.z_off;
+    blk->seq = s_fw.blk_cnt;
+    blk->crc = s_fw.crc;
+    blk->vfy = s_fw.vfy;
+    blk->sha = s_fw.sha;
+}
+
+/* back to where blk was sent from, it goes out again with the same sequence counter */
+static void blk_restore (const fw_blk_t *blk)
+{
+    s_fw.blk_idx = blk->blk_idx;
+    s_fw.z_off = blk->z_off;
+    s_fw.blk_cnt = blk->seq;
+    if (s_fw.comp)
+    {
+        return;     /* send_len and the digests follow the compressor, it is not run again */
+    }
+    s_fw.send_len = blk->off;
+    s_fw.crc = blk->crc;
+    s_fw.vfy = blk->vfy;
+    s_fw.sha = blk->sha;
+}
+
+static int local_connect (void)
+{
+    struct sockaddr_un sa;
+    socklen_t len;
+    int fd;
+
+    memset (&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf (&sa.sun_path[1], sizeof(sa.sun_path) - 1, LOCAL_SOCKET_NAME, (int)getpid());
+    len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen (&sa.sun_path[1]));
+    fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if ((fd >= 0) && (connect (fd, (struct sockaddr *)&sa, len) != 0))
+    {
+        close (fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* the image fd with the file range the next request covers, it is queued ahead of the request */
+static int local_send_fd (uint64_t off, uint32_t len)
+{
+    uint8_t buf[LOCAL_MSG_LEN];
+    union { struct cmsghdr hdr; char space[CMSG_SPACE(sizeof(int))]; } ctl;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+
+    memcpy (&buf[0], &off, sizeof(off));
+    memcpy (&buf[8], &len, sizeof(len));
+    memset (&ctl, 0, sizeof(ctl));
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy (CMSG_DATA(cm), &s_fw.src.fd, sizeof(int));
+    return (sendmsg (s_fw.local_sock, &msg, MSG_NOSIGNAL) == (ssize_t)sizeof(buf)) ? 0 : -1;
+}
+
+/* the server copies the next part of the region from the image file, -1 when it has to go as TransferData */
+static int local_copy (void)
+{
+    uint8_t cmd[12];
+    uintptr_t base = (uintptr_t)s_fw.src.base;
+    uintptr_t data = (uintptr_t)s_fw.seg_data;
+    uint32_t len;
+
+    /* only bytes that sit in the file as they are sent, not a parsed hex or srec segment */
+    if ((s_fw.src.type != IMG_SRC_MMAP) || (s_fw.src.fd < 0) || (s_fw.seg_data == NULL) ||
+        (data < base) || (data + s_fw.len > base + s_fw.src.size))
+    {
+        return -1;
+    }
+    if (s_fw.local_sock < 0)
+    {
+        s_fw.local_sock = local_connect ();
+        if (s_fw.local_sock < 0)
+        {
+            printf ("client: no local server, sending TransferData\n");
+            s_fw.local = 0;
+            return -1;
+        }
+    }
+    len = my_min(s_fw.dl_end - s_fw.send_len, LOCAL_COPY_MAX);
+    if (local_send_fd ((uint64_t)(data - base) + s_fw.send_len, len) != 0)
+    {
+        printf ("client: local socket closed, sending TransferData\n");
+        s_fw.local = 0;
+        return -1;
+    }
+    cmd[0] = SRV_ROUTINE_CONTROL;
+    cmd[1] = ROUTINE_START;
+    cmd[2] = (uint8_t)(ROUTINE_LOCAL_COPY >> 8);
+    cmd[3] = (uint8_t)(ROUTINE_LOCAL_COPY & 0xFF);
+    put_u32(&cmd[4], s_fw.addr + s_fw.send_len);
+    put_u32(&cmd[8], len);
+    s_fw.local_len = len;
+    INT_tp_send (cmd, sizeof(cmd));
+    return 0;
+}
+
+/* keep up to window blocks of the region in flight, after a refused block go back to it */
+static void transfer_window (void)
+{
+    fw_blk_t *blk;
+
+    if (uds_tp_busy_client())
+    {
+        s_fw.tm = os_get_tick();    /* P2 runs from the last frame of a request, not from handing it over */
+    }
+    if ((s_fw.inflight > 0) && ((os_get_tick() - s_fw.tm) >= WINDOW_P2_MS))
+    {
+        /* requests, or their answers, that were lost on the way */
+        if (!s_fw.rewind)
+        {
+            printf ("client: no answer to block seq = %u, resending from %s %u\n", s_fw.win[s_fw.win_head].seq, blk_where (),
+                    blk_off (&s_fw.win[s_fw.win_head]));
+        }
+        s_fw.inflight = 0;
+        s_fw.rewind = 1;
+    }
+    if (s_fw.rewind && (s_fw.inflight == 0) && (++s_fw.retry > BLK_RETRY))
+    {
+        s_res = 0x7F;
+    }
+    if (s_res == 0x7F)
+    {
+        s_fw.state++;   /* wait_response() reports and aborts */
+        return;
+    }
+    if (s_fw.rewind)
+    {
+        if (s_fw.inflight > 0)
+        {
+            return;
+        }
+        blk_restore (&s_fw.win[s_fw.win_head]);
+        s_fw.win_count = 0;
+        s_fw.rewind = 0;
+    }
+    while ((s_fw.win_count < s_fw.window) && (transfer_left () > 0))
+    {
+        blk = &s_fw.win[(s_fw.win_head + s_fw.win_count) % FW_WINDOW_MAX];
+        blk_save (blk);
+        transfer_next ();
+        if (s_fw.state != 44)
+        {
+            return;
+        }
+        blk->end = s_fw.send_len;
+        s_fw.win_count++;
+    }
+    if ((transfer_left () == 0) && (s_fw.win_count == 0))
+    {
+        s_fw.state = 47;
+    }
+}
+
+static void request_transfer_exit (void)
+{
+    uint8_t cmd[1];
+
+    cmd[0] = SRV_REQ_TRANSFER_EXIT;
+    INT_tp_send (cmd, sizeof(cmd));
+    s_fw.rb_active = 0;
+}
+
+/* the region just downloaded, compared block by block as it comes back */
+static void request_upload (uint32_t start, uint32_t end)
+{
+    uint8_t cmd[11];
+
+    cmd[0] = SRV_REQUEST_UPLOAD;
+    cmd[1] = 0x00;
+    cmd[2] = 0x44;
+    put_u32(&cmd[3], s_fw.addr + start);
+    put_u32(&cmd[7], end - start);
+    INT_tp_send (cmd, sizeof(cmd));
+    s_fw.rb_off = start;
+    s_fw.rb_end = end;
+    s_fw.rb_cnt = 1;
+}
+
+static void upload_block (void)
+{
+    uint8_t cmd[2];
+
+    cmd[0] = SRV_TRANSFER_DATA;
+    cmd[1] = s_fw.rb_cnt;
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+static void write_did_verify_alg (uint8_t alg_id)
+{
+    uint8_t cmd[4];
+
+    cmd[0] = SRV_WRITE_DID;
+    cmd[1] = (uint8_t)(DID_VERIFY_ALG >> 8);
+    cmd[2] = (uint8_t)(DID_VERIFY_ALG & 0xFF);
+    cmd[3] = alg_id;
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+static void write_did_transfer_window (uint8_t blocks)
+{
+    uint8_t cmd[4];
+
+    cmd[0] = SRV_WRITE_DID;
+    cmd[1] = (uint8_t)(DID_TRANSFER_WINDOW >> 8);
+    cmd[2] = (uint8_t)(DID_TRANSFER_WINDOW & 0xFF);
+    cmd[3] = blocks;
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+static void read_journal (void)
+{
+    uint8_t cmd[3];
+
+    cmd[0] = SRV_READ_DID;
+    cmd[1] = (uint8_t)(DID_TRANSFER_JOURNAL >> 8);
+    cmd[2] = (uint8_t)(DID_TRANSFER_JOURNAL & 0xFF);
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+/* the segment is programmed in place instead of erased */
+static void write_did_patch_region (uint32_t addr, uint32_t size)
+{
+    uint8_t cmd[11];
+
+    cmd[0] = SRV_WRITE_DID;
+    cmd[1] = (uint8_t)(DID_BLOCK_HASH >> 8);
+    cmd[2] = (uint8_t)(DID_BLOCK_HASH & 0xFF);
+    put_u32(&cmd[3], addr);
+    put_u32(&cmd[7], size);
+    INT_tp_send (cmd, sizeof(cmd));
+    digest_reset ();
+}
+
+static void read_block_hash (void)
+{
+    uint8_t cmd[3];
+
+    cmd[0] = SRV_READ_DID;
+    cmd[1] = (uint8_t)(DID_BLOCK_HASH >> 8);
+    cmd[2] = (uint8_t)(DID_BLOCK_HASH & 0xFF);
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+static void write_did_cipher_nonce (void)
+{
+    uint8_t cmd[3 + AES_BLOCK_LEN];
+
+    cmd[0] = SRV_WRITE_DID;
+    cmd[1] = (uint8_t)(DID_CIPHER_NONCE >> 8);
+    cmd[2] = (uint8_t)(DID_CIPHER_NONCE & 0xFF);
+    memcpy (&cmd[3], s_fw.nonce, AES_BLOCK_LEN);
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+static void write_did_block_tag (uint8_t on)
+{
+    uint8_t cmd[4];
+
+    cmd[0] = SRV_WRITE_DID;
+    cmd[1] = (uint8_t)(DID_BLOCK_TAG >> 8);
+    cmd[2] = (uint8_t)(DID_BLOCK_TAG & 0xFF);
+    cmd[3] = on;
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+static void image_sha256 (uint8_t *digest)
+{
+    if (s_fw.pkg != NULL)
+    {
+        memcpy (digest, s_fw.pkg->sha256, SHA256_DIGEST_LEN);
+    }
+    else
+    {
+        sha256_final (&s_fw.sha, digest);
+    }
+}
+
+/* verify data : legacy 4 byte CRC32, otherwise algorithm id + digest */
+static void check_memory (uint32_t start_addr, uint32_t size)
+{
+    uint8_t cmd[14 + 1 + VERIFY_MAX_DIGEST];
+    uint16_t vlen;
+
+    cmd[0] = SRV_ROUTINE_CONTROL;
+    cmd[1] = ROUTINE_START;
+    cmd[2] = (uint8_t)(ROUTINE_CHECK_MEMORY >> 8);
+    cmd[3] = (uint8_t)(ROUTINE_CHECK_MEMORY & 0xFF);
+    put_u32(&cmd[4], start_addr);
+    put_u32(&cmd[8], size);
+    if (s_fw.vfy_alg->id == VERIFY_CRC32)
+    {
+        vlen = sizeof(s_fw.crc);
+        put_u32(&cmd[14], s_fw.crc);
+    }
+    else if (s_fw.vfy_alg->id == VERIFY_SHA256)
+    {
+        vlen = 1 + SHA256_DIGEST_LEN;
+        cmd[14] = VERIFY_SHA256;
+        image_sha256 (&cmd[15]);
+    }
+    else
+    {
+        vlen = 1 + s_fw.vfy_alg->digest_len;
+        cmd[14] = s_fw.vfy_alg->id;
+        s_fw.vfy_alg->final (&s_fw.vfy, &cmd[15]);
+    }
+    put_u16(&cmd[12], vlen);
+    INT_tp_send (cmd, 14 + vlen);
+}
+
+static void merkle_query (uint8_t level, uint32_t idx)
+{
+    uint8_t cmd[9];
+
+    cmd[0] = SRV_ROUTINE_CONTROL;
+    cmd[1] = ROUTINE_START;
+    cmd[2] = (uint8_t)(ROUTINE_MERKLE_NODE >> 8);
+    cmd[3] = (uint8_t)(ROUTINE_MERKLE_NODE & 0xFF);
+    cmd[4] = level;
+    put_u32(&cmd[5], idx);
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+/* CheckMemory failed, 0 when the damage can be searched for and downloaded again */
+static int merkle_start (void)
+{
+    if ((s_fw.seg_data == NULL) || (s_fw.pkg != NULL) || (s_fw.mk_tries >= MK_REPAIR_MAX))
+    {
+        return -1;
+    }
+    merkle_reset (&s_fw.mk);
+    if ((merkle_update (&s_fw.mk, s_fw.seg_data, s_fw.len) != 0) || (merkle_build (&s_fw.mk) != 0))
+    {
+        return -1;
+    }
+    printf ("client: searching the damaged blocks, %u levels of %u leaves\n", s_fw.mk.levels, s_fw.mk.cnt[0]);
+    s_fw.mk_tries++;
+    s_fw.mk_sp = 0;
+    s_fw.mk_bad = 0;
+    s_fw.mk_walk = 1;
+    merkle_push (MERKLE_ROOT_QUERY, 0);
+    return 0;
+}
+
+/* open the next mismatching node, the damaged leaves are patched once none is left */
+static void merkle_next (void)
+{
+    if (s_fw.mk_sp > 0)
+    {
+        s_fw.mk_sp--;
+        merkle_query (s_fw.mk_lvl[s_fw.mk_sp], s_fw.mk_idx[s_fw.mk_sp]);
+        return;
+    }
+    printf ("client: %u damaged blocks of %u bytes, downloading them again\n", s_fw.mk_bad, MERKLE_LEAF_LEN);
+    s_fw.mk_walk = 2;
+    write_did_patch_region (s_fw.addr, s_fw.len);
+}
+
+static void check_digest (void)
+{
+    uint8_t cmd[4 + SHA256_DIGEST_LEN];
+
+    cmd[0] = SRV_ROUTINE_CONTROL;
+    cmd[1] = ROUTINE_START;
+    cmd[2] = (uint8_t)(ROUTINE_CHECK_DIGEST >> 8);
+    cmd[3] = (uint8_t)(ROUTINE_CHECK_DIGEST & 0xFF);
+    image_sha256 (&cmd[4]);
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+static void check_prog_dependency (void)
+{
+    uint8_t cmd[4];
+
+    cmd[0] = SRV_ROUTINE_CONTROL;
+    cmd[1] = ROUTINE_START;
+    cmd[2] = (uint8_t)(ROUTINE_CHECK_PROG_DEPENDENCY >> 8);
+    cmd[3] = (uint8_t)(ROUTINE_CHECK_PROG_DEPENDENCY & 0xFF);
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+static void ecu_reset (uint8_t reset_type)
+{
+    uint8_t cmd[2];
+
+    cmd[0] = SRV_ECU_RESET;
+    cmd[1] = reset_type;
+    INT_tp_send (cmd, sizeof(cmd));
+}
+
+/*********************************************************************/
+/*********************************************************************/
+/*********************************************************************/
+
+void uds_poll_client (void)
+{
+    static uint8_t buf[UDS_TP_MAX_LEN];
+    int len;
+
+    while ((len = uds_tp_receive_client(buf)) > 0)
+    {
+        uds_parse_client(buf, len);
+    }
+}
+
+static void select_segment (uint32_t idx)
+{
+    s_fw.seg_idx = idx;
+    s_fw.addr = s_fw.segs.seg[idx].addr;
+    s_fw.len = s_fw.segs.seg[idx].len;
+    s_fw.seg_data = s_fw.segs.seg[idx].data;
+    if (s_fw.segs.count > 1)
+    {
+        printf ("segment %u/%u: addr = 0x%08X, len = %u\n", idx + 1, s_fw.segs.count, s_fw.addr, s_fw.len);
+    }
+}
+
+/* digest the first off bytes of the segment as if they had been sent, 0 when they match the journal crc */
+static int resume_skip (uint32_t off)
+{
+    static uint8_t buf[64 * 1024];
+    const fwpkg_blk_t *blk;
+    uint32_t pos, len, crc;
+
+    if (s_fw.pkg != NULL)
+    {
+        /* the package digests are stored, only the crc of the committed blocks is worked out */
+        crc = 0xFFFFFFFF;
+        for (pos = 0; pos < off; pos += blk->raw_len)
+        {
+            blk = fwpkg_block (s_fw.pkg, s_fw.blk_idx++);
+            crc = make_crc32(crc, (uint8_t *)s_fw.pkg + blk->frame_off + 2, blk->raw_len);
+        }
+        s_fw.send_len = off;
+        return ((pos == off) && (crc == s_fw.jnl_crc)) ? 0 : -1;
+    }
+    for (pos = 0; pos < off; pos += len)
+    {
+        len = my_min(off - pos, sizeof(buf));
+        if (s_fw.seg_data != NULL)
+        {
+            update_digest (s_fw.seg_data + pos, len);
+            continue;
+        }
+        if (img_src_read (&s_fw.src, pos, buf, len) != 0)
+        {
+            return -1;
+        }
+        update_digest (buf, len);
+        img_src_release (&s_fw.src, pos + len);
+    }
+    s_fw.send_len = off;
+    return (s_fw.crc == s_fw.jnl_crc) ? 0 : -1;
+}
+
+/* continue the segment the journal names from its committed offset, the segments before it are done */
+static int resume_download (void)
+{
+    uint32_t idx, off = s_fw.jnl_off;
+
+    s_fw.jnl_off = 0;
+    for (idx = 0; idx < s_fw.segs.count; idx++)
+    {
+        if ((s_fw.segs.seg[idx].addr == s_fw.jnl_addr) && (s_fw.segs.seg[idx].len == s_fw.jnl_size))
+        {
+            break;
+        }
+    }
+    if ((idx == s_fw.segs.count) || (off > s_fw.jnl_size))
+    {
+        printf ("journal: 0x%08X is not a segment of this image, full download\n", s_fw.jnl_addr);
+        return -1;
+    }
+    select_segment (idx);
+    digest_reset ();
+    if (resume_skip (off) == 0)
+    {
+        printf ("resume: 0x%08X, %u of %u bytes already committed\n", s_fw.addr, off, s_fw.len);
+        s_fw.state += 2;    /* no erase, straight to RequestDownload */
+        return 0;
+    }
+    printf ("journal: image differs from the committed data, full download\n");
+    if ((s_fw.seg_data == NULL) && (s_fw.pkg == NULL))
+    {
+        /* the stream can not go back to offset 0 */
+        s_res = 0x7F;
+        s_fw.state++;
+        return 0;
+    }
+    select_segment (0);
+    digest_reset ();
+    return -1;
+}
+
+static void fw_update_finish (void)
+{
+    s_fw.pkg = NULL;
+    s_fw.seg_data = NULL;
+    img_seg_free (&s_fw.segs);
+    free (s_fw.tx_buf);
+    s_fw.tx_buf = NULL;
+    s_fw.tx_cap = 0;
+    free (s_fw.z_buf);
+    s_fw.z_buf = NULL;
+    s_fw.z_cap = 0;
+    free (s_fw.same);
+    s_fw.same = NULL;
+    s_fw.same_cnt = 0;
+    merkle_free (&s_fw.mk);
+    s_fw.mk_walk = 0;
+    s_fw.rb_active = 0;
+    if (s_fw.local_sock >= 0)
+    {
+        close (s_fw.local_sock);
+        s_fw.local_sock = -1;
+    }
+    img_src_close (&s_fw.src);
+    s_fw.done = 1;
+    s_fw.state = 0;
+}
+
+void fw_update_set_options (uint32_t opt)
+{
+    s_opt = opt;
+}
+
+int fw_update_set_verify (const char *name)
+{
+    const verify_alg_t *alg = verify_find_name (name);
+
+    if (alg == NULL)
+    {
+        return -1;
+    }
+    s_fw.vfy_alg = alg;
+    return 0;
+}
+
+void fw_update_set_seg_gap (uint32_t max_gap)
+{
+    s_seg_gap = max_gap;
+}
+
+int fw_update_set_key (const uint8_t *key, uint32_t len)
+{
+    if (aes_set_key (&s_aes, key, len) != 0)
+    {
+        return -1;
+    }
+    s_aes_len = len;
+    return 0;
+}
+
+int fw_update_set_window (uint32_t blocks)
+{
+    if ((blocks == 0) || (blocks > FW_WINDOW_MAX))
+    {
+        return -1;
+    }
+    s_window = blocks;
+    return 0;
+}
+
+static int load_segments (char *file, int fmt)
+{
+    int ret;
+
+    switch (fmt)
+    {
+        case IMG_FMT_IHEX:
+            ret = img_parse_ihex (file, &s_fw.segs);
+            break;
+        case IMG_FMT_SREC:
+            ret = img_parse_srec (file, &s_fw.segs);
+            break;
+        default:
+            if (img_src_open (&s_fw.src, file, 0) != 0)
+            {
+                return -1;
+            }
+            ret = img_parse_elf (s_fw.src.base, s_fw.src.size, &s_fw.segs);
+            break;
+    }
+    if ((ret != 0) || (img_seg_coalesce (&s_fw.segs, s_seg_gap, 0xFF) != 0))
+    {
+        return -1;
+    }
+    if (s_fw.segs.count == 0)
+    {
+        printf ("[%s] no loadable data\n", file);
+        return -1;
+    }
+    printf ("[%s] %s, %u segment(s)\n", file, img_fmt_str (fmt), s_fw.segs.count);
+    return 0;
+}
+
+static int load_image (char *file)
+{
+    uint32_t flags = 0;
+
+    if (s_opt & FW_OPT_POPULATE)
+    {
+        flags |= IMG_SRC_POPULATE;
+    }
+    if (s_opt & FW_OPT_HUGEPAGE)
+    {
+        flags |= IMG_SRC_HUGEPAGE;
+    }
+    if ((s_opt & FW_OPT_STREAM) && !fwpkg_probe (file))
+    {
+        flags |= IMG_SRC_STREAM;
+    }
+    if (img_src_open (&s_fw.src, file, flags) != 0)
+    {
+        printf ("[%s] open fail\n", file);
+        return -1;
+    }
+    if (s_fw.src.size == 0)
+    {
+        printf ("[%s] empty\n", file);
+        return -1;
+    }
+    if ((s_fw.src.base != NULL) && (s_fw.src.size >= sizeof(FWPKG_MAGIC) - 1) &&
+        (memcmp (s_fw.src.base, FWPKG_MAGIC, sizeof(FWPKG_MAGIC) - 1) == 0))
+    {
+        s_fw.pkg = fwpkg_check (s_fw.src.base, s_fw.src.size);
+        if (s_fw.pkg == NULL)
+        {
+            printf ("[%s] invalid package\n", file);
+            return -1;
+        }
+        if ((s_fw.vfy_alg->id != VERIFY_CRC32) && (s_fw.vfy_alg->id != VERIFY_SHA256))
+        {
+            printf ("[%s] package carries crc32/sha256 only, %s not used\n", file, s_fw.vfy_alg->name);
+            s_fw.vfy_alg = verify_find (VERIFY_CRC32);
+        }
+        printf ("[%s] package, %u bytes at 0x%08X, %u blocks\n", file, s_fw.pkg->image_len, s_fw.pkg->start_addr, s_fw.pkg->block_count);
+        /* frames are sent from the package, the segment has no data pointer */
+        return img_seg_add (&s_fw.segs, s_fw.pkg->start_addr, NULL, s_fw.pkg->image_len, 0);
+    }
+    printf ("[%s] %u bytes, %s\n", file, (uint32_t)s_fw.src.size, img_src_type_str (&s_fw.src));
+    /* s_fw.src.base is NULL when streaming, blocks are then pulled through img_src_read() */
+    return img_seg_add (&s_fw.segs, FW_START_ADDR, s_fw.src.base, (uint32_t)s_fw.src.size, 0);
+}
+
+void fw_update_start (char *file)
+{
+    int fmt, ret;
+
+    s_fw.done = 1;
+    s_fw.pkg = NULL;
+    s_fw.local_sock = -1;
+    if (s_fw.vfy_alg == NULL)
+    {
+        s_fw.vfy_alg = verify_find (VERIFY_CRC32);
+    }
+    fmt = img_fmt_probe (file);
+    if (fmt == IMG_FMT_RAW)
+    {
+        ret = load_image (file);
+    }
+    else
+    {
+        ret = load_segments (file, fmt);
+    }
+    if (ret != 0)
+    {
+        printf ("[%s] load fail\n", file);
+        fw_update_finish ();
+        return;
+    }
+    select_segment (0);
+    s_fw.window = s_window;
+    s_fw.tag_len = (s_opt & FW_OPT_BLOCK_TAG) ? BLK_TAG_LEN : 0;
+    s_fw.comp = (s_opt & FW_OPT_COMPRESS) ? DFI_COMPRESSION_LZ : 0;
+    s_fw.delta = (s_opt & FW_OPT_DELTA) ? 1 : 0;
+    s_fw.readback = (s_opt & FW_OPT_READBACK) ? 1 : 0;
+    if (s_fw.readback && ((s_fw.pkg != NULL) || (s_fw.seg_data == NULL)))
+    {
+        printf ("[%s] readback needs a mapped image, skipped\n", file);
+        s_fw.readback = 0;
+    }
+    if (s_fw.delta && ((s_fw.pkg != NULL) || (s_fw.seg_data == NULL)))
+    {
+        printf ("[%s] patching needs a mapped image, full download\n", file);
+        s_fw.delta = 0;
+    }
+    s_fw.enc = 0;
+    if (s_aes_len != 0)
+    {
+        /* CTR must never reuse a counter under the same key, every run takes a new nonce */
+        if (getrandom (s_fw.nonce, sizeof(s_fw.nonce), 0) != sizeof(s_fw.nonce))
+        {
+            printf ("[%s] no random nonce, not sent\n", file);
+            fw_update_finish ();
+            return;
+        }
+        s_fw.enc = (s_aes_len == 32) ? DFI_ENCRYPTION_AES256_CTR : DFI_ENCRYPTION_AES128_CTR;
+        s_fw.ctr_seq = 0;
+    }
+    if (s_fw.comp && (s_fw.pkg != NULL))
+    {
+        printf ("[%s] package frames are sent as stored, not compressed\n", file);
+        s_fw.comp = 0;
+    }
+    s_fw.local = (s_opt & FW_OPT_LOCAL) ? 1 : 0;
+    s_fw.local_len = 0;
+    if (s_fw.local && (s_fw.comp || s_fw.enc || (s_fw.pkg != NULL) || (s_fw.src.type != IMG_SRC_MMAP)))
+    {
+        /* the server stores the file's bytes as they are */
+        printf ("[%s] local copy needs a plain, mapped image, sending TransferData\n", file);
+        s_fw.local = 0;
+    }
+    s_fw.resend = 0;
+    s_fw.jnl_off = 0;
+    s_fw.send_len = 0;
+    s_fw.state = 10;
+    s_fw.done = 0;
 }
 
 static void wait_response (void)
 {
+    if (uds_tp_busy_client())
+    {
+        s_fw.tm = os_get_tick();
+    }
     if ((os_get_tick() - s_fw.tm) >= 1000)
     {
         printf ("response timeout\n");
-        s_fw.done = 1;
-        s_fw.state = 0;
+        fw_update_finish ();
     }
     if (s_res != -1)
     {
         if (s_res == 0x7F)
         {
             printf ("error, abort\n");
-            s_fw.done = 1;
-            s_fw.state = 0;
+            fw_update_finish ();
         }
         else
         {
@@ -446,69 +1859,317 @@ void fw_update_schedule (void)
             wait_response ();
             break;
         case 28:
-            erase_memory (FW_START_ADDR, s_fw.len);
+            if (s_fw.vfy_alg->id == VERIFY_CRC32)
+            {
+                s_fw.state += 2;
+            }
+            else
+            {
+                write_did_verify_alg (s_fw.vfy_alg->id);
+            }
             break;
         case 29:
             wait_response ();
             break;
         case 30:
-            request_download (FW_START_ADDR, s_fw.len);
+            if (s_fw.window <= 1)
+            {
+                s_fw.state += 2;
+            }
+            else
+            {
+                write_did_transfer_window ((uint8_t)s_fw.window);
+            }
             break;
         case 31:
+            if (s_res == 0x7F)
+            {
+                printf ("transfer window refused, stop-and-wait\n");
+                s_fw.window = 1;
+                s_res = 0;
+            }
             wait_response ();
             break;
         case 32:
-            blk_len = my_min ((s_fw.len - s_fw.send_len), SEND_BLK_SIZE);
-            transfer_data (&s_fw.buf[s_fw.send_len], blk_len);
-            s_fw.send_len += blk_len;
+            if (s_fw.tag_len == 0)
+            {
+                s_fw.state += 2;
+            }
+            else
+            {
+                write_did_block_tag (1);
+            }
             break;
         case 33:
+            if (s_res == 0x7F)
+            {
+                printf ("block crc trailer refused, sending without it\n");
+                s_fw.tag_len = 0;
+                s_res = 0;
+            }
             wait_response ();
             break;
         case 34:
-            if (s_fw.len == s_fw.send_len)
+            if (s_fw.enc == 0)
             {
-                s_fw.state++;
+                s_fw.state += 2;
             }
             else
             {
-                s_fw.state -= 2;
+                write_did_cipher_nonce ();
             }
             break;
         case 35:
-            request_transfer_exit ();
+            wait_response ();   /* a server without the nonce can not decrypt, no plain fallback */
             break;
         case 36:
-            wait_response ();
+            if (!(s_opt & FW_OPT_RESUME))
+            {
+                s_fw.state += 2;
+            }
+            else
+            {
+                read_journal ();
+            }
             break;
         case 37:
-            check_memory (FW_START_ADDR, s_fw.len, s_fw.crc);
+            if (s_res == 0x7F)
+            {
+                printf ("no transfer journal, full download\n");
+                s_res = 0;
+            }
+            wait_response ();
             break;
         case 38:
-            wait_response ();
+            s_fw.same_cnt = 0;
+            s_fw.mk_tries = 0;
+            if ((s_fw.jnl_off != 0) && (resume_download () == 0))
+            {
+                break;
+            }
+            if (s_fw.delta)
+            {
+                write_did_patch_region (s_fw.addr, s_fw.len);
+                break;
+            }
+            erase_memory (s_fw.addr, s_fw.len);
             break;
         case 39:
-            check_prog_dependency ();
+            if ((s_res == 0x7F) && s_fw.delta)
+            {
+                printf ("no installed image to patch, full download\n");
+                s_fw.delta = 0;
+                s_fw.state = 38;
+                break;
+            }
+            wait_response ();
             break;
         case 40:
-            wait_response ();
+            if (!s_fw.delta)
+            {
+                s_fw.state += 2;
+            }
+            else
+            {
+                read_block_hash ();
+            }
             break;
         case 41:
-            session_control (SESSION_EXTENDED);
+            wait_response ();
             break;
         case 42:
-            wait_response ();
+            blk_len = next_region ();
+            if (blk_len == 0)
+            {
+                s_fw.state = 55;    /* only erased data left */
+                break;
+            }
+            s_fw.dl_start = s_fw.send_len;
+            s_fw.dl_end = s_fw.send_len + blk_len;
+            request_download (s_fw.addr + s_fw.send_len, blk_len);
             break;
         case 43:
-            ecu_reset (HARD_RESET);
+            if ((s_res == 0x7F) && s_fw.comp)
+            {
+                printf ("compressed download refused, sending plain data\n");
+                s_fw.comp = 0;
+                s_fw.state = 42;
+                break;
+            }
+            wait_response ();
+            if ((s_fw.state == 44) && s_fw.enc)
+            {
+                s_fw.ctr_seq++;     /* a patch or repair download of the same region gets new keystream */
+            }
+            if (s_fw.comp)
+            {
+                s_fw.z_len = 0;
+                s_fw.z_base = 0;
+                s_fw.z_off = 0;
+            }
             break;
         case 44:
-            wait_response ();
+            if (s_fw.local && (local_copy () == 0))
+            {
+                break;
+            }
+            if (s_fw.window > 1)
+            {
+                transfer_window ();
+                break;
+            }
+            blk_save (&s_fw.win[0]);
+            transfer_next ();
             break;
         case 45:
+            if ((s_res == 0x7F) && (s_fw.local_len != 0))
+            {
+                printf ("local copy refused, sending TransferData\n");
+                s_fw.local = 0;
+                s_fw.local_len = 0;
+                s_res = 0;
+                s_fw.state = 44;
+                break;
+            }
+            if (s_fw.resend)
+            {
+                s_fw.resend = 0;
+                if (++s_fw.retry <= BLK_RETRY)
+                {
+                    blk_restore (&s_fw.win[0]);
+                    s_fw.state--;
+                    break;
+                }
+                s_res = 0x7F;
+            }
+            wait_response ();
+            break;
+        case 46:
+            s_fw.retry = 0;
+            img_src_release (&s_fw.src, s_fw.send_len);   /* acknowledged, a damaged block is read again until then */
+            if (transfer_left () == 0)
+            {
+                s_fw.state++;
+            }
+            else
+            {
+                s_fw.state -= 2;
+            }
+            break;
+        case 47:
+            request_transfer_exit ();
+            break;
+        case 48:
+            wait_response ();
+            break;
+        case 49:
+            if (!s_fw.readback)
+            {
+                s_fw.state += 6;
+                break;
+            }
+            request_upload (s_fw.dl_start, s_fw.dl_end);
+            break;
+        case 50:
+            wait_response ();
+            break;
+        case 51:
+            if (s_fw.rb_off == s_fw.rb_end)
+            {
+                s_fw.state += 2;
+                break;
+            }
+            upload_block ();
+            break;
+        case 52:
+            wait_response ();
+            if (s_fw.state == 53)
+            {
+                s_fw.state = 51;
+            }
+            break;
+        case 53:
+            printf ("client: readback 0x%08X, len = %u, same\n", s_fw.addr + s_fw.dl_start, s_fw.dl_end - s_fw.dl_start);
+            request_transfer_exit ();
+            break;
+        case 54:
+            wait_response ();
+            break;
+        case 55:
+            if (s_fw.send_len < s_fw.len)
+            {
+                s_fw.state = 42;    /* next region after an erased run */
+                break;
+            }
+            check_memory (s_fw.addr, s_fw.len);
+            break;
+        case 56:
+            if ((s_res == 0x7F) && (merkle_start () == 0))
+            {
+                s_res = 0;
+            }
+            wait_response ();
+            break;
+        case 57:
+            if (s_fw.mk_walk == 0)
+            {
+                s_fw.state += 2;
+            }
+            else
+            {
+                merkle_next ();
+            }
+            break;
+        case 58:
+            wait_response ();
+            if ((s_fw.state == 59) && (s_fw.mk_walk == 2))
+            {
+                s_fw.mk_walk = 0;
+                s_fw.state = 42;    /* the damaged blocks, CheckMemory follows */
+            }
+            else if ((s_fw.state == 59) && (s_fw.mk_walk == 1))
+            {
+                s_fw.state = 57;
+            }
+            break;
+        case 59:
+            check_digest ();
+            break;
+        case 60:
+            wait_response ();
+            break;
+        case 61:
+            if (s_fw.seg_idx + 1 < s_fw.segs.count)
+            {
+                select_segment (s_fw.seg_idx + 1);
+                s_fw.state = 38;
+            }
+            else
+            {
+                s_fw.state++;
+            }
+            break;
+        case 62:
+            check_prog_dependency ();
+            break;
+        case 63:
+            wait_response ();
+            break;
+        case 64:
+            session_control (SESSION_EXTENDED);
+            break;
+        case 65:
+            wait_response ();
+            break;
+        case 66:
+            ecu_reset (HARD_RESET);
+            break;
+        case 67:
+            wait_response ();
+            break;
+        case 68:
             printf ("done\n");
-            s_fw.done = 1;
-            s_fw.state = 0;
+            fw_update_finish ();
             break;
     }
 }
@@ -6,6 +6,7 @@
 #endif
 
 #include <inttypes.h>
+#include "uds_hal.h"
 
 #define SESSION_DEFAULT         0x01
 #define SESSION_PROGRAMMING     0x02
@@ -21,6 +22,7 @@
 #define SRV_CONTROL_DTC         0x85
 #define SRV_ROUTINE_CONTROL     0x31
 #define SRV_REQUEST_DOWNLOAD    0x34
+#define SRV_REQUEST_UPLOAD      0x35
 #define SRV_TRANSFER_DATA       0x36
 #define SRV_REQ_TRANSFER_EXIT   0x37
 
@@ -40,12 +42,31 @@
 #define ROUTINE_ERASE_MEMORY            0xFF00
 #define ROUTINE_CHECK_PROG_DEPENDENCY   0xFF01
 #define ROUTINE_CHECK_MEMORY            0x0200
+#define ROUTINE_CHECK_DIGEST            0x0201  /* SHA-256 of the download region */
+#define ROUTINE_MERKLE_NODE             0x0202  /* children digests of a hash tree node of the download region */
+#define ROUTINE_LOCAL_COPY              0x0203  /* the next bytes of the download copied from the file passed on the local socket */
+
+#define MERKLE_ROOT_QUERY               0xFF    /* ROUTINE_MERKLE_NODE level : region, tree shape and root */
+
+#define DID_VERIFY_ALG                  0xFD00  /* CheckMemory verification algorithm id */
+#define DID_TRANSFER_WINDOW             0xFD01  /* TransferData requests the client keeps in flight */
+#define DID_BLOCK_TAG                   0xFD02  /* 1 : TransferData carries a CRC32 trailer of its payload */
+#define DID_TRANSFER_JOURNAL            0xFD03  /* erased region, committed bytes and their crc, read to resume */
+#define DID_CIPHER_NONCE                0xFD04  /* 16 byte AES-CTR nonce of the encrypted downloads that follow */
+#define DID_BLOCK_HASH                  0xFD05  /* write : region patched in place, read : its per-block hashes */
+
+#define DFI_COMPRESSION_LZ              0x1     /* dataFormatIdentifier high nibble, lz.h chunk stream */
+#define DFI_ENCRYPTION_AES128_CTR       0x1     /* dataFormatIdentifier low nibble, pre-shared key */
+#define DFI_ENCRYPTION_AES256_CTR       0x2
 
 
 #define ERROR_SERVICE_NOT_SUPPORTED                         0x11
 #define ERROR_SUB_FUNCTION_NOT_SUPPORT                      0x12
 #define ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT    0x13
 #define ERROR_REQUEST_SEQUENCE                              0x24
+#define ERROR_TRANSFER_DATA_SUSPENDED                       0x71
+#define ERROR_WRONG_BLOCK_SEQUENCE_COUNTER                  0x73
+#define ERROR_BLOCK_TAG_MISMATCH                            0xF0    /* manufacturer specific, the block is not written, send it again */
 #define ERROR_SECURITY_ACCESS_DENIED                        0x33
 #define ERROR_INCORRECT_KEY                                 0x35
 #define ERROR_REQUIRED_TIME_DELAY_NOT_EXPIRED               0x37
@@ -58,8 +79,29 @@
 #define HARD_RESET  1
 
 
+#define FW_OPT_POPULATE     0x0001  /* prefault the image mapping (MAP_POPULATE) */
+#define FW_OPT_HUGEPAGE     0x0002  /* transparent hugepage hint on the image mapping */
+#define FW_OPT_STREAM       0x0004  /* stream the image through a bounded readahead ring */
+#define FW_OPT_SEND_BLANK   0x0008  /* transfer erased (0xFF) blocks instead of skipping them */
+#define FW_OPT_BLOCK_TAG    0x0010  /* CRC32 trailer on every TransferData block, resent alone when damaged */
+#define FW_OPT_RESUME       0x0020  /* continue from the server's transfer journal instead of erasing */
+#define FW_OPT_COMPRESS     0x0040  /* TransferData carries the region LZ compressed, DFI_COMPRESSION_LZ */
+#define FW_OPT_DELTA        0x0080  /* patch the installed image, blocks whose hash matches are not sent */
+#define FW_OPT_READBACK     0x0100  /* RequestUpload every downloaded region and compare it with the image */
+#define FW_OPT_LOCAL        0x0200  /* pass the image fd to a server on this host, it copies instead of TransferData */
+
+#define LOCAL_SOCKET_NAME   "uds_fw_update.%d"  /* abstract unix socket, numbered by the tester's pid */
+#define LOCAL_MSG_LEN       12                  /* file offset (8) and length (4), host byte order, with the fd */
+
+#define FW_WINDOW_MAX       UDS_TP_QUEUE_DEPTH  /* TransferData blocks in flight at most */
+
 //void session_control (uint8_t session);
 void uds_poll_client (void);
+void fw_update_set_options (uint32_t opt);
+int fw_update_set_verify (const char *name);
+void fw_update_set_seg_gap (uint32_t max_gap);
+int fw_update_set_window (uint32_t blocks);
+int fw_update_set_key (const uint8_t *key, uint32_t len);
 void fw_update_start (char *file);
 void fw_update_schedule (void);
 int is_fw_update_done (void);
@@ -0,0 +1,136 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "fwpkg.h"
+
+/* 1 if file starts with the package magic */
+int fwpkg_probe (const char *file)
+{
+    char magic[sizeof(FWPKG_MAGIC) - 1];
+    struct stat st;
+    FILE *fp;
+    int ret = 0;
+
+    /* reading a pipe would take the bytes away from the image source */
+    if ((stat (file, &st) != 0) || !S_ISREG(st.st_mode))
+    {
+        return 0;
+    }
+    fp = fopen (file, "rb");
+    if (fp != NULL)
+    {
+        if (fread (magic, 1, sizeof(magic), fp) == sizeof(magic))
+        {
+            ret = (memcmp (magic, FWPKG_MAGIC, sizeof(magic)) == 0);
+        }
+        fclose (fp);
+    }
+    return ret;
+}
+
+/* header of a mapped package, NULL when the layout does not fit in size */
+const fwpkg_hdr_t *fwpkg_check (const void *base, uint64_t size)
+{
+    const fwpkg_hdr_t *hdr = base;
+    const fwpkg_blk_t *blk;
+    uint64_t raw = 0;
+    uint32_t i;
+
+    if ((size < sizeof(*hdr)) || (memcmp (hdr->magic, FWPKG_MAGIC, sizeof(hdr->magic)) != 0))
+    {
+        return NULL;
+    }
+    if ((hdr->version != FWPKG_VERSION) || (hdr->hdr_len != sizeof(*hdr)) || (hdr->index_off % 4) ||
+        ((uint64_t)hdr->index_off + (uint64_t)hdr->block_count * sizeof(fwpkg_blk_t) > size))
+    {
+        return NULL;
+    }
+    for (i = 0; i < hdr->block_count; i++)
+    {
+        blk = fwpkg_block (hdr, i);
+        if (((uint64_t)blk->frame_off + blk->frame_len > size) || (blk->frame_len < 2) ||
+            (blk->raw_off != raw) || (blk->raw_len > hdr->block_len) || (blk->flags != 0))
+        {
+            return NULL;
+        }
+        raw += blk->raw_len;
+    }
+    if (raw != hdr->image_len)
+    {
+        return NULL;
+    }
+    return hdr;
+}
+
+const fwpkg_blk_t *fwpkg_block (const fwpkg_hdr_t *hdr, uint32_t idx)
+{
+    return (const fwpkg_blk_t *)((const uint8_t *)hdr + hdr->index_off) + idx;
+}
+
+int fwpkg_write (const char *file, const uint8_t *img, uint32_t len, uint32_t start_addr, uint32_t block_len)
+{
+    fwpkg_hdr_t hdr;
+    fwpkg_blk_t *index;
+    uint8_t frame[2];
+    uint32_t i, off;
+    FILE *fp;
+
+    if ((block_len == 0) || (len == 0))
+    {
+        return -1;
+    }
+    memset (&hdr, 0, sizeof(hdr));
+    memcpy (hdr.magic, FWPKG_MAGIC, sizeof(hdr.magic));
+    hdr.version = FWPKG_VERSION;
+    hdr.hdr_len = sizeof(hdr);
+    hdr.start_addr = start_addr;
+    hdr.image_len = len;
+    hdr.block_len = block_len;
+    hdr.block_count = (uint32_t)(((uint64_t)len + block_len - 1) / block_len);
+    hdr.crc32 = make_crc32_mt(0xFFFFFFFF, img, len, 0);
+    sha256 (img, len, hdr.sha256);
+    hdr.index_off = sizeof(hdr);
+    hdr.data_off = hdr.index_off + hdr.block_count * sizeof(fwpkg_blk_t);
+
+    index = calloc (hdr.block_count, sizeof(fwpkg_blk_t));
+    if (index == NULL)
+    {
+        return -1;
+    }
+    off = hdr.data_off;
+    for (i = 0; i < hdr.block_count; i++)
+    {
+        index[i].raw_off = i * block_len;
+        index[i].raw_len = my_min(len - index[i].raw_off, block_len);
+        index[i].frame_off = off;
+        index[i].frame_len = 2 + index[i].raw_len;
+        index[i].crc32 = make_crc32(0xFFFFFFFF, img + index[i].raw_off, index[i].raw_len);
+        off += index[i].frame_len;
+    }
+
+    fp = fopen (file, "wb");
+    if (fp == NULL)
+    {
+        free (index);
+        return -1;
+    }
+    fwrite (&hdr, 1, sizeof(hdr), fp);
+    fwrite (index, sizeof(fwpkg_blk_t), hdr.block_count, fp);
+    for (i = 0; i < hdr.block_count; i++)
+    {
+        /* block sequence counter as the client numbers it : 1, 2, .. 0xFF, 0x00, .. */
+        frame[0] = 0x36;
+        frame[1] = (uint8_t)(i + 1);
+        fwrite (frame, 1, sizeof(frame), fp);
+        fwrite (img + index[i].raw_off, 1, index[i].raw_len, fp);
+    }
+    free (index);
+    if ((ferror (fp) != 0) | (fclose (fp) != 0))
+    {
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef _FWPKG_H_
+#define _FWPKG_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+#include "sha256.h"
+
+/*
+    precompiled flash package, host byte order, read in place from an mmap
+
+    +--------------+  0
+    | fwpkg_hdr_t  |
+    +--------------+  index_off
+    | fwpkg_blk_t  |  x block_count
+    +--------------+  data_off
+    | frames       |  TransferData requests (0x36, seq, payload) as sent on the wire
+    +--------------+
+*/
+#define FWPKG_MAGIC             "UDSFWPK1"
+#define FWPKG_VERSION           1
+
+typedef struct
+{
+    char     magic[8];
+    uint32_t version;
+    uint32_t hdr_len;
+    uint32_t start_addr;
+    uint32_t image_len;
+    uint32_t block_len;     /* raw bytes per block, the last one may be shorter */
+    uint32_t block_count;
+    uint32_t flags;
+    uint32_t crc32;         /* make_crc32(0xFFFFFFFF, image) */
+    uint32_t index_off;
+    uint32_t data_off;
+    uint8_t  sha256[SHA256_DIGEST_LEN];
+} fwpkg_hdr_t;
+
+typedef struct
+{
+    uint32_t frame_off;     /* file offset of the TransferData request */
+    uint32_t frame_len;
+    uint32_t raw_off;       /* image offset of the block */
+    uint32_t raw_len;
+    uint32_t crc32;         /* make_crc32(0xFFFFFFFF, block) */
+    uint32_t flags;         /* none defined, 0 */
+} fwpkg_blk_t;
+
+int fwpkg_probe (const char *file);
+const fwpkg_hdr_t *fwpkg_check (const void *base, uint64_t size);
+const fwpkg_blk_t *fwpkg_block (const fwpkg_hdr_t *hdr, uint32_t idx);
+int fwpkg_write (const char *file, const uint8_t *img, uint32_t len, uint32_t start_addr, uint32_t block_len);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
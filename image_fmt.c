@@ -0,0 +1,452 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "image_fmt.h"
+
+#define LINE_MAX_LEN    600
+
+int img_fmt_probe (const char *file)
+{
+    uint8_t head[4];
+    struct stat st;
+    FILE *fp;
+    int fmt = IMG_FMT_RAW;
+
+    /* a pipe can not be peeked without losing data, it is always sent as raw */
+    if ((stat (file, &st) != 0) || !S_ISREG(st.st_mode))
+    {
+        return IMG_FMT_RAW;
+    }
+    fp = fopen (file, "rb");
+    if (fp == NULL)
+    {
+        return IMG_FMT_RAW;
+    }
+    if (fread (head, 1, sizeof(head), fp) == sizeof(head))
+    {
+        if ((head[0] == 0x7F) && (head[1] == 'E') && (head[2] == 'L') && (head[3] == 'F'))
+        {
+            fmt = IMG_FMT_ELF;
+        }
+        else if ((head[0] == ':') && isxdigit(head[1]) && isxdigit(head[2]))
+        {
+            fmt = IMG_FMT_IHEX;
+        }
+        else if ((head[0] == 'S') && (head[1] >= '0') && (head[1] <= '9') && isxdigit(head[2]))
+        {
+            fmt = IMG_FMT_SREC;
+        }
+    }
+    fclose (fp);
+    return fmt;
+}
+
+const char *img_fmt_str (int fmt)
+{
+    switch (fmt)
+    {
+        case IMG_FMT_IHEX: return "ihex";
+        case IMG_FMT_SREC: return "srec";
+        case IMG_FMT_ELF:  return "elf";
+        default: break;
+    }
+    return "raw";
+}
+
+/***********************************************************************************/
+/* segment list */
+
+static int seg_reserve (img_seg_t *seg, uint32_t len)
+{
+    uint8_t *p;
+    uint32_t cap;
+
+    if (len <= seg->cap)
+    {
+        return 0;
+    }
+    cap = (seg->cap < 4096) ? 4096 : seg->cap;
+    while (cap < len)
+    {
+        cap = (cap > UINT32_MAX / 2) ? UINT32_MAX : (cap * 2);
+    }
+    p = realloc (seg->own, cap);
+    if (p == NULL)
+    {
+        return -1;
+    }
+    if ((seg->own == NULL) && (seg->len > 0))
+    {
+        memcpy (p, seg->data, seg->len);
+    }
+    seg->own = p;
+    seg->data = p;
+    seg->cap = cap;
+    return 0;
+}
+
+/* records usually follow each other, so appending to the last segment is the fast path */
+int img_seg_add (img_seg_list_t *list, uint32_t addr, const uint8_t *data, uint32_t len, int copy)
+{
+    img_seg_t *seg, *p;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+    if ((uint64_t)addr + len > 0x100000000ULL)
+    {
+        return -1;
+    }
+    if (list->count > 0)
+    {
+        seg = &list->seg[list->count - 1];
+        if (copy && ((uint64_t)seg->addr + seg->len == addr))
+        {
+            if (seg_reserve (seg, seg->len + len) != 0)
+            {
+                return -1;
+            }
+            memcpy (seg->own + seg->len, data, len);
+            seg->len += len;
+            return 0;
+        }
+    }
+    if (list->count == list->cap)
+    {
+        p = realloc (list->seg, (list->cap + 16) * sizeof(img_seg_t));
+        if (p == NULL)
+        {
+            return -1;
+        }
+        list->seg = p;
+        list->cap += 16;
+    }
+    seg = &list->seg[list->count++];
+    memset (seg, 0, sizeof(*seg));
+    seg->addr = addr;
+    if (copy)
+    {
+        if (seg_reserve (seg, len) != 0)
+        {
+            list->count--;
+            return -1;
+        }
+        memcpy (seg->own, data, len);
+    }
+    else
+    {
+        seg->data = data;
+    }
+    seg->len = len;
+    return 0;
+}
+
+static int seg_cmp (const void *a, const void *b)
+{
+    const img_seg_t *x = a, *y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/* sort, then merge neighbours closer than max_gap, the gap is filled with fill */
+int img_seg_coalesce (img_seg_list_t *list, uint32_t max_gap, uint8_t fill)
+{
+    img_seg_t *dst, *src;
+    uint64_t dst_end, gap;
+    uint32_t i, n;
+
+    if (list->count < 2)
+    {
+        return 0;
+    }
+    qsort (list->seg, list->count, sizeof(img_seg_t), seg_cmp);
+
+    n = 0;
+    for (i = 1; i < list->count; i++)
+    {
+        dst = &list->seg[n];
+        src = &list->seg[i];
+        dst_end = (uint64_t)dst->addr + dst->len;
+        if (src->addr < dst_end)
+        {
+            printf ("image: overlapping segments 0x%08X and 0x%08X\n", dst->addr, src->addr);
+            return -1;
+        }
+        gap = src->addr - dst_end;
+        if (gap <= max_gap)
+        {
+            if (seg_reserve (dst, dst->len + (uint32_t)gap + src->len) != 0)
+            {
+                return -1;
+            }
+            memset (dst->own + dst->len, fill, (size_t)gap);
+            memcpy (dst->own + dst->len + gap, src->data, src->len);
+            dst->len += (uint32_t)gap + src->len;
+            free (src->own);
+            continue;
+        }
+        list->seg[++n] = *src;
+    }
+    list->count = n + 1;
+    return 0;
+}
+
+void img_seg_free (img_seg_list_t *list)
+{
+    uint32_t i;
+
+    for (i = 0; i < list->count; i++)
+    {
+        free (list->seg[i].own);
+    }
+    free (list->seg);
+    memset (list, 0, sizeof(*list));
+}
+
+/***********************************************************************************/
+/* Intel HEX / Motorola S-record, parsed a line at a time */
+
+static int hex_bytes (const char *s, uint8_t *out, uint32_t n)
+{
+    uint32_t i;
+    int hi, lo;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!isxdigit((uint8_t)s[2 * i]) || !isxdigit((uint8_t)s[2 * i + 1]))
+        {
+            return -1;
+        }
+        hi = isdigit((uint8_t)s[2 * i]) ? (s[2 * i] - '0') : (tolower((uint8_t)s[2 * i]) - 'a' + 10);
+        lo = isdigit((uint8_t)s[2 * i + 1]) ? (s[2 * i + 1] - '0') : (tolower((uint8_t)s[2 * i + 1]) - 'a' + 10);
+        out[i] = (uint8_t)((hi << 4) | lo);
+    }
+    return 0;
+}
+
+static uint32_t line_trim (char *line)
+{
+    uint32_t len = (uint32_t)strlen (line);
+
+    while ((len > 0) && isspace((uint8_t)line[len - 1]))
+    {
+        line[--len] = '\0';
+    }
+    return len;
+}
+
+int img_parse_ihex (const char *file, img_seg_list_t *list)
+{
+    char line[LINE_MAX_LEN];
+    uint8_t rec[256 + 5], sum;
+    uint32_t len, n, i, base = 0, lineno = 0;
+    FILE *fp;
+    int ret = -1;
+
+    fp = fopen (file, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    while (fgets (line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        len = line_trim (line);
+        if (len == 0)
+        {
+            continue;
+        }
+        /* :LLAAAATT[DD..]CC */
+        n = (len - 1) / 2;
+        if ((line[0] != ':') || (len < 11) || ((len - 1) % 2) || (n > sizeof(rec)) || (hex_bytes (&line[1], rec, n) != 0) || (n != rec[0] + 5u))
+        {
+            printf ("ihex: line %u, format error\n", lineno);
+            goto out;
+        }
+        for (i = 0, sum = 0; i < n; i++)
+        {
+            sum += rec[i];
+        }
+        if (sum != 0)
+        {
+            printf ("ihex: line %u, checksum error\n", lineno);
+            goto out;
+        }
+        switch (rec[3])
+        {
+            case 0x00:
+                if (img_seg_add (list, base + get_u16(&rec[1]), &rec[4], rec[0], 1) != 0)
+                {
+                    goto out;
+                }
+                break;
+            case 0x01:
+                ret = 0;
+                goto out;
+            case 0x02:
+                base = (uint32_t)get_u16(&rec[4]) << 4;
+                break;
+            case 0x04:
+                base = (uint32_t)get_u16(&rec[4]) << 16;
+                break;
+            default:    /* 03 / 05 start address */
+                break;
+        }
+    }
+    printf ("ihex: missing end of file record\n");
+out:
+    fclose (fp);
+    return ret;
+}
+
+int img_parse_srec (const char *file, img_seg_list_t *list)
+{
+    char line[LINE_MAX_LEN];
+    uint8_t rec[256], sum;
+    uint32_t len, n, i, alen, addr, lineno = 0;
+    FILE *fp;
+    int ret = -1;
+
+    fp = fopen (file, "r");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    while (fgets (line, sizeof(line), fp) != NULL)
+    {
+        lineno++;
+        len = line_trim (line);
+        if (len == 0)
+        {
+            continue;
+        }
+        /* Stcc[AAAA..][DD..]CC, cc counts address, data and checksum */
+        n = (len - 2) / 2;
+        if ((line[0] != 'S') || (len < 4) || (len % 2) || (n > sizeof(rec)) || (hex_bytes (&line[2], rec, n) != 0) || (n != rec[0] + 1u))
+        {
+            printf ("srec: line %u, format error\n", lineno);
+            goto out;
+        }
+        for (i = 0, sum = 0; i < n; i++)
+        {
+            sum += rec[i];
+        }
+        if (sum != 0xFF)
+        {
+            printf ("srec: line %u, checksum error\n", lineno);
+            goto out;
+        }
+        switch (line[1])
+        {
+            case '1':
+            case '2':
+            case '3':
+                alen = (uint32_t)(line[1] - '0') + 1;
+                if (rec[0] < alen + 1)
+                {
+                    printf ("srec: line %u, format error\n", lineno);
+                    goto out;
+                }
+                for (i = 0, addr = 0; i < alen; i++)
+                {
+                    addr = (addr << 8) | rec[1 + i];
+                }
+                if (img_seg_add (list, addr, &rec[1 + alen], rec[0] - alen - 1, 1) != 0)
+                {
+                    goto out;
+                }
+                break;
+            case '7':
+            case '8':
+            case '9':
+                ret = 0;
+                goto out;
+            default:    /* S0 header, S5 / S6 record count */
+                break;
+        }
+    }
+    /* the termination record is optional in practice */
+    ret = 0;
+out:
+    fclose (fp);
+    return ret;
+}
+
+/***********************************************************************************/
+/* ELF32 / ELF64, PT_LOAD segments placed at their physical (load) address */
+
+#define PT_LOAD 1
+
+static uint64_t elf_get (const uint8_t *p, int n, int big)
+{
+    uint64_t v = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        v |= (uint64_t)p[big ? i : (n - 1 - i)] << (8 * (n - 1 - i));
+    }
+    return v;
+}
+
+int img_parse_elf (const uint8_t *base, uint64_t size, img_seg_list_t *list)
+{
+    uint64_t phoff, off, paddr, filesz;
+    uint32_t phentsize, phnum, i;
+    const uint8_t *ph;
+    int is64, big;
+
+    if ((size < 52) || (memcmp (base, "\x7F" "ELF", 4) != 0) || (base[4] < 1) || (base[4] > 2) || (base[5] < 1) || (base[5] > 2))
+    {
+        printf ("elf: bad header\n");
+        return -1;
+    }
+    is64 = (base[4] == 2);
+    big = (base[5] == 2);
+    if (is64 && (size < 64))
+    {
+        printf ("elf: bad header\n");
+        return -1;
+    }
+    phoff     = is64 ? elf_get (base + 32, 8, big) : elf_get (base + 28, 4, big);
+    phentsize = (uint32_t)(is64 ? elf_get (base + 54, 2, big) : elf_get (base + 42, 2, big));
+    phnum     = (uint32_t)(is64 ? elf_get (base + 56, 2, big) : elf_get (base + 44, 2, big));
+    /* the offsets come from the file, compared without letting a sum wrap */
+    if ((phentsize < (is64 ? 56u : 32u)) || (phoff > size) || ((uint64_t)phentsize * phnum > size - phoff))
+    {
+        printf ("elf: bad program header table\n");
+        return -1;
+    }
+
+    for (i = 0; i < phnum; i++)
+    {
+        ph = base + phoff + (uint64_t)i * phentsize;
+        if (elf_get (ph, 4, big) != PT_LOAD)
+        {
+            continue;
+        }
+        off    = is64 ? elf_get (ph + 8, 8, big)  : elf_get (ph + 4, 4, big);
+        paddr  = is64 ? elf_get (ph + 24, 8, big) : elf_get (ph + 12, 4, big);
+        filesz = is64 ? elf_get (ph + 32, 8, big) : elf_get (ph + 16, 4, big);
+        if (filesz == 0)
+        {
+            continue;   /* .bss */
+        }
+        if ((off > size) || (filesz > size - off) || (paddr > 0xFFFFFFFFULL) || (filesz > 0x100000000ULL - paddr))
+        {
+            printf ("elf: segment %u out of range\n", i);
+            return -1;
+        }
+        /* no copy, the segment points into the mapped file */
+        if (img_seg_add (list, (uint32_t)paddr, base + off, (uint32_t)filesz, 0) != 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
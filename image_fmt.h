@@ -0,0 +1,44 @@
+#ifndef _IMAGE_FMT_H_
+#define _IMAGE_FMT_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+
+#define IMG_FMT_RAW     0
+#define IMG_FMT_IHEX    1
+#define IMG_FMT_SREC    2
+#define IMG_FMT_ELF     3
+
+typedef struct
+{
+    uint32_t addr;
+    uint32_t len;
+    const uint8_t *data;
+    uint8_t *own;       /* buffer owned by the list, NULL when data points into the caller's mapping */
+    uint32_t cap;
+} img_seg_t;
+
+typedef struct
+{
+    img_seg_t *seg;
+    uint32_t count;
+    uint32_t cap;
+} img_seg_list_t;
+
+int img_fmt_probe (const char *file);
+const char *img_fmt_str (int fmt);
+int img_parse_ihex (const char *file, img_seg_list_t *list);
+int img_parse_srec (const char *file, img_seg_list_t *list);
+int img_parse_elf (const uint8_t *base, uint64_t size, img_seg_list_t *list);
+int img_seg_add (img_seg_list_t *list, uint32_t addr, const uint8_t *data, uint32_t len, int copy);
+int img_seg_coalesce (img_seg_list_t *list, uint32_t max_gap, uint8_t fill);
+void img_seg_free (img_seg_list_t *list);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
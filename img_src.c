@@ -0,0 +1,354 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "util.h"
+#include "img_src.h"
+
+#define READ_CHUNK_SIZE (1024 * 1024)
+
+/* pipes and other non-regular files, read until EOF */
+static int open_heap (img_src_t *src, int fd)
+{
+    uint8_t *buf = NULL, *p;
+    size_t len = 0, cap = 0;
+    ssize_t n;
+
+    for (;;)
+    {
+        if (cap - len < READ_CHUNK_SIZE)
+        {
+            cap += (cap < (64 * READ_CHUNK_SIZE)) ? (cap + READ_CHUNK_SIZE) : (64 * READ_CHUNK_SIZE);
+            if (cap > UINT32_MAX)
+            {
+                printf ("image too large\n");
+                free (buf);
+                return -1;
+            }
+            p = realloc (buf, cap);
+            if (p == NULL)
+            {
+                printf ("malloc fail (%zu)\n", cap);
+                free (buf);
+                return -1;
+            }
+            buf = p;
+        }
+        n = read (fd, buf + len, cap - len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf ("read fail, %s\n", strerror(errno));
+            free (buf);
+            return -1;
+        }
+        if (n == 0)
+        {
+            break;
+        }
+        len += (size_t)n;
+    }
+    src->type = IMG_SRC_HEAP;
+    src->base = buf;
+    src->size = len;
+    return 0;
+}
+
+static int open_mmap (img_src_t *src, int fd, uint64_t size, uint32_t flags)
+{
+    int mflags = MAP_PRIVATE;
+    void *p;
+
+#ifdef MAP_POPULATE
+    if (flags & IMG_SRC_POPULATE)
+    {
+        mflags |= MAP_POPULATE;
+    }
+#endif
+    p = mmap (NULL, (size_t)size, PROT_READ, mflags, fd, 0);
+    if (p == MAP_FAILED)
+    {
+        return -1;
+    }
+    madvise (p, (size_t)size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+    if (flags & IMG_SRC_HUGEPAGE)
+    {
+        madvise (p, (size_t)size, MADV_HUGEPAGE);
+    }
+#endif
+    src->type = IMG_SRC_MMAP;
+    src->base = p;
+    src->size = size;
+    return 0;
+}
+
+static uint8_t *ring_slot (img_src_t *src, uint64_t n)
+{
+    return src->ring + (size_t)(n % IMG_SRC_RING_SLOTS) * IMG_SRC_SLOT_SIZE;
+}
+
+static int read_full (int fd, uint8_t *buf, uint32_t len)
+{
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = read (fd, buf, len);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0)
+        {
+            return -1;
+        }
+        buf += n;
+        len -= (uint32_t)n;
+    }
+    return 0;
+}
+
+static void *ring_reader (void *arg)
+{
+    img_src_t *src = arg;
+    uint64_t n, slots, off;
+    uint32_t len;
+    int stop;
+
+    slots = (src->size + IMG_SRC_SLOT_SIZE - 1) / IMG_SRC_SLOT_SIZE;
+    for (n = 0; n < slots; n++)
+    {
+        pthread_mutex_lock (&src->lock);
+        while (!src->stop && (n - src->released >= IMG_SRC_RING_SLOTS))
+        {
+            pthread_cond_wait (&src->cond_released, &src->lock);
+        }
+        stop = src->stop;
+        pthread_mutex_unlock (&src->lock);
+        if (stop)
+        {
+            break;
+        }
+
+        off = n * IMG_SRC_SLOT_SIZE;
+        len = (uint32_t)my_min(src->size - off, IMG_SRC_SLOT_SIZE);
+        /* ask for the slot after this one while this one is being read */
+        posix_fadvise (src->fd, (off_t)(off + len), IMG_SRC_SLOT_SIZE, POSIX_FADV_WILLNEED);
+        if (read_full (src->fd, ring_slot (src, n), len) != 0)
+        {
+            pthread_mutex_lock (&src->lock);
+            src->error = 1;
+            pthread_cond_broadcast (&src->cond_filled);
+            pthread_mutex_unlock (&src->lock);
+            break;
+        }
+        /* the slot is copied out of the ring, the page cache copy is not needed again */
+        posix_fadvise (src->fd, (off_t)off, len, POSIX_FADV_DONTNEED);
+
+        pthread_mutex_lock (&src->lock);
+        src->filled = n + 1;
+        pthread_cond_broadcast (&src->cond_filled);
+        pthread_mutex_unlock (&src->lock);
+    }
+    return NULL;
+}
+
+static int open_ring (img_src_t *src, int fd, uint64_t size)
+{
+    src->ring = malloc ((size_t)IMG_SRC_RING_SLOTS * IMG_SRC_SLOT_SIZE);
+    if (src->ring == NULL)
+    {
+        return -1;
+    }
+    src->type = IMG_SRC_RING;
+    src->base = NULL;
+    src->size = size;
+    src->fd = fd;
+    src->filled = 0;
+    src->released = 0;
+    src->error = 0;
+    src->stop = 0;
+    pthread_mutex_init (&src->lock, NULL);
+    pthread_cond_init (&src->cond_filled, NULL);
+    pthread_cond_init (&src->cond_released, NULL);
+    posix_fadvise (fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (pthread_create (&src->reader, NULL, ring_reader, src) != 0)
+    {
+        pthread_cond_destroy (&src->cond_released);
+        pthread_cond_destroy (&src->cond_filled);
+        pthread_mutex_destroy (&src->lock);
+        free (src->ring);
+        src->ring = NULL;
+        src->fd = -1;
+        src->type = IMG_SRC_NONE;
+        return -1;
+    }
+    return 0;
+}
+
+int img_src_open (img_src_t *src, const char *file, uint32_t flags)
+{
+    struct stat st;
+    int fd, ret = -1;
+
+    memset (src, 0, sizeof(*src));
+    src->fd = -1;
+    fd = open (file, O_RDONLY);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if ((fstat (fd, &st) == 0) && S_ISREG(st.st_mode) && (st.st_size > 0))
+    {
+        if ((uint64_t)st.st_size > UINT32_MAX)
+        {
+            printf ("image too large\n");
+            close (fd);
+            return -1;
+        }
+        if (flags & IMG_SRC_STREAM)
+        {
+            ret = open_ring (src, fd, (uint64_t)st.st_size);
+            if (ret == 0)
+            {
+                return 0; /* fd is owned by the reader */
+            }
+        }
+        ret = open_mmap (src, fd, (uint64_t)st.st_size, flags);
+        if (ret == 0)
+        {
+            src->fd = fd;   /* a local server may copy straight from the file */
+            return 0;
+        }
+    }
+    if (ret != 0)
+    {
+        ret = open_heap (src, fd);
+    }
+    close (fd);
+    return ret;
+}
+
+/* copy [off, off + len) to dst, off must not be below the last img_src_release() */
+int img_src_read (img_src_t *src, uint64_t off, void *dst, uint32_t len)
+{
+    uint8_t *d = dst;
+    uint64_t n;
+    uint32_t pos, cnt;
+
+    if (off + len > src->size)
+    {
+        return -1;
+    }
+    if (src->base != NULL)
+    {
+        memcpy (dst, src->base + off, len);
+        return 0;
+    }
+
+    while (len > 0)
+    {
+        n = off / IMG_SRC_SLOT_SIZE;
+        pos = (uint32_t)(off % IMG_SRC_SLOT_SIZE);
+        cnt = my_min(len, IMG_SRC_SLOT_SIZE - pos);
+
+        pthread_mutex_lock (&src->lock);
+        if (n < src->released)
+        {
+            pthread_mutex_unlock (&src->lock);
+            return -1;
+        }
+        while ((src->filled <= n) && !src->error)
+        {
+            pthread_cond_wait (&src->cond_filled, &src->lock);
+        }
+        if (src->filled <= n)
+        {
+            pthread_mutex_unlock (&src->lock);
+            return -1;
+        }
+        pthread_mutex_unlock (&src->lock);
+
+        memcpy (d, ring_slot (src, n) + pos, cnt);
+        d += cnt;
+        off += cnt;
+        len -= cnt;
+    }
+    return 0;
+}
+
+/* bytes below off will not be read again */
+void img_src_release (img_src_t *src, uint64_t off)
+{
+    uint64_t n = off / IMG_SRC_SLOT_SIZE;
+
+    if (src->type != IMG_SRC_RING)
+    {
+        return;
+    }
+    pthread_mutex_lock (&src->lock);
+    if (n > src->released)
+    {
+        src->released = n;
+        pthread_cond_signal (&src->cond_released);
+    }
+    pthread_mutex_unlock (&src->lock);
+}
+
+void img_src_close (img_src_t *src)
+{
+    switch (src->type)
+    {
+        case IMG_SRC_MMAP:
+            munmap ((void *)src->base, (size_t)src->size);
+            close (src->fd);
+            break;
+
+        case IMG_SRC_HEAP:
+            free ((void *)src->base);
+            break;
+
+        case IMG_SRC_RING:
+            pthread_mutex_lock (&src->lock);
+            src->stop = 1;
+            pthread_cond_signal (&src->cond_released);
+            pthread_mutex_unlock (&src->lock);
+            pthread_join (src->reader, NULL);
+            pthread_mutex_destroy (&src->lock);
+            pthread_cond_destroy (&src->cond_filled);
+            pthread_cond_destroy (&src->cond_released);
+            close (src->fd);
+            free (src->ring);
+            break;
+
+        default:
+            break;
+    }
+    memset (src, 0, sizeof(*src));
+    src->fd = -1;
+}
+
+const char *img_src_type_str (const img_src_t *src)
+{
+    switch (src->type)
+    {
+        case IMG_SRC_MMAP: return "mmap";
+        case IMG_SRC_HEAP: return "read";
+        case IMG_SRC_RING: return "stream";
+        default: break;
+    }
+    return "none";
+}
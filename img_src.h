@@ -0,0 +1,55 @@
+#ifndef _IMG_SRC_H_
+#define _IMG_SRC_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+#include <pthread.h>
+
+#define IMG_SRC_POPULATE    0x0001  /* prefault the mapping (MAP_POPULATE) */
+#define IMG_SRC_HUGEPAGE    0x0002  /* transparent hugepage hint on the mapping */
+#define IMG_SRC_STREAM      0x0004  /* bounded readahead ring instead of a resident image */
+
+#define IMG_SRC_RING_SLOTS  4
+#define IMG_SRC_SLOT_SIZE   (1024 * 1024)
+
+typedef enum
+{
+    IMG_SRC_NONE = 0,
+    IMG_SRC_MMAP,
+    IMG_SRC_HEAP,
+    IMG_SRC_RING,
+} img_src_type_t;
+
+typedef struct
+{
+    img_src_type_t type;
+    const uint8_t *base;        /* whole image, NULL for IMG_SRC_RING */
+    uint64_t size;
+    int fd;                     /* the file, kept open for IMG_SRC_MMAP and IMG_SRC_RING */
+
+    /* IMG_SRC_RING : slot (n % IMG_SRC_RING_SLOTS) holds bytes [n * IMG_SRC_SLOT_SIZE, ...) */
+    uint8_t *ring;
+    uint64_t filled;            /* slots read so far */
+    uint64_t released;          /* slots handed back by the consumer */
+    int error;
+    int stop;
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_filled;
+    pthread_cond_t cond_released;
+} img_src_t;
+
+int img_src_open (img_src_t *src, const char *file, uint32_t flags);
+int img_src_read (img_src_t *src, uint64_t off, void *dst, uint32_t len);
+void img_src_release (img_src_t *src, uint64_t off);
+void img_src_close (img_src_t *src);
+const char *img_src_type_str (const img_src_t *src);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
@@ -0,0 +1,335 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "util.h"
+#include "isotp.h"
+
+#define TX_IDLE         0
+#define TX_SF           1       /* single frame not on the bus yet */
+#define TX_FF           2
+#define TX_WAIT_FC      3
+#define TX_CF           4
+
+#define FS_CTS          0
+#define FS_WAIT         1
+#define FS_OVFLW        2
+
+static uint64_t isotp_now_us (void)
+{
+    struct timespec tm;
+
+    clock_gettime(CLOCK_MONOTONIC, &tm);
+    return (uint64_t)tm.tv_sec * 1000000 + (uint64_t)tm.tv_nsec / 1000;
+}
+
+/* frame length for len data bytes, CAN FD only has these lengths above 8 */
+static uint32_t isotp_dlc_len (uint32_t len)
+{
+    static const uint8_t fd_len[] = { 12, 16, 20, 24, 32, 48, 64 };
+    uint32_t i;
+
+    if (len <= 8)
+    {
+        return 8;
+    }
+    for (i = 0; fd_len[i] < len; i++)
+    {
+    }
+    return fd_len[i];
+}
+
+/* STmin encoding to microseconds, reserved values mean the longest separation */
+static uint32_t isotp_st_us (uint8_t st)
+{
+    if (st <= 0x7F)
+    {
+        return st * 1000u;
+    }
+    if ((st >= 0xF1) && (st <= 0xF9))
+    {
+        return (st - 0xF0) * 100u;
+    }
+    return 0x7F * 1000u;
+}
+
+/* protocol control bytes then len data bytes, padded */
+static int isotp_put_frame (isotp_link_t *link, const uint8_t *pci, uint32_t pci_len, const uint8_t *data, uint32_t len)
+{
+    can_frame_t f;
+
+    f.id = link->tx_id;
+    f.len = isotp_dlc_len (pci_len + len);
+    memcpy (f.data, pci, pci_len);
+    if (len > 0)
+    {
+        memcpy (&f.data[pci_len], data, len);
+    }
+    memset (&f.data[pci_len + len], ISOTP_PAD, f.len - pci_len - len);
+    if (link->can_tx (link->arg, &f) != 0)
+    {
+        return -1;
+    }
+    link->stats.bus_bytes += f.len;
+    return 0;
+}
+
+static void isotp_flush_fc (isotp_link_t *link)
+{
+    uint8_t pci[3];
+
+    if (link->fc_pending < 0)
+    {
+        return;
+    }
+    pci[0] = (uint8_t)(0x30 | link->fc_pending);
+    pci[1] = link->cfg.bs;
+    pci[2] = link->cfg.stmin;
+    if (isotp_put_frame (link, pci, sizeof(pci), NULL, 0) == 0)
+    {
+        link->stats.fc++;
+        link->fc_pending = -1;
+    }
+}
+
+void isotp_init (isotp_link_t *link, const isotp_cfg_t *cfg, uint32_t tx_id, uint32_t rx_id,
+                 isotp_can_tx_t can_tx, void *arg, uint8_t *rx_buf, uint32_t rx_cap)
+{
+    memset (link, 0, sizeof(*link));
+    link->cfg = *cfg;
+    link->tx_id = tx_id;
+    link->rx_id = rx_id;
+    link->can_tx = can_tx;
+    link->arg = arg;
+    link->rx_buf = rx_buf;
+    link->rx_cap = rx_cap;
+    link->fc_pending = -1;
+}
+
+/* data has to stay in place until the link is idle again, the frames go out from isotp_poll() */
+int isotp_send (isotp_link_t *link, const uint8_t *data, uint32_t len)
+{
+    uint32_t sf_max = (link->cfg.tx_dl == ISOTP_CAN_DL) ? 7 : link->cfg.tx_dl - 2;
+
+    if ((link->tx_state != TX_IDLE) || (len == 0))
+    {
+        return -1;
+    }
+    link->tx_buf = data;
+    link->tx_len = len;
+    link->tx_state = (len <= sf_max) ? TX_SF : TX_FF;
+    isotp_poll (link);
+    return 0;
+}
+
+int isotp_tx_idle (const isotp_link_t *link)
+{
+    return link->tx_state == TX_IDLE;
+}
+
+/* everything the timers and the receiver's flow control allow right now */
+void isotp_poll (isotp_link_t *link)
+{
+    uint64_t now = isotp_now_us();
+    uint8_t pci[6];
+    uint32_t pci_len, n;
+
+    isotp_flush_fc (link);
+    if (link->rx_active && (now >= link->rx_timer_us))
+    {
+        printf ("isotp: 0x%03X consecutive frame timeout, %u of %u bytes\n", link->rx_id, link->rx_off, link->rx_len);
+        link->rx_active = 0;
+    }
+
+    switch (link->tx_state)
+    {
+        case TX_SF:
+            if (link->tx_len <= 7)
+            {
+                pci[0] = (uint8_t)link->tx_len;
+                pci_len = 1;
+            }
+            else
+            {
+                pci[0] = 0x00;
+                pci[1] = (uint8_t)link->tx_len;
+                pci_len = 2;
+            }
+            if (isotp_put_frame (link, pci, pci_len, link->tx_buf, link->tx_len) == 0)
+            {
+                link->stats.sf++;
+                link->stats.msg_bytes += link->tx_len;
+                link->tx_state = TX_IDLE;
+            }
+            break;
+
+        case TX_FF:
+            if (link->tx_len <= 0xFFF)
+            {
+                pci[0] = (uint8_t)(0x10 | (link->tx_len >> 8));
+                pci[1] = (uint8_t)link->tx_len;
+                pci_len = 2;
+            }
+            else
+            {
+                pci[0] = 0x10;
+                pci[1] = 0x00;
+                put_u32(&pci[2], link->tx_len);
+                pci_len = 6;
+            }
+            n = link->cfg.tx_dl - pci_len;
+            if (isotp_put_frame (link, pci, pci_len, link->tx_buf, n) == 0)
+            {
+                link->stats.ff++;
+                link->tx_off = n;
+                link->tx_sn = 1;
+                link->tx_state = TX_WAIT_FC;
+                link->tx_timer_us = now + ISOTP_N_BS_MS * 1000;
+            }
+            break;
+
+        case TX_WAIT_FC:
+            if (now >= link->tx_timer_us)
+            {
+                printf ("isotp: 0x%03X no flow control, message of %u bytes abandoned\n", link->tx_id, link->tx_len);
+                link->tx_state = TX_IDLE;
+            }
+            break;
+
+        case TX_CF:
+            while (now >= link->tx_next_us)
+            {
+                n = my_min(link->cfg.tx_dl - 1, link->tx_len - link->tx_off);
+                pci[0] = (uint8_t)(0x20 | link->tx_sn);
+                if (isotp_put_frame (link, pci, 1, link->tx_buf + link->tx_off, n) != 0)
+                {
+                    break;      /* bus full, the same frame next time */
+                }
+                link->stats.cf++;
+                link->tx_off += n;
+                link->tx_sn = (link->tx_sn + 1) & 0x0F;
+                link->tx_next_us = now + link->tx_st_us;
+                if (link->tx_off == link->tx_len)
+                {
+                    link->stats.msg_bytes += link->tx_len;
+                    link->tx_state = TX_IDLE;
+                    break;
+                }
+                if ((link->tx_bs != 0) && (--link->tx_bs == 0))
+                {
+                    link->tx_state = TX_WAIT_FC;
+                    link->tx_timer_us = now + ISOTP_N_BS_MS * 1000;
+                    break;
+                }
+            }
+            break;
+    }
+}
+
+/* a frame from the bus, the message length once one is complete in rx_buf, 0 otherwise, -1 on a protocol error */
+int isotp_on_frame (isotp_link_t *link, const can_frame_t *frame)
+{
+    const uint8_t *d = frame->data;
+    uint32_t len, pci_len, n;
+
+    if ((frame->id != link->rx_id) || (frame->len == 0) || (frame->len > ISOTP_CANFD_DL))
+    {
+        return 0;
+    }
+    switch (d[0] >> 4)
+    {
+        case 0x0:
+            pci_len = ((d[0] & 0x0F) != 0) ? 1 : 2;
+            len = (pci_len == 1) ? (uint32_t)(d[0] & 0x0F) : d[1];
+            if ((len == 0) || (pci_len + len > frame->len) || (len > link->rx_cap) || ((pci_len == 2) && (frame->len <= 8)))
+            {
+                return -1;
+            }
+            memcpy (link->rx_buf, &d[pci_len], len);
+            link->rx_active = 0;    /* a new message ends one that was still arriving */
+            return (int)len;
+
+        case 0x1:
+            len = ((uint32_t)(d[0] & 0x0F) << 8) | d[1];
+            pci_len = 2;
+            if (len == 0)
+            {
+                len = get_u32((void *)&d[2]);
+                pci_len = 6;
+            }
+            if ((frame->len < 8) || (len <= frame->len - pci_len))
+            {
+                return -1;
+            }
+            if (len > link->rx_cap)
+            {
+                link->rx_active = 0;
+                link->fc_pending = FS_OVFLW;
+                isotp_flush_fc (link);
+                return -1;
+            }
+            n = frame->len - pci_len;
+            memcpy (link->rx_buf, &d[pci_len], n);
+            link->rx_len = len;
+            link->rx_off = n;
+            link->rx_sn = 1;
+            link->rx_bs = link->cfg.bs;
+            link->rx_active = 1;
+            link->rx_timer_us = isotp_now_us() + ISOTP_N_CR_MS * 1000;
+            link->fc_pending = FS_CTS;
+            isotp_flush_fc (link);
+            return 0;
+
+        case 0x2:
+            if (!link->rx_active)
+            {
+                return 0;
+            }
+            if ((d[0] & 0x0F) != link->rx_sn)
+            {
+                printf ("isotp: 0x%03X sequence number %u, %u expected, message dropped\n", link->rx_id, d[0] & 0x0F, link->rx_sn);
+                link->rx_active = 0;
+                return -1;
+            }
+            n = my_min(frame->len - 1, link->rx_len - link->rx_off);
+            memcpy (link->rx_buf + link->rx_off, &d[1], n);
+            link->rx_off += n;
+            link->rx_sn = (link->rx_sn + 1) & 0x0F;
+            if (link->rx_off == link->rx_len)
+            {
+                link->rx_active = 0;
+                return (int)link->rx_len;
+            }
+            link->rx_timer_us = isotp_now_us() + ISOTP_N_CR_MS * 1000;
+            if ((link->cfg.bs != 0) && (--link->rx_bs == 0))
+            {
+                link->rx_bs = link->cfg.bs;
+                link->fc_pending = FS_CTS;
+                isotp_flush_fc (link);
+            }
+            return 0;
+
+        case 0x3:
+            if ((link->tx_state != TX_WAIT_FC) || (frame->len < 3))
+            {
+                return 0;
+            }
+            switch (d[0] & 0x0F)
+            {
+                case FS_CTS:
+                    link->tx_bs = d[1];
+                    link->tx_st_us = isotp_st_us (d[2]);
+                    link->tx_next_us = 0;
+                    link->tx_state = TX_CF;
+                    break;
+                case FS_WAIT:
+                    link->tx_timer_us = isotp_now_us() + ISOTP_N_BS_MS * 1000;
+                    break;
+                default:
+                    printf ("isotp: 0x%03X receiver overflow, message of %u bytes abandoned\n", link->tx_id, link->tx_len);
+                    link->tx_state = TX_IDLE;
+                    break;
+            }
+            return 0;
+    }
+    return -1;
+}
@@ -0,0 +1,88 @@
+#ifndef _ISOTP_H_
+#define _ISOTP_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+
+/*
+    ISO 15765-2 transport, one connection (tx id / rx id pair) per link
+    SF  0N data              N = 1..7, CAN FD : 00 NN data, NN = 8..62
+    FF  1L LL data           L = 12 bit length, 10 00 LLLLLLLL data above 4095 bytes
+    CF  2N data              N = sequence number, 1..F, 0..
+    FC  3S BS ST             S = 0 continue, 1 wait, 2 overflow
+*/
+#define ISOTP_CAN_DL        8
+#define ISOTP_CANFD_DL      64
+#define ISOTP_PAD           0xCC
+#define ISOTP_N_BS_MS       1000    /* sender waiting for a flow control */
+#define ISOTP_N_CR_MS       1000    /* receiver waiting for a consecutive frame */
+
+typedef struct
+{
+    uint32_t id;
+    uint32_t len;                   /* data bytes on the bus, padded to a valid DLC */
+    uint8_t  data[ISOTP_CANFD_DL];
+} can_frame_t;
+
+/* 0 when the bus took the frame, otherwise it is offered again on the next poll */
+typedef int (*isotp_can_tx_t)(void *arg, const can_frame_t *frame);
+
+typedef struct
+{
+    uint32_t tx_dl;                 /* ISOTP_CAN_DL or ISOTP_CANFD_DL */
+    uint8_t  bs;                    /* block size this receiver asks for, 0 = one flow control per message */
+    uint8_t  stmin;                 /* separation time this receiver asks for, 0x00..0x7F ms, 0xF1..0xF9 100..900 us */
+} isotp_cfg_t;
+
+typedef struct
+{
+    uint32_t sf, ff, cf, fc;        /* frames sent */
+    uint64_t bus_bytes;             /* frame data on the bus, padding included */
+    uint64_t msg_bytes;             /* message payload */
+} isotp_stats_t;
+
+typedef struct
+{
+    isotp_cfg_t cfg;
+    uint32_t tx_id;
+    uint32_t rx_id;
+    isotp_can_tx_t can_tx;
+    void *arg;
+    /* sender */
+    int tx_state;
+    const uint8_t *tx_buf;
+    uint32_t tx_len;
+    uint32_t tx_off;
+    uint8_t  tx_sn;
+    uint32_t tx_bs;                 /* consecutive frames left in the block, 0 = unlimited */
+    uint32_t tx_st_us;              /* separation time the receiver asked for */
+    uint64_t tx_next_us;            /* earliest time of the next consecutive frame */
+    uint64_t tx_timer_us;           /* N_Bs */
+    /* receiver */
+    uint8_t *rx_buf;
+    uint32_t rx_cap;
+    int rx_active;
+    uint32_t rx_len;
+    uint32_t rx_off;
+    uint8_t  rx_sn;
+    uint32_t rx_bs;                 /* consecutive frames left before the next flow control */
+    uint64_t rx_timer_us;           /* N_Cr */
+    int fc_pending;                 /* flow status still to send, -1 = none */
+    isotp_stats_t stats;
+} isotp_link_t;
+
+void isotp_init (isotp_link_t *link, const isotp_cfg_t *cfg, uint32_t tx_id, uint32_t rx_id,
+                 isotp_can_tx_t can_tx, void *arg, uint8_t *rx_buf, uint32_t rx_cap);
+int isotp_send (isotp_link_t *link, const uint8_t *data, uint32_t len);
+int isotp_tx_idle (const isotp_link_t *link);
+void isotp_poll (isotp_link_t *link);
+int isotp_on_frame (isotp_link_t *link, const can_frame_t *frame);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
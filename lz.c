@@ -0,0 +1,348 @@
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "util.h"
+#include "lz.h"
+
+#define LZ_MIN_MATCH        4
+#define LZ_HASH_BITS        13
+#define LZ_MAX_OFFSET       0xFFFF
+#define LZ_SKIP_TRIGGER     6       /* misses before the search steps faster over incompressible data */
+#define LZ_MAX_THREADS      64
+
+/* worker output slot of chunk i, the stream is packed afterwards */
+#define LZ_SLOT(i)          ((size_t)(i) * (LZ_HDR_LEN + LZ_CHUNK_LEN))
+
+typedef struct
+{
+    pthread_t th;
+    int started;
+    const uint8_t *src;
+    uint32_t len;
+    uint8_t *dst;
+    uint32_t first;
+    uint32_t step;
+} lz_job_t;
+
+static uint32_t lz_hash (const uint8_t *p)
+{
+    uint32_t v;
+
+    memcpy (&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* length past the 15 of the token nibble */
+static uint8_t *lz_put_len (uint8_t *op, uint32_t len)
+{
+    len -= 15;
+    while (len >= 255)
+    {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+static uint8_t *lz_put_seq (uint8_t *op, const uint8_t *lit, uint32_t lit_len, uint32_t off, uint32_t match_len)
+{
+    uint8_t *token = op++;
+
+    *token = (uint8_t)(my_min(lit_len, 15) << 4);
+    if (lit_len >= 15)
+    {
+        op = lz_put_len (op, lit_len);
+    }
+    memcpy (op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0)
+    {
+        return op;
+    }
+    *op++ = (uint8_t)off;
+    *op++ = (uint8_t)(off >> 8);
+    match_len -= LZ_MIN_MATCH;
+    *token |= (uint8_t)my_min(match_len, 15);
+    if (match_len >= 15)
+    {
+        op = lz_put_len (op, match_len);
+    }
+    return op;
+}
+
+/* greedy single probe match finder, 0 when the block does not fit in cap */
+static uint32_t lz_compress_block (const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t cap)
+{
+    uint16_t table[1 << LZ_HASH_BITS];
+    const uint8_t *ip = src, *anchor = src, *end = src + len, *ref;
+    uint8_t *op = dst;
+    uint32_t h, lit, mlen, miss = 0;
+
+    memset (table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= end)
+    {
+        h = lz_hash (ip);
+        ref = src + table[h];
+        table[h] = (uint16_t)(ip - src);
+        if ((ref >= ip) || (ip - ref > LZ_MAX_OFFSET) || (memcmp (ref, ip, LZ_MIN_MATCH) != 0))
+        {
+            ip += 1 + (miss++ >> LZ_SKIP_TRIGGER);
+            continue;
+        }
+        miss = 0;
+        for (mlen = LZ_MIN_MATCH; (ip + mlen < end) && (ref[mlen] == ip[mlen]); mlen++)
+        {
+        }
+        lit = (uint32_t)(ip - anchor);
+        if ((op - dst) + 1 + lit + lit / 255 + 1 + 2 + mlen / 255 + 1 > cap)
+        {
+            return 0;
+        }
+        op = lz_put_seq (op, anchor, lit, (uint32_t)(ip - ref), mlen);
+        ip += mlen;
+        anchor = ip;
+    }
+    lit = (uint32_t)(end - anchor);
+    if ((op - dst) + 1 + lit + lit / 255 + 1 > cap)
+    {
+        return 0;
+    }
+    op = lz_put_seq (op, anchor, lit, 0, 0);
+    return (uint32_t)(op - dst);
+}
+
+/* 0 when src decodes to exactly raw_len bytes, matches may overlap their own output */
+static int lz_decompress_block (const uint8_t *src, uint32_t len, uint8_t *dst, uint32_t raw_len)
+{
+    const uint8_t *ip = src, *end = src + len;
+    uint8_t *op = dst, *oend = dst + raw_len, *ref;
+    uint32_t token, lit, off, mlen, b, i;
+
+    while (ip < end)
+    {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15)
+        {
+            do
+            {
+                if (ip == end)
+                {
+                    return -1;
+                }
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if ((lit > (uint32_t)(end - ip)) || (lit > (uint32_t)(oend - op)))
+        {
+            return -1;
+        }
+        memcpy (op, ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == end)
+        {
+            break;
+        }
+        if (end - ip < 2)
+        {
+            return -1;
+        }
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        mlen = token & 15;
+        if (mlen == 15)
+        {
+            do
+            {
+                if (ip == end)
+                {
+                    return -1;
+                }
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MIN_MATCH;
+        if ((off == 0) || (off > (uint32_t)(op - dst)) || (mlen > (uint32_t)(oend - op)))
+        {
+            return -1;
+        }
+        ref = op - off;
+        if (off >= mlen)
+        {
+            memcpy (op, ref, mlen);
+        }
+        else
+        {
+            for (i = 0; i < mlen; i++)
+            {
+                op[i] = ref[i];
+            }
+        }
+        op += mlen;
+    }
+    return (op == oend) ? 0 : -1;
+}
+
+/* header and data of one chunk at dst, stored as is when compression does not gain */
+static uint32_t lz_compress_chunk (const uint8_t *src, uint32_t len, uint8_t *dst)
+{
+    uint32_t z_len = lz_compress_block (src, len, dst + LZ_HDR_LEN, len - 1);
+
+    if (z_len == 0)
+    {
+        memcpy (dst + LZ_HDR_LEN, src, len);
+        z_len = len;
+    }
+    put_u16(&dst[0], (uint16_t)len);
+    put_u16(&dst[2], (uint16_t)z_len);
+    return LZ_HDR_LEN + z_len;
+}
+
+static void *lz_worker (void *arg)
+{
+    lz_job_t *job = arg;
+    uint32_t i, pos;
+
+    for (i = job->first; (pos = i * LZ_CHUNK_LEN) < job->len; i += job->step)
+    {
+        lz_compress_chunk (job->src + pos, my_min(job->len - pos, LZ_CHUNK_LEN), job->dst + LZ_SLOT(i));
+    }
+    return NULL;
+}
+
+/* worst case of lz_compress(), every chunk stored */
+uint32_t lz_stream_bound (uint32_t len)
+{
+    return len + ((len + LZ_CHUNK_LEN - 1) / LZ_CHUNK_LEN) * LZ_HDR_LEN;
+}
+
+/* chunk stream of src into dst (lz_stream_bound() bytes), the chunks are spread over threads workers, 0 = every core */
+uint32_t lz_compress (const uint8_t *src, uint32_t len, uint8_t *dst, int threads)
+{
+    lz_job_t job[LZ_MAX_THREADS];
+    uint32_t chunks = (len + LZ_CHUNK_LEN - 1) / LZ_CHUNK_LEN;
+    uint32_t i, n, z_len, out = 0;
+
+    if (threads <= 0)
+    {
+        threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    n = my_min((uint32_t)my_min(threads, LZ_MAX_THREADS), chunks);
+    for (i = 0; i < n; i++)
+    {
+        job[i].src = src;
+        job[i].len = len;
+        job[i].dst = dst;
+        job[i].first = i;
+        job[i].step = n;
+        job[i].started = (i > 0) && (pthread_create(&job[i].th, NULL, lz_worker, &job[i]) == 0);
+        if ((i > 0) && !job[i].started)
+        {
+            lz_worker(&job[i]);
+        }
+    }
+    if (n > 0)
+    {
+        lz_worker(&job[0]);
+    }
+    for (i = 1; i < n; i++)
+    {
+        if (job[i].started)
+        {
+            pthread_join(job[i].th, NULL);
+        }
+    }
+
+    /* every slot holds at most its own chunk, packing only moves data down */
+    for (i = 0; i < chunks; i++)
+    {
+        z_len = LZ_HDR_LEN + get_u16(dst + LZ_SLOT(i) + 2);
+        memmove (dst + out, dst + LZ_SLOT(i), z_len);
+        out += z_len;
+    }
+    return out;
+}
+
+void lz_stream_init (lz_stream_t *s)
+{
+    s->hdr_len = 0;
+    s->z_fill = 0;
+}
+
+static int lz_stream_chunk (lz_stream_t *s, const uint8_t *z, lz_sink_t sink, void *arg)
+{
+    s->hdr_len = 0;
+    s->z_fill = 0;
+    if (s->z_len == s->raw_len)
+    {
+        return sink (arg, z, s->raw_len);
+    }
+    if (lz_decompress_block (z, s->z_len, s->out, s->raw_len) != 0)
+    {
+        return -1;
+    }
+    return sink (arg, s->out, s->raw_len);
+}
+
+/*
+    the next len bytes of the stream, every completed chunk goes to sink in order
+    -1 on a malformed stream, otherwise the first non zero sink result
+*/
+int lz_stream_feed (lz_stream_t *s, const uint8_t *data, uint32_t len, lz_sink_t sink, void *arg)
+{
+    uint32_t n;
+    int ret;
+
+    while (len > 0)
+    {
+        if (s->hdr_len < LZ_HDR_LEN)
+        {
+            n = my_min(LZ_HDR_LEN - s->hdr_len, len);
+            memcpy (&s->hdr[s->hdr_len], data, n);
+            s->hdr_len += n;
+            data += n;
+            len -= n;
+            if (s->hdr_len < LZ_HDR_LEN)
+            {
+                break;
+            }
+            s->raw_len = get_u16(&s->hdr[0]);
+            s->z_len = get_u16(&s->hdr[2]);
+            if ((s->raw_len == 0) || (s->raw_len > LZ_CHUNK_LEN) || (s->z_len == 0) || (s->z_len > s->raw_len))
+            {
+                return -1;
+            }
+            continue;
+        }
+        if ((s->z_fill == 0) && (len >= s->z_len))
+        {
+            /* the whole chunk is in this piece, decoded in place */
+            n = s->z_len;
+            ret = lz_stream_chunk (s, data, sink, arg);
+        }
+        else
+        {
+            n = my_min(s->z_len - s->z_fill, len);
+            memcpy (&s->z[s->z_fill], data, n);
+            s->z_fill += n;
+            ret = (s->z_fill == s->z_len) ? lz_stream_chunk (s, s->z, sink, arg) : 0;
+        }
+        if (ret != 0)
+        {
+            return ret;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* true between chunks, the stream may end here */
+int lz_stream_idle (const lz_stream_t *s)
+{
+    return (s->hdr_len == 0) && (s->z_fill == 0);
+}
@@ -0,0 +1,42 @@
+#ifndef _LZ_H_
+#define _LZ_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+
+/*
+    LZ77 chunk stream, every chunk decodes on its own
+    chunk : raw_len(2) z_len(2) data(z_len), big endian, z_len == raw_len is a stored chunk
+    data  : sequences of token, literals, offset(2, little endian), match length, the last one has literals only
+*/
+#define LZ_CHUNK_LEN    (32 * 1024)
+#define LZ_HDR_LEN      4
+
+typedef int (*lz_sink_t)(void *arg, const uint8_t *data, uint32_t len);
+
+/* decoder state, the memory is bounded by one chunk in and one chunk out */
+typedef struct
+{
+    uint8_t  hdr[LZ_HDR_LEN];
+    uint32_t hdr_len;
+    uint32_t raw_len;
+    uint32_t z_len;
+    uint32_t z_fill;
+    uint8_t  z[LZ_CHUNK_LEN];
+    uint8_t  out[LZ_CHUNK_LEN];
+} lz_stream_t;
+
+uint32_t lz_stream_bound (uint32_t len);
+uint32_t lz_compress (const uint8_t *src, uint32_t len, uint8_t *dst, int threads);
+void lz_stream_init (lz_stream_t *s);
+int lz_stream_feed (lz_stream_t *s, const uint8_t *data, uint32_t len, lz_sink_t sink, void *arg);
+int lz_stream_idle (const lz_stream_t *s);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
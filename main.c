@@ -1,18 +1,249 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include "uds.h"
+#include "uds_hal.h"
+#include "doip.h"
 #include "util.h"
 #include "fw_update.h"
 
-int main (void)
+static void usage (char *name)
 {
-    uds_init();
-    fw_update_start ("test.dat");
+    printf ("usage: %s [-p] [-H] [-s] [-E] [-c] [-r] [-z] [-d] [-u] [-l] [-K key] [-T dl[,bs[,st]]] [-D port] [-X server] [-v alg] [-g gap] [-B base] [-L len] [-w n] [file]\n", name);
+    printf ("  -p    prefault the image mapping (MAP_POPULATE)\n");
+    printf ("  -H    hugepage hint on the image mapping\n");
+    printf ("  -s    stream the image with bounded memory (regular files)\n");
+    printf ("  -E    also transfer erased (0xFF) blocks\n");
+    printf ("  -c    CRC32 trailer on every TransferData block, a damaged block is resent alone\n");
+    printf ("  -r    resume an interrupted download from the server's transfer journal\n");
+    printf ("  -z    compress the download (dataFormatIdentifier 0x10), chunks compressed on every core\n");
+    printf ("  -d    delta update, only blocks that differ from the installed image are sent\n");
+    printf ("  -u    read every downloaded region back with RequestUpload and compare it byte for byte\n");
+    printf ("  -l    local server, it copies the image file passed over a unix socket instead of TransferData\n");
+    printf ("  -K    pre-shared AES-CTR key, 32 or 64 hex digits (AES-128 / AES-256), encrypts every download\n");
+    printf ("  -T    ISO-TP over a virtual CAN bus, frame data length 8 (CAN) or 64 (CAN FD), block size, STmin\n");
+    printf ("  -D    DoIP over TCP on 127.0.0.1, 0 picks a free port (%u is the standard one)\n", DOIP_PORT);
+    printf ("  -X    run the server as its own process, e.g. -X \"./uds_server -L 65000\", frames cross a shared memory ring\n");
+    printf ("  -v    CheckMemory algorithm: crc32 (default), crc32c, xxh64, sha256\n");
+    printf ("  -g    join hex/srec/elf segments closer than gap bytes (default 4096)\n");
+    printf ("  -B    flash address stored at offset 0 of out.dat (default 0x1D0000)\n");
+    printf ("  -L    server maxNumberOfBlockLength (default 3842)\n");
+    printf ("  -w    TransferData blocks in flight, 1..%u (default 1, stop-and-wait)\n", FW_WINDOW_MAX);
+#ifdef UDS_FAULT_TEST
+    printf ("  -F    test build, fault on the n-th TransferData request: flip,n damages its first data byte, drop,n loses it\n");
+#endif
+    printf ("  file  raw image, fw_pack package, Intel HEX, S-record or ELF, '-' for stdin (default test.dat)\n");
+}
+
+/* dl[,bs[,stmin]] */
+static int parse_isotp (const char *str)
+{
+    uint32_t val[3] = { 0, 0, 0 };
+    char *end;
+    int n;
+
+    for (n = 0; n < 3; n++)
+    {
+        val[n] = (uint32_t)strtoul (str, &end, 0);
+        if ((end == str) || ((*end != ',') && (*end != '\0')) || ((n > 0) && (val[n] > 0xFF)))
+        {
+            return -1;
+        }
+        if (*end == '\0')
+        {
+            break;
+        }
+        str = end + 1;
+    }
+    if (n == 3)
+    {
+        return -1;
+    }
+    return uds_hal_set_isotp (val[0], (uint8_t)val[1], (uint8_t)val[2]);
+}
+
+#ifdef UDS_FAULT_TEST
+#define TEST_OPTS   "F:"
+
+/* flip,n or drop,n */
+static int parse_fault (const char *str)
+{
+    uint32_t n;
+    char *end;
+    int drop;
+
+    if (strncmp (str, "flip,", 5) == 0)
+    {
+        drop = 0;
+    }
+    else if (strncmp (str, "drop,", 5) == 0)
+    {
+        drop = 1;
+    }
+    else
+    {
+        return -1;
+    }
+    n = (uint32_t)strtoul (str + 5, &end, 0);
+    if ((end == str + 5) || (*end != '\0') || (n == 0))
+    {
+        return -1;
+    }
+    uds_hal_set_fault (drop, n);
+    return 0;
+}
+#else
+#define TEST_OPTS   ""
+#endif
+
+int main (int argc, char *argv[])
+{
+    uint32_t opt = 0;
+    char *file = "test.dat";
+    char *server = NULL;
+    uint8_t key[32];
+    int c, key_len, isotp = 0, doip = 0;
+
+    while ((c = getopt(argc, argv, "pHsEcrzdulK:T:D:X:" TEST_OPTS "v:g:B:L:w:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'p':
+                opt |= FW_OPT_POPULATE;
+                break;
+            case 'H':
+                opt |= FW_OPT_HUGEPAGE;
+                break;
+            case 's':
+                opt |= FW_OPT_STREAM;
+                break;
+            case 'E':
+                opt |= FW_OPT_SEND_BLANK;
+                break;
+            case 'c':
+                opt |= FW_OPT_BLOCK_TAG;
+                break;
+            case 'r':
+                opt |= FW_OPT_RESUME;
+                break;
+            case 'z':
+                opt |= FW_OPT_COMPRESS;
+                break;
+            case 'd':
+                opt |= FW_OPT_DELTA;
+                break;
+            case 'u':
+                opt |= FW_OPT_READBACK;
+                break;
+            case 'l':
+                opt |= FW_OPT_LOCAL;
+                break;
+            case 'K':
+                /* the simulated server is provisioned with the same key */
+                key_len = parse_hex (optarg, key, sizeof(key));
+                if ((key_len < 0) || (fw_update_set_key (key, key_len) != 0) || (uds_set_aes_key (key, key_len) != 0))
+                {
+                    printf ("key must be 32 or 64 hex digits\n");
+                    return 1;
+                }
+                break;
+            case 'T':
+                if (parse_isotp (optarg) != 0)
+                {
+                    printf ("ISO-TP must be dl[,bs[,stmin]], dl 8 or 64\n");
+                    return 1;
+                }
+                isotp = 1;
+                break;
+            case 'D':
+                uds_hal_set_doip ((uint16_t)strtoul (optarg, NULL, 0));
+                doip = 1;
+                break;
+            case 'X':
+                server = optarg;
+                break;
+#ifdef UDS_FAULT_TEST
+            case 'F':
+                if (parse_fault (optarg) != 0)
+                {
+                    printf ("fault must be flip,n or drop,n, n from 1\n");
+                    return 1;
+                }
+                break;
+#endif
+            case 'v':
+                if (fw_update_set_verify (optarg) != 0)
+                {
+                    printf ("unknown verification algorithm: %s\n", optarg);
+                    return 1;
+                }
+                break;
+            case 'g':
+                fw_update_set_seg_gap ((uint32_t)strtoul (optarg, NULL, 0));
+                break;
+            case 'B':
+                uds_set_flash_base ((uint32_t)strtoul (optarg, NULL, 0));
+                break;
+            case 'L':
+                uds_set_max_block_len ((uint32_t)strtoul (optarg, NULL, 0));
+                break;
+            case 'w':
+                if (fw_update_set_window ((uint32_t)strtoul (optarg, NULL, 0)) != 0)
+                {
+                    printf ("window must be 1..%u\n", FW_WINDOW_MAX);
+                    return 1;
+                }
+                break;
+            default:
+                usage (argv[0]);
+                return 1;
+        }
+    }
+    if (isotp + doip + (server != NULL) > 1)
+    {
+        printf ("-T, -D and -X select different transports\n");
+        return 1;
+    }
+    if (optind < argc)
+    {
+        file = argv[optind];
+    }
+    if (file[0] == '-' && file[1] == '\0')
+    {
+        file = "/dev/stdin";
+    }
+
+    if (server != NULL)
+    {
+        /* the server process owns the flash, only the tester's transport is set up here */
+        if (uds_hal_spawn_server (server) != 0)
+        {
+            return 1;
+        }
+        uds_hal_init ();
+    }
+    else
+    {
+        if (opt & FW_OPT_LOCAL)
+        {
+            uds_set_local ((int)getpid ());
+        }
+        uds_init ();
+    }
+    fw_update_set_options (opt);
+    fw_update_start (file);
     while (!is_fw_update_done ())
     {
-        uds_poll ();
+        if (server == NULL)
+        {
+            uds_poll ();
+        }
         uds_poll_client ();
         fw_update_schedule ();
-        os_delay (1);
+        uds_hal_wait (1);
     }
+    uds_hal_close ();
+    uds_hal_report ();
     return 0;
 }
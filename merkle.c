@@ -0,0 +1,157 @@
+#include <stdlib.h>
+#include "util.h"
+#include "merkle.h"
+
+/* room for n leaves */
+static int merkle_reserve (merkle_t *t, uint32_t n)
+{
+    uint32_t cap = (t->leaf_cap != 0) ? t->leaf_cap : 1024;
+    uint64_t *leaf;
+
+    if (n <= t->leaf_cap)
+    {
+        return 0;
+    }
+    while (cap < n)
+    {
+        cap *= 2;
+    }
+    leaf = realloc (t->leaf, (size_t)cap * sizeof(*leaf));
+    if (leaf == NULL)
+    {
+        return -1;
+    }
+    t->leaf = leaf;
+    t->leaf_cap = cap;
+    return 0;
+}
+
+/* the buffers are kept for the next region */
+void merkle_reset (merkle_t *t)
+{
+    t->len = 0;
+    t->fill = 0;
+    t->full = 0;
+    t->built = 0;
+    t->levels = 0;
+    t->cnt[0] = 0;
+}
+
+/* data continues the region, -1 when the leaves can not grow */
+int merkle_update (merkle_t *t, const uint8_t *data, uint32_t len)
+{
+    uint32_t n;
+
+    t->built = 0;
+    while (len > 0)
+    {
+        if (merkle_reserve (t, t->full + 1) != 0)
+        {
+            return -1;
+        }
+        n = my_min(MERKLE_LEAF_LEN - t->fill, len);
+        if ((t->fill == 0) && (n == MERKLE_LEAF_LEN))
+        {
+            t->leaf[t->full++] = xxh64 (data, n, 0);
+        }
+        else
+        {
+            if (t->fill == 0)
+            {
+                xxh64_init (&t->ctx, 0);
+            }
+            xxh64_update (&t->ctx, data, n);
+            t->fill += n;
+            if (t->fill == MERKLE_LEAF_LEN)
+            {
+                t->leaf[t->full++] = xxh64_final (&t->ctx);
+                t->fill = 0;
+            }
+        }
+        t->len += n;
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* levels up to the root over everything hashed so far, more data may follow */
+int merkle_build (merkle_t *t)
+{
+    uint8_t buf[MERKLE_FANOUT * MERKLE_DIGEST_LEN];
+    uint32_t leaves = t->full + (t->fill != 0);
+    uint32_t total = 0, n, l, i, j, first;
+    const uint64_t *child;
+    uint64_t *node;
+
+    if (t->built)
+    {
+        return 0;
+    }
+    if (merkle_reserve (t, leaves) != 0)
+    {
+        return -1;
+    }
+    if (t->fill != 0)
+    {
+        t->leaf[t->full] = xxh64_final (&t->ctx);
+    }
+    t->levels = (leaves != 0);
+    t->cnt[0] = leaves;
+    t->off[0] = 0;
+    for (n = leaves; n > 1; n = (n + MERKLE_FANOUT - 1) / MERKLE_FANOUT)
+    {
+        if (t->levels == MERKLE_MAX_LEVELS)
+        {
+            return -1;
+        }
+        t->off[t->levels++] = total;
+        total += (n + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+    }
+    if (total > t->node_cap)
+    {
+        node = realloc (t->node, (size_t)total * sizeof(*node));
+        if (node == NULL)
+        {
+            return -1;
+        }
+        t->node = node;
+        t->node_cap = total;
+    }
+    n = leaves;
+    for (l = 1; l < t->levels; l++)
+    {
+        child = merkle_level (t, l - 1);
+        node = t->node + t->off[l];
+        t->cnt[l] = (n + MERKLE_FANOUT - 1) / MERKLE_FANOUT;
+        for (i = 0; i < t->cnt[l]; i++)
+        {
+            first = i * MERKLE_FANOUT;
+            for (j = 0; (j < MERKLE_FANOUT) && (first + j < n); j++)
+            {
+                put_u64(&buf[j * MERKLE_DIGEST_LEN], child[first + j]);
+            }
+            node[i] = xxh64 (buf, j * MERKLE_DIGEST_LEN, l);
+        }
+        n = t->cnt[l];
+    }
+    t->built = 1;
+    return 0;
+}
+
+/* digests of a level, t->cnt[level] of them, after merkle_build() */
+const uint64_t *merkle_level (const merkle_t *t, uint32_t level)
+{
+    return (level == 0) ? t->leaf : t->node + t->off[level];
+}
+
+void merkle_free (merkle_t *t)
+{
+    free (t->leaf);
+    free (t->node);
+    t->leaf = NULL;
+    t->node = NULL;
+    t->leaf_cap = 0;
+    t->node_cap = 0;
+    merkle_reset (t);
+}
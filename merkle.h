@@ -0,0 +1,48 @@
+#ifndef _MERKLE_H_
+#define _MERKLE_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+#include "verify.h"
+
+/*
+    hash tree over a download region
+    leaf  : xxh64(seed 0) of MERKLE_LEAF_LEN bytes, the last one may be shorter
+    node  : xxh64(seed level) of its children digests, 8 bytes big endian each
+    the top level holds the root, a region of one leaf is its own root
+*/
+#define MERKLE_LEAF_LEN     (4 * 1024)
+#define MERKLE_FANOUT       16
+#define MERKLE_MAX_LEVELS   8       /* 16^7 leaves cover every 32 bit region */
+#define MERKLE_DIGEST_LEN   8
+
+typedef struct
+{
+    uint32_t len;                   /* bytes hashed */
+    uint64_t *leaf;                 /* complete leaves, the partial one is added by merkle_build() */
+    uint32_t leaf_cap;
+    uint32_t full;                  /* complete leaves */
+    xxh64_ctx_t ctx;                /* leaf being filled */
+    uint32_t fill;
+    uint64_t *node;                 /* every level above the leaves */
+    uint32_t node_cap;
+    int built;                      /* levels match len */
+    uint32_t levels;                /* leaf level included, 0 when nothing was hashed */
+    uint32_t cnt[MERKLE_MAX_LEVELS];    /* digests per level, after merkle_build() */
+    uint32_t off[MERKLE_MAX_LEVELS];    /* level start in node, level 0 is leaf */
+} merkle_t;
+
+void merkle_reset (merkle_t *t);
+int merkle_update (merkle_t *t, const uint8_t *data, uint32_t len);
+int merkle_build (merkle_t *t);
+const uint64_t *merkle_level (const merkle_t *t, uint32_t level);
+void merkle_free (merkle_t *t);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
@@ -0,0 +1,205 @@
+#include <string.h>
+#include <pthread.h>
+#include "util.h"
+#include "sha256.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SHA256_HAVE_SHANI
+#endif
+
+typedef void (*sha256_kernel_t)(uint32_t state[8], const uint8_t *data, uint32_t blocks);
+
+static sha256_kernel_t s_sha256_kernel;
+static const char *s_sha256_kernel_name;
+static pthread_once_t s_sha256_once = PTHREAD_ONCE_INIT;
+
+static const uint32_t s_k[64] =
+{
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROR(x, n)   (((x) >> (n)) | ((x) << (32 - (n))))
+#define S0(x)       (ROR(x, 2) ^ ROR(x, 13) ^ ROR(x, 22))
+#define S1(x)       (ROR(x, 6) ^ ROR(x, 11) ^ ROR(x, 25))
+#define G0(x)       (ROR(x, 7) ^ ROR(x, 18) ^ ((x) >> 3))
+#define G1(x)       (ROR(x, 17) ^ ROR(x, 19) ^ ((x) >> 10))
+
+static void sha256_blocks_c (uint32_t state[8], const uint8_t *data, uint32_t blocks)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    while (blocks--)
+    {
+        for (i = 0; i < 16; i++)
+        {
+            w[i] = get_u32((void *)(data + i * 4));
+        }
+        for (i = 16; i < 64; i++)
+        {
+            w[i] = G1(w[i - 2]) + w[i - 7] + G0(w[i - 15]) + w[i - 16];
+        }
+        a = state[0]; b = state[1]; c = state[2]; d = state[3];
+        e = state[4]; f = state[5]; g = state[6]; h = state[7];
+        for (i = 0; i < 64; i++)
+        {
+            t1 = h + S1(e) + ((e & f) ^ (~e & g)) + s_k[i] + w[i];
+            t2 = S0(a) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        data += SHA256_BLOCK_LEN;
+    }
+}
+
+#ifdef SHA256_HAVE_SHANI
+/* SHA extensions, state kept as ABEF / CDGH lanes for sha256rnds2 */
+__attribute__((target("sha,sse4.1")))
+static void sha256_blocks_shani (uint32_t state[8], const uint8_t *data, uint32_t blocks)
+{
+    const __m128i bswap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, abef, cdgh, msg, tmp, w[4];
+    int g;
+
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xB1);   /* CDAB */
+    state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1B); /* EFGH */
+    state0 = _mm_alignr_epi8(tmp, state1, 8);                                       /* ABEF */
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);                                    /* CDGH */
+
+    while (blocks--)
+    {
+        abef = state0;
+        cdgh = state1;
+        for (g = 0; g < 4; g++)
+        {
+            w[g] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + g * 16)), bswap);
+        }
+        /* 16 groups of 4 rounds, w[g % 4] is replaced by the schedule of group g + 4 */
+        for (g = 0; g < 16; g++)
+        {
+            msg = _mm_add_epi32(w[g & 3], _mm_loadu_si128((const __m128i *)&s_k[g * 4]));
+            state1 = _mm_sha256rnds2_epu32(state1, state0, msg);
+            state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(msg, 0x0E));
+            if (g < 12)
+            {
+                tmp = _mm_add_epi32(_mm_sha256msg1_epu32(w[g & 3], w[(g + 1) & 3]),
+                                    _mm_alignr_epi8(w[(g + 3) & 3], w[(g + 2) & 3], 4));
+                w[g & 3] = _mm_sha256msg2_epu32(tmp, w[(g + 3) & 3]);
+            }
+        }
+        state0 = _mm_add_epi32(state0, abef);
+        state1 = _mm_add_epi32(state1, cdgh);
+        data += SHA256_BLOCK_LEN;
+    }
+
+    tmp = _mm_shuffle_epi32(state0, 0x1B);          /* FEBA */
+    state1 = _mm_shuffle_epi32(state1, 0xB1);       /* DCHG */
+    state0 = _mm_blend_epi16(tmp, state1, 0xF0);    /* DCBA */
+    state1 = _mm_alignr_epi8(state1, tmp, 8);       /* HGFE */
+    _mm_storeu_si128((__m128i *)&state[0], state0);
+    _mm_storeu_si128((__m128i *)&state[4], state1);
+}
+#endif
+
+static void sha256_kernel_init (void)
+{
+    s_sha256_kernel = sha256_blocks_c;
+    s_sha256_kernel_name = "c";
+#ifdef SHA256_HAVE_SHANI
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"))
+    {
+        s_sha256_kernel = sha256_blocks_shani;
+        s_sha256_kernel_name = "sha-ni";
+    }
+#endif
+}
+
+const char *sha256_kernel_name (void)
+{
+    pthread_once(&s_sha256_once, sha256_kernel_init);
+    return s_sha256_kernel_name;
+}
+
+void sha256_init (sha256_ctx_t *ctx)
+{
+    static const uint32_t iv[8] =
+    {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    pthread_once(&s_sha256_once, sha256_kernel_init);
+    memcpy (ctx->state, iv, sizeof(iv));
+    ctx->total = 0;
+    ctx->buf_len = 0;
+}
+
+void sha256_update (sha256_ctx_t *ctx, const void *data, uint32_t len)
+{
+    const uint8_t *p = data;
+    uint32_t n;
+
+    ctx->total += len;
+    if (ctx->buf_len > 0)
+    {
+        n = my_min(len, SHA256_BLOCK_LEN - ctx->buf_len);
+        memcpy (ctx->buf + ctx->buf_len, p, n);
+        ctx->buf_len += n;
+        p += n;
+        len -= n;
+        if (ctx->buf_len < SHA256_BLOCK_LEN)
+        {
+            return;
+        }
+        s_sha256_kernel (ctx->state, ctx->buf, 1);
+        ctx->buf_len = 0;
+    }
+    n = len / SHA256_BLOCK_LEN;
+    if (n > 0)
+    {
+        s_sha256_kernel (ctx->state, p, n);
+        p += n * SHA256_BLOCK_LEN;
+        len -= n * SHA256_BLOCK_LEN;
+    }
+    memcpy (ctx->buf, p, len);
+    ctx->buf_len = len;
+}
+
+/* the context is left untouched, a running digest can be read at any time */
+void sha256_final (const sha256_ctx_t *ctx, uint8_t *digest)
+{
+    uint8_t pad[2 * SHA256_BLOCK_LEN];
+    uint32_t state[8], n;
+    int i;
+
+    memcpy (state, ctx->state, sizeof(state));
+    memset (pad, 0, sizeof(pad));
+    memcpy (pad, ctx->buf, ctx->buf_len);
+    pad[ctx->buf_len] = 0x80;
+    n = (ctx->buf_len < SHA256_BLOCK_LEN - 8) ? SHA256_BLOCK_LEN : (2 * SHA256_BLOCK_LEN);
+    put_u64(&pad[n - 8], ctx->total * 8);
+    s_sha256_kernel (state, pad, n / SHA256_BLOCK_LEN);
+    for (i = 0; i < 8; i++)
+    {
+        put_u32(&digest[i * 4], state[i]);
+    }
+}
+
+void sha256 (const void *data, uint32_t len, uint8_t *digest)
+{
+    sha256_ctx_t ctx;
+
+    sha256_init (&ctx);
+    sha256_update (&ctx, data, len);
+    sha256_final (&ctx, digest);
+}
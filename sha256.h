@@ -0,0 +1,32 @@
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+
+#define SHA256_DIGEST_LEN   32
+#define SHA256_BLOCK_LEN    64
+
+/* plain data only, a context can be copied or saved as is */
+typedef struct
+{
+    uint32_t state[8];
+    uint64_t total;
+    uint8_t  buf[SHA256_BLOCK_LEN];
+    uint32_t buf_len;
+} sha256_ctx_t;
+
+void sha256_init (sha256_ctx_t *ctx);
+void sha256_update (sha256_ctx_t *ctx, const void *data, uint32_t len);
+void sha256_final (const sha256_ctx_t *ctx, uint8_t *digest);
+void sha256 (const void *data, uint32_t len, uint8_t *digest);
+const char *sha256_kernel_name (void);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif
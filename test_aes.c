@@ -0,0 +1,111 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "aes.h"
+
+/* AES-CTR against the NIST SP 800-38A vectors, and pieces of a stream against the whole, run by 'make test' */
+
+static int s_fail;
+
+#define CHECK(cond)     do { if (!(cond)) { printf ("FAIL  %s:%d  %s\n", __FILE__, __LINE__, #cond); s_fail = 1; } } while (0)
+
+static const char *s_ctr = "f0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+static const char *s_plain = "6bc1bee22e409f96e93d7e117393172aae2d8a571e03ac9c9eb76fac45af8e51"
+                             "30c81c46a35ce411e5fbc1191a0a52eff69f2445df4f9b17ad2b417be66c3710";
+
+/* F.5.1 CTR-AES128.Encrypt and F.5.5 CTR-AES256.Encrypt */
+static void test_vector (const char *key_hex, const char *cipher_hex)
+{
+    uint8_t raw[32], ctr[AES_BLOCK_LEN], data[64], cipher[64];
+    aes_key_t key;
+    int key_len = parse_hex (key_hex, raw, sizeof(raw));
+    uint32_t off;
+
+    CHECK(aes_set_key (&key, raw, (uint32_t)key_len) == 0);
+    parse_hex (s_ctr, ctr, sizeof(ctr));
+    parse_hex (cipher_hex, cipher, sizeof(cipher));
+
+    parse_hex (s_plain, data, sizeof(data));
+    aes_ctr_xor (&key, ctr, 0, data, sizeof(data));
+    CHECK(memcmp (data, cipher, sizeof(cipher)) == 0);
+
+    /* the same stream in odd pieces, each placed by its offset */
+    parse_hex (s_plain, data, sizeof(data));
+    for (off = 0; off < sizeof(data); off += 7)
+    {
+        aes_ctr_xor (&key, ctr, off, data + off, my_min((uint32_t)sizeof(data) - off, 7u));
+    }
+    CHECK(memcmp (data, cipher, sizeof(cipher)) == 0);
+
+    /* CTR is its own inverse */
+    aes_ctr_xor (&key, ctr, 0, data, sizeof(data));
+    parse_hex (s_plain, cipher, sizeof(cipher));
+    CHECK(memcmp (data, cipher, sizeof(cipher)) == 0);
+}
+
+/* the wide kernels against single blocks, across the carry from the low into the high counter half */
+static void test_kernel (void)
+{
+    static uint8_t whole[64 * 1024 + 5], piece[sizeof(whole)];
+    uint8_t raw[16] = { 1, 2, 3, 4 }, ctr[AES_BLOCK_LEN], next[AES_BLOCK_LEN];
+    aes_key_t key;
+    uint32_t off;
+
+    aes_set_key (&key, raw, sizeof(raw));
+    memset (ctr, 0xFF, sizeof(ctr));
+    ctr[7] = 0x10;
+    for (off = 0; off < sizeof(whole); off++)
+    {
+        whole[off] = (uint8_t)(off * 7);
+    }
+    memcpy (piece, whole, sizeof(whole));
+    aes_ctr_xor (&key, ctr, 3, whole, sizeof(whole));
+    for (off = 0; off < sizeof(piece); off += AES_BLOCK_LEN - 3)
+    {
+        aes_ctr_xor (&key, ctr, 3 + off, piece + off, my_min((uint32_t)sizeof(piece) - off, AES_BLOCK_LEN - 3u));
+    }
+    CHECK(memcmp (whole, piece, sizeof(whole)) == 0);
+
+    /* block 1 of ctr = ..10 FFFF..FF is block 0 of ..11 0000..00 */
+    memset (whole, 0, 32);
+    memset (piece, 0, 16);
+    memcpy (next, ctr, sizeof(next));
+    next[7] = 0x11;
+    memset (&next[8], 0, 8);
+    aes_ctr_xor (&key, ctr, 0, whole, 32);
+    aes_ctr_xor (&key, next, 0, piece, 16);
+    CHECK(memcmp (whole + 16, piece, 16) == 0);
+}
+
+/* every download of a nonce starts its own counter range */
+static void test_ctr_start (void)
+{
+    uint8_t nonce[AES_BLOCK_LEN], a[AES_BLOCK_LEN], b[AES_BLOCK_LEN];
+
+    memset (nonce, 0x5A, sizeof(nonce));
+    aes_ctr_start (a, nonce, 0, 0x1D0000);
+    aes_ctr_start (b, nonce, 1, 0x1D0000);
+    CHECK(memcmp (a, b, sizeof(a)) != 0);
+    CHECK(memcmp (&a[8], &nonce[8], 8) == 0);
+    aes_ctr_start (b, nonce, 0, 0x1D0001);
+    CHECK(memcmp (a, b, sizeof(a)) != 0);
+}
+
+int main (void)
+{
+    aes_key_t key;
+
+    CHECK(aes_set_key (&key, (const uint8_t *)"0123456789abcdef", 24) != 0);
+    test_vector ("2b7e151628aed2a6abf7158809cf4f3c",
+                 "874d6191b620e3261bef6864990db6ce9806f66b7970fdff8617187bb9fffdff"
+                 "5ae4df3edbd5d35e5b4f09020db03eab1e031dda2fbe03d1792170a0f3009cee");
+    test_vector ("603deb1015ca71be2b73aef0857d77811f352c073b6108d72d9810a30914dff4",
+                 "601ec313775789a5b7a7f504bbf3d228f443e3ca4d62b59aca84e990cacaf5c5"
+                 "2b0930daa23de94ce87017ba2d84988ddfc9c58db67aada613c2dd08457941a6");
+    test_kernel ();
+    test_ctr_start ();
+    printf ("%s  aes (%s)\n", s_fail ? "FAIL" : "PASS", aes_kernel_name ());
+    return s_fail;
+}
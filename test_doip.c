@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+
+#include "util.h"
+#include "doip.h"
+
+/* DoIP framing byte by byte on a socket pair, then a tester and an entity over TCP loopback, run by 'make test' */
+
+static int s_fail;
+
+#define CHECK(cond)     do { if (!(cond)) { printf ("FAIL  %s:%d  %s\n", __FILE__, __LINE__, #cond); s_fail = 1; } } while (0)
+
+#define MAX_LEN     (64 * 1024)
+
+static uint8_t s_payload[MAX_LEN];
+
+/* what the entity wrote, as a hex string, "" when nothing came */
+static const char *raw_read (int fd)
+{
+    static char hex[256];
+    uint8_t buf[100];
+    ssize_t n = recv (fd, buf, sizeof(buf), MSG_DONTWAIT);
+    ssize_t i;
+
+    hex[0] = '\0';
+    for (i = 0; i < n; i++)
+    {
+        sprintf (&hex[2 * i], "%02X", buf[i]);
+    }
+    return hex;
+}
+
+static void raw_write (int fd, const char *hex)
+{
+    uint8_t buf[100];
+    int n = parse_hex (hex, buf, sizeof(buf));
+
+    CHECK(write (fd, buf, (size_t)n) == n);
+}
+
+static void test_entity_framing (void)
+{
+    static doip_conn_t entity;
+    int sv[2];
+
+    CHECK(socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl (sv[0], F_SETFL, fcntl (sv[0], F_GETFL) | O_NONBLOCK);
+    CHECK(doip_conn_init (&entity, sv[0], 1, DOIP_ADDR_ENTITY, DOIP_ADDR_TESTER, MAX_LEN) == 0);
+
+    /* a diagnostic message before routing activation is refused with source address unknown */
+    raw_write (sv[1], "02FD8001000000050E00100122");
+    CHECK(doip_receive (&entity, s_payload) == 0);
+    CHECK(strcmp (raw_read (sv[1]), "02FD8003000000051001" "0E0002") == 0);
+
+    /* routing activation request, response with the entity address and code 0x10 */
+    raw_write (sv[1], "02FD0005000000070E0000" "00000000");
+    CHECK(doip_receive (&entity, s_payload) == 0);
+    CHECK(strcmp (raw_read (sv[1]), "02FD0006000000090E001001" "1000000000") == 0);
+
+    /* a diagnostic message split across writes only comes out once complete, then it is acked */
+    raw_write (sv[1], "02FD80");
+    CHECK(doip_receive (&entity, s_payload) == 0);
+    raw_write (sv[1], "01000000070E00");
+    CHECK(doip_receive (&entity, s_payload) == 0);
+    raw_write (sv[1], "1001" "3601AB");
+    CHECK(doip_receive (&entity, s_payload) == 3);
+    CHECK(memcmp (s_payload, "\x36\x01\xAB", 3) == 0);
+    CHECK(strcmp (raw_read (sv[1]), "02FD800200000005" "10010E0000") == 0);
+
+    /* two messages in one write */
+    raw_write (sv[1], "02FD8001000000050E00100111" "02FD8001000000050E00100122");
+    CHECK((doip_receive (&entity, s_payload) == 1) && (s_payload[0] == 0x11));
+    CHECK((doip_receive (&entity, s_payload) == 1) && (s_payload[0] == 0x22));
+    raw_read (sv[1]);
+
+    /* unknown target address */
+    raw_write (sv[1], "02FD8001000000050E00999922");
+    CHECK(doip_receive (&entity, s_payload) == 0);
+    CHECK(strcmp (raw_read (sv[1]), "02FD800300000005" "10010E0003") == 0);
+
+    /* longer than the entity accepts : generic header nack 0x02, the connection is closed */
+    raw_write (sv[1], "02FD800100100005");
+    CHECK(doip_receive (&entity, s_payload) == 0);
+    CHECK(strcmp (raw_read (sv[1]), "02FD000000000001" "02") == 0);
+    CHECK(entity.fd < 0);
+    close (sv[1]);
+
+    /* wrong protocol version pattern : generic header nack 0x00 */
+    CHECK(socketpair (AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl (sv[0], F_SETFL, fcntl (sv[0], F_GETFL) | O_NONBLOCK);
+    CHECK(doip_conn_init (&entity, sv[0], 1, DOIP_ADDR_ENTITY, DOIP_ADDR_TESTER, MAX_LEN) == 0);
+    raw_write (sv[1], "03FD8001000000050E00100122");
+    CHECK(doip_receive (&entity, s_payload) == 0);
+    CHECK(strcmp (raw_read (sv[1]), "02FD000000000001" "00") == 0);
+    CHECK(entity.fd < 0);
+    close (sv[1]);
+}
+
+/* many large messages before the entity reads any, the tester keeps what the socket does not take */
+static void test_loopback (void)
+{
+    static doip_conn_t tester, entity;
+    static uint8_t msg[MAX_LEN];
+    uint16_t port = 0;
+    uint32_t i, got = 0, spins = 0;
+    int lfd, fd = -1, len;
+
+    lfd = doip_listen (&port);
+    CHECK(lfd >= 0);
+    CHECK(doip_conn_init (&tester, doip_connect (port), 0, DOIP_ADDR_TESTER, DOIP_ADDR_ENTITY, MAX_LEN) == 0);
+    while ((fd < 0) && (spins++ < 100000))
+    {
+        fd = doip_accept (lfd);
+    }
+    CHECK(doip_conn_init (&entity, fd, 1, DOIP_ADDR_ENTITY, DOIP_ADDR_TESTER, MAX_LEN) == 0);
+
+    /* queued behind the routing activation */
+    CHECK(doip_activate (&tester) == 0);
+    for (i = 0; i < 64; i++)
+    {
+        memset (msg, (int)i, sizeof(msg));
+        CHECK(doip_send (&tester, msg, sizeof(msg)) == 0);
+    }
+    CHECK(tester.tx_len > 0);
+
+    for (spins = 0; (got < 64) && (spins < 1000000); spins++)
+    {
+        doip_receive (&tester, msg);
+        len = doip_receive (&entity, s_payload);
+        if (len > 0)
+        {
+            CHECK((len == MAX_LEN) && (s_payload[0] == got) && (s_payload[MAX_LEN - 1] == got));
+            got++;
+        }
+    }
+    CHECK(got == 64);
+
+    /* and the other way, a short answer */
+    CHECK(doip_send (&entity, (uint8_t *)"\x76\x01", 2) == 0);
+    for (spins = 0, len = 0; (len == 0) && (spins < 100000); spins++)
+    {
+        len = doip_receive (&tester, s_payload);
+    }
+    CHECK((len == 2) && (s_payload[0] == 0x76));
+    CHECK((tester.stats.msgs == 64) && (tester.stats.acks > 0));
+
+    doip_close (&tester);
+    doip_close (&entity);
+    close (lfd);
+}
+
+int main (void)
+{
+    test_entity_framing ();
+    test_loopback ();
+    printf ("%s  doip\n", s_fail ? "FAIL" : "PASS");
+    return s_fail;
+}
@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "util.h"
+#include "image_fmt.h"
+
+/* Intel HEX / S-record / ELF parsers on small images and on damaged ones, run by 'make test' */
+
+static int s_fail;
+
+#define CHECK(cond)     do { if (!(cond)) { printf ("FAIL  %s:%d  %s\n", __FILE__, __LINE__, #cond); s_fail = 1; } } while (0)
+
+static char s_path[] = "/tmp/test_image_fmt.XXXXXX";
+
+static const char *write_text (const char *text)
+{
+    FILE *fp = fopen (s_path, "w");
+
+    fputs (text, fp);
+    fclose (fp);
+    return s_path;
+}
+
+static void test_ihex (void)
+{
+    img_seg_list_t list = { 0 };
+    char line[700];
+    int i;
+
+    /* two data records behind an extended linear address, a start address and the end of file */
+    CHECK(img_parse_ihex (write_text (":020000040800F2\n"
+                                      ":0400000001020304F2\n"
+                                      ":02000400AABB95\n"
+                                      ":0400000508000000EF\n"
+                                      ":00000001FF\n"), &list) == 0);
+    CHECK(list.count == 1);
+    if (list.count == 1)
+    {
+        CHECK(list.seg[0].addr == 0x08000000);
+        CHECK(list.seg[0].len == 6);
+        CHECK(memcmp (list.seg[0].data, "\x01\x02\x03\x04\xAA\xBB", 6) == 0);
+    }
+    img_seg_free (&list);
+
+    CHECK(img_parse_ihex (write_text (":0400000001020304F3\n:00000001FF\n"), &list) != 0);   /* checksum */
+    img_seg_free (&list);
+    CHECK(img_parse_ihex (write_text (":0400000001020304F2\n"), &list) != 0);                /* no end record */
+    img_seg_free (&list);
+    CHECK(img_parse_ihex (write_text (":0500000001020304F2\n:00000001FF\n"), &list) != 0);   /* count and length */
+    img_seg_free (&list);
+    CHECK(img_parse_ihex (write_text (":04000000010G0304F2\n:00000001FF\n"), &list) != 0);   /* not hex */
+    img_seg_free (&list);
+
+    /* longer than any record, it must be refused before it is decoded */
+    line[0] = ':';
+    for (i = 1; i < 599; i++)
+    {
+        line[i] = 'F';
+    }
+    line[i++] = '\n';
+    line[i] = '\0';
+    CHECK(img_parse_ihex (write_text (line), &list) != 0);
+    img_seg_free (&list);
+}
+
+static void test_srec (void)
+{
+    img_seg_list_t list = { 0 };
+    char line[700];
+    int i;
+
+    CHECK(img_parse_srec (write_text ("S00600004844521B\n"
+                                      "S107100001020304DE\n"
+                                      "S30900020000AABBCCDDE6\n"
+                                      "S9031000EC\n"), &list) == 0);
+    CHECK(list.count == 2);
+    if (list.count == 2)
+    {
+        CHECK((list.seg[0].addr == 0x1000) && (list.seg[0].len == 4));
+        CHECK((list.seg[1].addr == 0x00020000) && (list.seg[1].len == 4));
+        CHECK(memcmp (list.seg[1].data, "\xAA\xBB\xCC\xDD", 4) == 0);
+    }
+    img_seg_free (&list);
+
+    CHECK(img_parse_srec (write_text ("S107100001020304DF\n"), &list) != 0);    /* checksum */
+    img_seg_free (&list);
+    CHECK(img_parse_srec (write_text ("S10210ED\n"), &list) != 0);            /* count shorter than the address */
+    img_seg_free (&list);
+
+    line[0] = 'S';
+    line[1] = '1';
+    for (i = 2; i < 600; i++)
+    {
+        line[i] = 'F';
+    }
+    line[i++] = '\n';
+    line[i] = '\0';
+    CHECK(img_parse_srec (write_text (line), &list) != 0);
+    img_seg_free (&list);
+}
+
+/* ELF64 little endian, one PT_LOAD program header right behind the file header */
+static uint32_t make_elf64 (uint8_t *elf, uint64_t off, uint64_t paddr, uint64_t filesz)
+{
+    uint8_t *ph = elf + 64;
+
+    memset (elf, 0, 64 + 56 + 16);
+    memcpy (elf, "\x7F" "ELF\x02\x01\x01", 7);
+    elf[32] = 64;           /* e_phoff */
+    elf[54] = 56;           /* e_phentsize */
+    elf[56] = 1;            /* e_phnum */
+    ph[0] = 1;              /* PT_LOAD */
+    memcpy (ph + 8, &off, 8);
+    memcpy (ph + 24, &paddr, 8);
+    memcpy (ph + 32, &filesz, 8);
+    memcpy (elf + 120, "0123456789abcdef", 16);
+    return 64 + 56 + 16;
+}
+
+static void test_elf (void)
+{
+    img_seg_list_t list = { 0 };
+    uint8_t elf[64 + 56 + 16];
+    uint32_t len;
+
+    len = make_elf64 (elf, 120, 0x1D0000, 16);
+    CHECK(img_parse_elf (elf, len, &list) == 0);
+    CHECK((list.count == 1) && (list.seg[0].addr == 0x1D0000) && (list.seg[0].len == 16));
+    img_seg_free (&list);
+
+    /* offset + size wraps around 2^64 */
+    len = make_elf64 (elf, 0xFFFFFFFFFFFFF000ULL, 0x1D0000, 0x2000);
+    CHECK(img_parse_elf (elf, len, &list) != 0);
+    img_seg_free (&list);
+
+    /* runs past the end of the file */
+    len = make_elf64 (elf, 120, 0x1D0000, 17);
+    CHECK(img_parse_elf (elf, len, &list) != 0);
+    img_seg_free (&list);
+
+    /* beyond the 32 bit address space, also with a wrapping address */
+    len = make_elf64 (elf, 120, 0xFFFFFFF8ULL, 16);
+    CHECK(img_parse_elf (elf, len, &list) != 0);
+    img_seg_free (&list);
+    len = make_elf64 (elf, 120, 0xFFFFFFFFFFFFFFF8ULL, 16);
+    CHECK(img_parse_elf (elf, len, &list) != 0);
+    img_seg_free (&list);
+
+    /* program header table offset that wraps */
+    len = make_elf64 (elf, 120, 0x1D0000, 16);
+    memset (elf + 32, 0xFF, 8);
+    CHECK(img_parse_elf (elf, len, &list) != 0);
+    img_seg_free (&list);
+    CHECK(img_parse_elf (elf, 40, &list) != 0);
+}
+
+static void test_coalesce (void)
+{
+    img_seg_list_t list = { 0 };
+
+    CHECK(img_seg_add (&list, 0x2000, (const uint8_t *)"cd", 2, 1) == 0);
+    CHECK(img_seg_add (&list, 0x1000, (const uint8_t *)"ab", 2, 1) == 0);
+    CHECK(img_seg_add (&list, 0x9000, (const uint8_t *)"ef", 2, 1) == 0);
+    CHECK(img_seg_coalesce (&list, 4096, 0xFF) == 0);
+    CHECK(list.count == 2);
+    if (list.count == 2)
+    {
+        CHECK((list.seg[0].addr == 0x1000) && (list.seg[0].len == 0x1002));
+        CHECK((list.seg[0].data[2] == 0xFF) && (memcmp (list.seg[0].data + 0x1000, "cd", 2) == 0));
+        CHECK(list.seg[1].addr == 0x9000);
+    }
+    img_seg_free (&list);
+
+    CHECK(img_seg_add (&list, 0x1000, (const uint8_t *)"ab", 2, 1) == 0);
+    CHECK(img_seg_add (&list, 0x1001, (const uint8_t *)"cd", 2, 0) == 0);
+    CHECK(img_seg_coalesce (&list, 0, 0xFF) != 0);      /* overlap */
+    img_seg_free (&list);
+    CHECK(img_seg_add (&list, 0xFFFFFFFF, (const uint8_t *)"ab", 2, 1) != 0);
+    img_seg_free (&list);
+}
+
+int main (void)
+{
+    int fd = mkstemp (s_path);
+
+    if (fd < 0)
+    {
+        printf ("test_image_fmt: no temporary file\n");
+        return 1;
+    }
+    close (fd);
+    test_ihex ();
+    test_srec ();
+    test_elf ();
+    test_coalesce ();
+    unlink (s_path);
+    printf ("%s  image_fmt\n", s_fail ? "FAIL" : "PASS");
+    return s_fail;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "isotp.h"
+
+/* ISO-TP segmentation, flow control and malformed frames between two links on a captured bus, run by 'make test' */
+
+static int s_fail;
+
+#define CHECK(cond)     do { if (!(cond)) { printf ("FAIL  %s:%d  %s\n", __FILE__, __LINE__, #cond); s_fail = 1; } } while (0)
+
+#define BUS_LEN     8192
+#define ID_TESTER   0x7E0
+#define ID_ECU      0x7E8
+
+/* frames one node put on the bus, in order */
+typedef struct
+{
+    can_frame_t frame[BUS_LEN];
+    uint32_t head;
+    uint32_t tail;
+} bus_t;
+
+static bus_t s_to_ecu, s_to_tester;
+static isotp_link_t s_tester, s_ecu;
+static uint8_t s_tester_rx[8192], s_ecu_rx[8192];
+
+static int bus_put (void *arg, const can_frame_t *frame)
+{
+    bus_t *b = arg;
+
+    if (b->tail - b->head == BUS_LEN)
+    {
+        return -1;
+    }
+    b->frame[b->tail++ % BUS_LEN] = *frame;
+    return 0;
+}
+
+static void setup (uint32_t tx_dl, uint8_t bs, uint8_t stmin, uint32_t ecu_rx_cap)
+{
+    isotp_cfg_t cfg = { tx_dl, bs, stmin };
+
+    memset (&s_to_ecu, 0, sizeof(s_to_ecu));
+    memset (&s_to_tester, 0, sizeof(s_to_tester));
+    isotp_init (&s_tester, &cfg, ID_TESTER, ID_ECU, bus_put, &s_to_ecu, s_tester_rx, sizeof(s_tester_rx));
+    isotp_init (&s_ecu, &cfg, ID_ECU, ID_TESTER, bus_put, &s_to_tester, s_ecu_rx, ecu_rx_cap);
+}
+
+/* polls both sides and delivers every frame until the bus is quiet, the length the ECU received or -1 */
+static int run (void)
+{
+    int len, got = 0, idle = 0;
+
+    while (idle < 100000)
+    {
+        isotp_poll (&s_tester);
+        isotp_poll (&s_ecu);
+        if ((s_to_ecu.head == s_to_ecu.tail) && (s_to_tester.head == s_to_tester.tail))
+        {
+            if (isotp_tx_idle (&s_tester))
+            {
+                break;
+            }
+            idle++;     /* separation time */
+            continue;
+        }
+        while (s_to_ecu.head != s_to_ecu.tail)
+        {
+            len = isotp_on_frame (&s_ecu, &s_to_ecu.frame[s_to_ecu.head++ % BUS_LEN]);
+            if (len != 0)
+            {
+                got = len;
+            }
+        }
+        while (s_to_tester.head != s_to_tester.tail)
+        {
+            isotp_on_frame (&s_tester, &s_to_tester.frame[s_to_tester.head++ % BUS_LEN]);
+        }
+    }
+    return got;
+}
+
+static uint8_t s_msg[8192];
+
+static void test_single_frame (void)
+{
+    setup (ISOTP_CAN_DL, 0, 0, sizeof(s_ecu_rx));
+    CHECK(isotp_send (&s_tester, s_msg, 7) == 0);
+    CHECK(s_to_ecu.tail == 1);
+    CHECK((s_to_ecu.frame[0].id == ID_TESTER) && (s_to_ecu.frame[0].len == 8));
+    CHECK((s_to_ecu.frame[0].data[0] == 0x07) && (s_to_ecu.frame[0].data[7] == s_msg[6]));
+    CHECK(run () == 7);
+    CHECK(memcmp (s_ecu_rx, s_msg, 7) == 0);
+
+    /* CAN FD single frame above 8 bytes : 00 NN, padded to the next valid length */
+    setup (ISOTP_CANFD_DL, 0, 0, sizeof(s_ecu_rx));
+    CHECK(isotp_send (&s_tester, s_msg, 20) == 0);
+    CHECK((s_to_ecu.frame[0].len == 24) && (s_to_ecu.frame[0].data[0] == 0x00) && (s_to_ecu.frame[0].data[1] == 20));
+    CHECK(s_to_ecu.frame[0].data[23] == ISOTP_PAD);
+    CHECK(run () == 20);
+    CHECK(memcmp (s_ecu_rx, s_msg, 20) == 0);
+
+    /* a second message only once the first has left */
+    setup (ISOTP_CAN_DL, 0, 0, sizeof(s_ecu_rx));
+    CHECK(isotp_send (&s_tester, s_msg, 100) == 0);
+    CHECK(!isotp_tx_idle (&s_tester));
+    CHECK(isotp_send (&s_tester, s_msg, 5) != 0);
+}
+
+static void test_multi_frame (void)
+{
+    uint32_t i;
+
+    /* 120 bytes : FF with 6, 17 CF with 7 each, the sequence number wraps after F */
+    setup (ISOTP_CAN_DL, 0, 0, sizeof(s_ecu_rx));
+    CHECK(isotp_send (&s_tester, s_msg, 120) == 0);
+    CHECK((s_to_ecu.frame[0].data[0] == 0x10) && (s_to_ecu.frame[0].data[1] == 120));
+    CHECK(run () == 120);
+    CHECK(memcmp (s_ecu_rx, s_msg, 120) == 0);
+    CHECK((s_tester.stats.ff == 1) && (s_tester.stats.cf == 17) && (s_ecu.stats.fc == 1));
+    CHECK((s_to_ecu.frame[15].data[0] == 0x2F) && (s_to_ecu.frame[16].data[0] == 0x20));
+    CHECK(s_to_tester.frame[0].data[0] == 0x30);
+
+    /* block size 2 : a flow control after every second CF except the last */
+    setup (ISOTP_CAN_DL, 2, 0, sizeof(s_ecu_rx));
+    CHECK(isotp_send (&s_tester, s_msg, 120) == 0);
+    CHECK(run () == 120);
+    CHECK(memcmp (s_ecu_rx, s_msg, 120) == 0);
+    CHECK(s_ecu.stats.fc == 9);
+
+    /* above 4095 bytes the FF carries a 32 bit length after 10 00 */
+    setup (ISOTP_CANFD_DL, 8, 0, sizeof(s_ecu_rx));
+    CHECK(isotp_send (&s_tester, s_msg, 5000) == 0);
+    CHECK((s_to_ecu.frame[0].len == 64) && (s_to_ecu.frame[0].data[0] == 0x10) && (s_to_ecu.frame[0].data[1] == 0x00));
+    CHECK(get_u32(&s_to_ecu.frame[0].data[2]) == 5000);
+    CHECK(run () == 5000);
+    CHECK(memcmp (s_ecu_rx, s_msg, 5000) == 0);
+    for (i = 1; i < s_to_ecu.tail; i++)
+    {
+        CHECK((s_to_ecu.frame[i].data[0] >> 4) == 0x2);
+    }
+
+    /* STmin 10 ms : after the flow control one CF per separation time, not the whole message */
+    setup (ISOTP_CAN_DL, 0, 10, sizeof(s_ecu_rx));
+    CHECK(isotp_send (&s_tester, s_msg, 100) == 0);
+    isotp_on_frame (&s_ecu, &s_to_ecu.frame[s_to_ecu.head++]);
+    isotp_on_frame (&s_tester, &s_to_tester.frame[s_to_tester.head++]);
+    isotp_poll (&s_tester);
+    isotp_poll (&s_tester);
+    CHECK(s_tester.stats.cf == 1);
+}
+
+static void test_errors (void)
+{
+    can_frame_t f;
+
+    /* the receiver has no room : overflow flow control and the sender gives up */
+    setup (ISOTP_CAN_DL, 0, 0, 50);
+    CHECK(isotp_send (&s_tester, s_msg, 100) == 0);
+    CHECK(run () < 0);
+    CHECK(s_to_tester.frame[0].data[0] == 0x32);
+    CHECK(isotp_tx_idle (&s_tester));
+
+    /* a lost CF : wrong sequence number, the message is dropped */
+    setup (ISOTP_CAN_DL, 0, 0, sizeof(s_ecu_rx));
+    CHECK(isotp_send (&s_tester, s_msg, 100) == 0);
+    isotp_on_frame (&s_ecu, &s_to_ecu.frame[s_to_ecu.head++]);
+    isotp_on_frame (&s_tester, &s_to_tester.frame[s_to_tester.head++]);
+    isotp_poll (&s_tester);
+    CHECK(isotp_on_frame (&s_ecu, &s_to_ecu.frame[2]) < 0);
+    CHECK(isotp_on_frame (&s_ecu, &s_to_ecu.frame[3]) == 0);    /* ignored, nothing in progress */
+
+    /* malformed single frames and frames for another id */
+    setup (ISOTP_CAN_DL, 0, 0, sizeof(s_ecu_rx));
+    memset (&f, ISOTP_PAD, sizeof(f));
+    f.id = ID_TESTER;
+    f.len = 8;
+    f.data[0] = 0x00;
+    CHECK(isotp_on_frame (&s_ecu, &f) < 0);         /* 00 NN on classic CAN */
+    f.data[0] = 0x08;
+    CHECK(isotp_on_frame (&s_ecu, &f) < 0);         /* longer than the frame */
+    f.data[0] = 0x10;
+    f.data[1] = 0x05;
+    CHECK(isotp_on_frame (&s_ecu, &f) < 0);         /* FF for what fits a SF */
+    f.id = 0x123;
+    f.data[0] = 0x03;
+    CHECK(isotp_on_frame (&s_ecu, &f) == 0);
+    f.id = ID_TESTER;
+    f.len = 0;
+    CHECK(isotp_on_frame (&s_ecu, &f) == 0);
+}
+
+int main (void)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(s_msg); i++)
+    {
+        s_msg[i] = (uint8_t)(i * 13 + 1);
+    }
+    test_single_frame ();
+    test_multi_frame ();
+    test_errors ();
+    printf ("%s  isotp\n", s_fail ? "FAIL" : "PASS");
+    return s_fail;
+}
@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+#include "lz.h"
+
+/* LZ chunk stream round trips fed in uneven pieces, and damaged streams that must fail cleanly, run by 'make test' */
+
+static int s_fail;
+
+#define CHECK(cond)     do { if (!(cond)) { printf ("FAIL  %s:%d  %s\n", __FILE__, __LINE__, #cond); s_fail = 1; } } while (0)
+
+typedef struct
+{
+    uint8_t *buf;
+    uint32_t len;
+    uint32_t cap;
+} sink_t;
+
+static int sink_put (void *arg, const uint8_t *data, uint32_t len)
+{
+    sink_t *s = arg;
+
+    if (len > s->cap - s->len)
+    {
+        return 0x71;    /* like the server, a chunk past the end is refused */
+    }
+    memcpy (s->buf + s->len, data, len);
+    s->len += len;
+    return 0;
+}
+
+static uint32_t s_rnd = 12345;
+
+static uint32_t rnd (void)
+{
+    s_rnd = s_rnd * 1103515245 + 12345;
+    return s_rnd >> 8;
+}
+
+/* compress src with threads workers, then decode the stream in pieces of at most piece bytes */
+static void round_trip (const uint8_t *src, uint32_t len, int threads, uint32_t piece)
+{
+    static lz_stream_t lz;
+    uint8_t *z = malloc (lz_stream_bound (len) + 1);
+    sink_t out = { malloc (len + 1), 0, len };
+    uint32_t z_len, off, n;
+    int ret = 0;
+
+    z_len = lz_compress (src, len, z, threads);
+    CHECK(z_len <= lz_stream_bound (len));
+    lz_stream_init (&lz);
+    for (off = 0; (off < z_len) && (ret == 0); off += n)
+    {
+        n = (piece != 0) ? 1 + rnd () % piece : z_len;     /* my_min() evaluates its arguments twice */
+        n = my_min(z_len - off, n);
+        ret = lz_stream_feed (&lz, z + off, n, sink_put, &out);
+    }
+    CHECK(ret == 0);
+    CHECK(lz_stream_idle (&lz));
+    CHECK(out.len == len);
+    CHECK(memcmp (out.buf, src, len) == 0);
+    free (z);
+    free (out.buf);
+}
+
+static void test_round_trip (void)
+{
+    uint32_t len = 5 * LZ_CHUNK_LEN + 123, i;
+    uint8_t *buf = malloc (len);
+
+    /* text like, runs, incompressible (stored chunks) and a mix within one stream */
+    for (i = 0; i < len; i++)
+    {
+        buf[i] = "firmware block "[i % 15] + (uint8_t)((i / 4096) & 1);
+    }
+    round_trip (buf, len, 1, 0);
+    round_trip (buf, len, 4, 7);
+    memset (buf, 0xFF, len);
+    round_trip (buf, len, 0, 1000);
+    for (i = 0; i < len; i++)
+    {
+        buf[i] = (uint8_t)rnd ();
+    }
+    round_trip (buf, len, 3, 3);
+    memset (buf + LZ_CHUNK_LEN, 0, LZ_CHUNK_LEN);
+    round_trip (buf, len, 2, 40000);
+
+    /* chunk boundaries and the shortest inputs */
+    round_trip (buf, LZ_CHUNK_LEN, 1, 0);
+    round_trip (buf, LZ_CHUNK_LEN + 1, 1, 5);
+    round_trip (buf, 1, 1, 0);
+    round_trip (buf, 0, 1, 0);
+    free (buf);
+}
+
+static void test_damaged (void)
+{
+    static lz_stream_t lz;
+    uint32_t len = 3 * LZ_CHUNK_LEN, z_len, i, n;
+    uint8_t *src = malloc (len), *z = malloc (lz_stream_bound (len)), *bad = malloc (lz_stream_bound (len));
+    sink_t out = { malloc (len), 0, len };
+    int ret;
+
+    for (i = 0; i < len; i++)
+    {
+        src[i] = (uint8_t)((i % 251) ^ (i >> 9));
+    }
+    z_len = lz_compress (src, len, z, 1);
+
+    /* headers the decoder has to refuse : empty chunk, chunk larger than LZ_CHUNK_LEN, data longer than raw */
+    lz_stream_init (&lz);
+    CHECK(lz_stream_feed (&lz, (const uint8_t *)"\x00\x00\x00\x01", 4, sink_put, &out) < 0);
+    lz_stream_init (&lz);
+    CHECK(lz_stream_feed (&lz, (const uint8_t *)"\x80\x01\x00\x01", 4, sink_put, &out) < 0);
+    lz_stream_init (&lz);
+    CHECK(lz_stream_feed (&lz, (const uint8_t *)"\x00\x10\x00\x11", 4, sink_put, &out) < 0);
+
+    /* a stream that stops inside a chunk is not idle */
+    lz_stream_init (&lz);
+    out.len = 0;
+    CHECK(lz_stream_feed (&lz, z, z_len - 1, sink_put, &out) == 0);
+    CHECK(!lz_stream_idle (&lz));
+
+    /* the sink's answer comes back unchanged */
+    lz_stream_init (&lz);
+    out.len = 0;
+    out.cap = LZ_CHUNK_LEN;
+    CHECK(lz_stream_feed (&lz, z, z_len, sink_put, &out) == 0x71);
+    out.cap = len;
+
+    /* random damage either fails or decodes to something, never past the buffers (run under -fsanitize=address) */
+    for (i = 0; i < 2000; i++)
+    {
+        memcpy (bad, z, z_len);
+        for (n = 1 + rnd () % 4; n > 0; n--)
+        {
+            bad[rnd () % z_len] ^= (uint8_t)(1 + rnd () % 255);
+        }
+        lz_stream_init (&lz);
+        out.len = 0;
+        ret = lz_stream_feed (&lz, bad, z_len, sink_put, &out);
+        CHECK((ret <= 0) || (ret == 0x71));
+    }
+    free (src);
+    free (z);
+    free (bad);
+    free (out.buf);
+}
+
+int main (void)
+{
+    test_round_trip ();
+    test_damaged ();
+    printf ("%s  lz\n", s_fail ? "FAIL" : "PASS");
+    return s_fail;
+}
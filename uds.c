@@ -1,5 +1,20 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
 #include "uds.h"
+#include "util.h"
+#include "verify.h"
+#include "lz.h"
+#include "aes.h"
+#include "merkle.h"
 
 #define SESSION_TIMEOUT             5000
 #define SECURITY_ACCESS_DELAY_TIME  10000
@@ -18,6 +33,7 @@
 #define SRV_CONTROL_DTC         0x85
 #define SRV_ROUTINE_CONTROL     0x31
 #define SRV_REQUEST_DOWNLOAD    0x34
+#define SRV_REQUEST_UPLOAD      0x35
 #define SRV_TRANSFER_DATA       0x36
 #define SRV_REQ_TRANSFER_EXIT   0x37
 
@@ -37,12 +53,36 @@
 #define ROUTINE_ERASE_MEMORY            0xFF00
 #define ROUTINE_CHECK_PROG_DEPENDENCY   0xFF01
 #define ROUTINE_CHECK_MEMORY            0x0200
+#define ROUTINE_CHECK_DIGEST            0x0201  /* SHA-256 of the download region */
+#define ROUTINE_MERKLE_NODE             0x0202  /* children digests of a hash tree node of the download region */
+#define ROUTINE_LOCAL_COPY              0x0203  /* the next bytes of the download copied from the file passed on the local socket */
+
+#define MERKLE_ROOT_QUERY               0xFF    /* ROUTINE_MERKLE_NODE level : region, tree shape and root */
+
+#define DID_VERIFY_ALG                  0xFD00  /* CheckMemory verification algorithm id */
+#define DID_TRANSFER_WINDOW             0xFD01  /* TransferData requests the client keeps in flight */
+#define DID_BLOCK_TAG                   0xFD02  /* 1 : TransferData carries a CRC32 trailer of its payload */
+#define DID_TRANSFER_JOURNAL            0xFD03  /* erased region, committed bytes and their crc, read to resume */
+#define DID_CIPHER_NONCE                0xFD04  /* 16 byte AES-CTR nonce of the encrypted downloads that follow */
+#define DID_BLOCK_HASH                  0xFD05  /* write : region patched in place, read : its per-block hashes */
+
+#define BLOCK_HASH_MIN_LEN              1024    /* the block grows by powers of two until the table fits one response */
+
+#define BLK_TAG_LEN                     4
+
+#define DFI_COMPRESSION_LZ              0x1     /* dataFormatIdentifier high nibble, lz.h chunk stream */
+#define DFI_ENCRYPTION_AES128_CTR       0x1     /* dataFormatIdentifier low nibble, pre-shared key */
+#define DFI_ENCRYPTION_AES256_CTR       0x2
 
 
 #define ERROR_SERVICE_NOT_SUPPORTED                         0x11
 #define ERROR_SUB_FUNCTION_NOT_SUPPORT                      0x12
 #define ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT    0x13
+#define ERROR_CONDITIONS_NOT_CORRECT                        0x22
 #define ERROR_REQUEST_SEQUENCE                              0x24
+#define ERROR_REQUEST_OUT_OF_RANGE                          0x31
+#define ERROR_TRANSFER_DATA_SUSPENDED                       0x71
+#define ERROR_BLOCK_TAG_MISMATCH                            0xF0    /* manufacturer specific, the block is not written, send it again */
 #define ERROR_SECURITY_ACCESS_DENIED                        0x33
 #define ERROR_INCORRECT_KEY                                 0x35
 #define ERROR_REQUIRED_TIME_DELAY_NOT_EXPIRED               0x37
@@ -54,6 +94,30 @@
 
 #define HARD_RESET  1
 
+#define FLASH_BASE_ADDR     0x1D0000    /* address stored at offset 0 of out.dat */
+#define MAX_BLOCK_LEN       0xF02       /* maxNumberOfBlockLength, SID and sequence counter included */
+
+#define LOCAL_SOCKET_NAME   "uds_fw_update.%d"  /* abstract unix socket, numbered by the tester's pid */
+#define LOCAL_MSG_LEN       12                  /* file offset (8) and length (4), host byte order, with the fd */
+
+#define JOURNAL_FILE        "out.jnl"
+#define JOURNAL_TMP_FILE    "out.jnl.tmp"       /* written and synced, then renamed over JOURNAL_FILE */
+#define JOURNAL_SYNC_LEN    (4 * 1024 * 1024)   /* bytes committed between two journal updates, each costs two fsyncs */
+#define JOURNAL_MAGIC       "UDSJNL01"
+
+/* download progress, replaced every JOURNAL_SYNC_LEN bytes that reached out.dat and at RequestTransferExit, host byte order */
+typedef struct {
+    char     magic[8];
+    uint32_t er_addr;       /* erased region the download belongs to */
+    uint32_t er_size;
+    uint32_t dl_recv;       /* committed bytes from er_addr */
+    uint32_t dl_crc;
+    uint8_t  vfy_id;        /* 0 when no algorithm was negotiated */
+    verify_ctx_t vfy;
+    sha256_ctx_t dl_sha;
+    uint32_t crc;           /* make_crc32 of everything above */
+} uds_journal_t;
+
 typedef struct {
     int      secure;
     uint8_t  session;
@@ -65,26 +129,52 @@ typedef struct {
     uint32_t security_key;
     uint32_t tm_session;
     uint32_t tm_security_delay;
+    uint32_t dl_start;      /* current RequestDownload */
+    uint32_t dl_size;
+    uint32_t dl_off;        /* bytes written from dl_start */
+    uint32_t dl_blk;        /* blocks accepted, blk_cnt is this + 1 modulo 256 */
+    uint32_t dl_last_len;   /* last accepted block, a repeat of it is answered without writing */
+    uint8_t  dl_comp;       /* compression method of the current download, 0 = plain */
+    uint8_t  dl_enc;        /* encryption method of the current download, 0 = plain */
+    uint32_t dl_rx;         /* TransferData payload bytes accepted, the position in the cipher stream */
+    uint8_t  dl_ctr[AES_BLOCK_LEN];     /* first counter block of the current download */
+    uint8_t  nonce[AES_BLOCK_LEN];      /* written with DID_CIPHER_NONCE */
+    int      nonce_set;
+    uint32_t nonce_seq;     /* encrypted downloads accepted under the nonce, part of their first counter block */
+    uint32_t dl_addr;       /* verify region, from the erase or the first RequestDownload */
+    uint32_t dl_recv;       /* bytes written by TransferData */
+    uint32_t dl_crc;        /* running crc of the written bytes */
+    uint8_t  tx_window;     /* negotiated with DID_TRANSFER_WINDOW, 1 = stop-and-wait */
+    uint8_t  tag_len;       /* TransferData CRC32 trailer, negotiated with DID_BLOCK_TAG */
+    const verify_alg_t *vfy_alg;    /* negotiated with DID_VERIFY_ALG, run inline with dl_crc */
+    verify_ctx_t vfy;
+    sha256_ctx_t dl_sha;    /* always run inline, checked by ROUTINE_CHECK_DIGEST */
+    int      flash_new;     /* programming session entered, out.dat is recreated on the next download */
+    uint32_t er_addr;       /* last erased region, reads back as 0xFF, or the region patched in place */
+    uint32_t er_size;
+    uint32_t ul_start;      /* current RequestUpload, TransferData answers with the stored image */
+    uint32_t ul_size;
+    uint32_t ul_off;        /* bytes sent from ul_start */
+    uint32_t ul_blk;        /* blocks sent */
+    uint32_t ul_last_len;   /* last block, sent again when its request is repeated */
 } uds_info_t;
 
 static uds_info_t s_uds;
-static FILE *outFile = NULL; // Added for firmware data saving
+static int outFd = -1; // firmware data saving, written with pwrite() at the flash offset
+static int upFd = -1;  // upload source, read with pread() at the flash offset
+static uint32_t s_jnl_recv;     /* dl_recv of the journal on disk */
+static uint32_t s_flash_base = FLASH_BASE_ADDR;
+static uint32_t s_max_block_len = MAX_BLOCK_LEN;
+static lz_stream_t s_lz;    /* compressed download, the chunk being received */
+static aes_key_t s_aes;     /* pre-shared, uds_set_aes_key() */
+static uint32_t s_aes_len;
+static merkle_t s_mk;       /* leaves of the verify region, in step with dl_recv */
+static int s_local_id = -1; /* tester pid the local copy socket is named after, -1 = off */
+static int s_local_fd = -1;
+static int s_local_conn = -1;
 
 void c_printf (const char *format, ...);
-
-static uint16_t get_u16(void *p)
-{
-    uint8_t *b = p;
-
-    return (uint16_t)(((uint16_t)b[0] << 8) | (uint16_t)b[1]);
-}
-
-static uint32_t get_u32(void *p)
-{
-    uint8_t *b = p;
-
-    return (uint32_t)(((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | (uint32_t)b[3]);
-}
+static int srv_patch_flash (uint32_t addr, uint32_t size);
 
 static uint32_t gen_random(void)
 {
@@ -162,7 +252,7 @@ static void session_timeout_check (void)
     }
 }
 
-static void srv_session_control (uint8_t *data, uint16_t size)
+static void srv_session_control (uint8_t *data, uint32_t size)
 {
     uint8_t msg[] = { 0x00, 0x32, 0x01, 0xF4 };
 
@@ -185,6 +275,7 @@ static void srv_session_control (uint8_t *data, uint16_t size)
             case SESSION_PROGRAMMING:
                 c_printf ("SESSION_PROGRAMMING\n");
                 s_uds.session = SESSION_PROGRAMMING;
+                s_uds.flash_new = 1;
                 s_uds.tm_session = uds_get_ms() + SESSION_TIMEOUT;
                 send_positive_response(msg, 4);
                 break;
@@ -204,7 +295,7 @@ static void srv_session_control (uint8_t *data, uint16_t size)
     return;
 }
 
-static void srv_ecu_reset (uint8_t *data, uint16_t size)
+static void srv_ecu_reset (uint8_t *data, uint32_t size)
 {
     s_uds.sub_func = data[1];
     if (size != 2)
@@ -225,9 +316,74 @@ static void srv_ecu_reset (uint8_t *data, uint16_t size)
     }
 }
 
-static void srv_read_did (uint8_t *data, uint16_t size)
+static uint32_t srv_flash_size (void)
+{
+    struct stat st;
+
+    if (stat ("out.dat", &st) != 0)
+    {
+        return 0;
+    }
+    return (uint32_t)my_min((uint64_t)st.st_size, 0xFFFFFFFF);
+}
+
+/* xxh64 of every block of the patch region, cut to 32 bits, as installed in out.dat */
+static void srv_read_block_hash (uint8_t *data)
+{
+    static uint8_t msg[UDS_TP_MAX_LEN];
+    static uint8_t buf[64 * 1024];
+    xxh64_ctx_t ctx;
+    uint32_t blk_len = BLOCK_HASH_MIN_LEN, n, i, pos, end, len;
+    FILE *fp;
+
+    if ((s_uds.er_size == 0) || (s_uds.dl_addr != s_uds.er_addr))
+    {
+        send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+        return;
+    }
+    while ((n = (s_uds.er_size + blk_len - 1) / blk_len) > (uds_tp_max_len() - 7) / 4)
+    {
+        blk_len <<= 1;
+    }
+    fp = fopen ("out.dat", "rb");
+    if ((fp == NULL) || (fseek (fp, (long)(s_uds.er_addr - s_flash_base), SEEK_SET) != 0))
+    {
+        if (fp != NULL)
+        {
+            fclose (fp);
+        }
+        send_negative_response(0x72); // General Programming Failure
+        return;
+    }
+    for (i = 0; i < n; i++)
+    {
+        xxh64_init (&ctx, 0);
+        end = my_min(s_uds.er_size - i * blk_len, blk_len);
+        for (pos = 0; pos < end; pos += len)
+        {
+            len = my_min(end - pos, sizeof(buf));
+            if (fread (buf, 1, len, fp) != len)
+            {
+                fclose (fp);
+                send_negative_response(0x72); // General Programming Failure
+                return;
+            }
+            xxh64_update (&ctx, buf, len);
+        }
+        put_u32(&msg[7 + i * 4], (uint32_t)xxh64_final (&ctx));
+    }
+    fclose (fp);
+    c_printf ("block hash: 0x%08X, %u blocks of %u bytes\n", s_uds.er_addr, n, blk_len);
+    msg[0] = data[0] + 0x40;
+    msg[1] = data[1];
+    msg[2] = data[2];
+    put_u32(&msg[3], blk_len);
+    uds_tp_send(msg, 7 + n * 4);
+}
+
+static void srv_read_did (uint8_t *data, uint32_t size)
 {
-    uint8_t msg[7];
+    uint8_t msg[19];
     uint16_t data_id;
 
     s_uds.sub_func = data[1];
@@ -250,7 +406,26 @@ static void srv_read_did (uint8_t *data, uint16_t size)
         msg[4] = '2';
         msg[5] = '3';
         msg[6] = '4';
-        uds_tp_send(msg, sizeof(msg));
+        uds_tp_send(msg, 7);
+    }
+    else if ((data_id == DID_TRANSFER_JOURNAL) && (s_uds.er_size != 0) && (s_uds.dl_addr == s_uds.er_addr))
+    {
+        msg[0] = data[0] + 0x40;
+        msg[1] = data[1];
+        msg[2] = data[2];
+        put_u32(&msg[3], s_uds.er_addr);
+        put_u32(&msg[7], s_uds.er_size);
+        put_u32(&msg[11], s_uds.dl_recv);
+        put_u32(&msg[15], s_uds.dl_crc);
+        uds_tp_send(msg, 19);
+    }
+    else if (data_id == DID_TRANSFER_JOURNAL)
+    {
+        send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+    }
+    else if (data_id == DID_BLOCK_HASH)
+    {
+        srv_read_block_hash (data);
     }
     else
     {
@@ -258,7 +433,93 @@ static void srv_read_did (uint8_t *data, uint16_t size)
     }
 }
 
-static void srv_security_access (uint8_t *data, uint16_t size)
+static void srv_write_did (uint8_t *data, uint32_t size)
+{
+    const verify_alg_t *alg;
+    uint16_t data_id;
+
+    s_uds.sub_func = data[1];
+    if (size < 4)
+    {
+        send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+        return;
+    }
+
+    data_id = get_u16(&data[1]);
+    c_printf ("Write DID 0x%04X\n", data_id);
+    switch (data_id)
+    {
+        case DID_VERIFY_ALG:
+            alg = verify_find (data[3]);
+            if ((size != 4) || (alg == NULL))
+            {
+                send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+                return;
+            }
+            if ((alg != s_uds.vfy_alg) && (s_uds.er_size != 0))
+            {
+                /* the inline digest of the journal belongs to the other algorithm */
+                c_printf ("verify algorithm changed, transfer journal dropped\n");
+                s_uds.er_size = 0;
+            }
+            s_uds.vfy_alg = alg;
+            c_printf ("verify algorithm: %s\n", alg->name);
+            break;
+
+        case DID_TRANSFER_WINDOW:
+            /* requests beyond the receive queue would be dropped by the transport */
+            if ((size != 4) || (data[3] == 0) || (data[3] > UDS_TP_QUEUE_DEPTH))
+            {
+                send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+                return;
+            }
+            s_uds.tx_window = data[3];
+            c_printf ("transfer window: %u\n", data[3]);
+            break;
+
+        case DID_BLOCK_TAG:
+            if ((size != 4) || (data[3] > 1))
+            {
+                send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+                return;
+            }
+            s_uds.tag_len = data[3] ? BLK_TAG_LEN : 0;
+            c_printf ("block crc trailer: %s\n", data[3] ? "on" : "off");
+            break;
+
+        case DID_BLOCK_HASH:
+            if (size != 3 + 8)
+            {
+                send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+                return;
+            }
+            if (srv_patch_flash (get_u32(&data[3]), get_u32(&data[7])) != 0)
+            {
+                send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+                return;
+            }
+            break;
+
+        case DID_CIPHER_NONCE:
+            if (size != 3 + AES_BLOCK_LEN)
+            {
+                send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+                return;
+            }
+            memcpy (s_uds.nonce, &data[3], AES_BLOCK_LEN);
+            s_uds.nonce_set = 1;
+            s_uds.nonce_seq = 0;
+            c_printf ("cipher nonce set\n");
+            break;
+
+        default:
+            send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+            return;
+    }
+    send_positive_response(&data[2], 1);
+}
+
+static void srv_security_access (uint8_t *data, uint32_t size)
 {
     uint8_t msg[8];
     uint32_t requested_key;
@@ -335,7 +596,7 @@ static void srv_security_access (uint8_t *data, uint16_t size)
     }
 }
 
-static void srv_control_dtc_setting (uint8_t *data, uint16_t size)
+static void srv_control_dtc_setting (uint8_t *data, uint32_t size)
 {
     s_uds.sub_func = data[1];
     if (size != 2)
@@ -361,7 +622,7 @@ static void srv_control_dtc_setting (uint8_t *data, uint16_t size)
     }
 }
 
-static void srv_communication_control (uint8_t *data, uint16_t size)
+static void srv_communication_control (uint8_t *data, uint32_t size)
 {
     s_uds.sub_func = data[1];
     if (size != 3)
@@ -398,7 +659,278 @@ static void srv_communication_control (uint8_t *data, uint16_t size)
     send_positive_response(NULL, 0);
 }
 
-static void srv_routine_control_erase_memory (uint8_t *data, uint16_t size)
+/* out.dat mirrors the flash from s_flash_base, every segment is written at its own offset */
+static int srv_open_flash (void)
+{
+    if (outFd >= 0)
+    {
+        close(outFd); // Close if already open (e.g., interrupted transfer)
+        outFd = -1;
+    }
+    outFd = open("out.dat", O_RDWR | O_CREAT | (s_uds.flash_new ? O_TRUNC : 0), 0644);
+    if (outFd < 0)
+    {
+        c_printf("SERVER: Error opening out.dat for writing.\n");
+        return -1;
+    }
+    s_uds.flash_new = 0;
+    return 0;
+}
+
+/* len bytes at flash address addr */
+static int srv_write_flash (uint32_t addr, const uint8_t *data, uint32_t len)
+{
+    off_t pos = (off_t)(addr - s_flash_base);
+    ssize_t n;
+
+    while (len > 0)
+    {
+        n = pwrite(outFd, data, len, pos);
+        if (n <= 0)
+        {
+            c_printf("SERVER: Error writing out.dat at 0x%08X.\n", addr);
+            return -1;
+        }
+        data += n;
+        pos += n;
+        len -= (uint32_t)n;
+    }
+    return 0;
+}
+
+/* the running digests restart at addr */
+static void srv_verify_reset (uint32_t addr)
+{
+    s_uds.dl_addr = addr;
+    s_uds.dl_recv = 0;
+    s_uds.dl_crc = 0xFFFFFFFF;
+    if (s_uds.vfy_alg != NULL)
+    {
+        s_uds.vfy_alg->init (&s_uds.vfy);
+    }
+    sha256_init (&s_uds.dl_sha);
+    merkle_reset (&s_mk);
+}
+
+static void srv_verify_update (const uint8_t *data, uint32_t len)
+{
+    s_uds.dl_crc = make_crc32(s_uds.dl_crc, data, len);
+    if ((s_uds.vfy_alg != NULL) && (s_uds.vfy_alg->id != VERIFY_SHA256))
+    {
+        s_uds.vfy_alg->update (&s_uds.vfy, data, len);
+    }
+    sha256_update (&s_uds.dl_sha, data, len);
+    if (s_mk.len == s_uds.dl_recv)
+    {
+        merkle_update (&s_mk, data, len);
+    }
+    s_uds.dl_recv += len;
+}
+
+/* only a download into an erased region can be resumed, the journal then covers it from er_addr */
+static void srv_journal_commit (int force)
+{
+    uds_journal_t jnl;
+    FILE *fp;
+    int ok, dir;
+
+    if ((s_uds.er_size == 0) || (s_uds.dl_addr != s_uds.er_addr))
+    {
+        return;
+    }
+    if (!force && (s_uds.dl_recv >= s_jnl_recv) && (s_uds.dl_recv - s_jnl_recv < JOURNAL_SYNC_LEN))
+    {
+        return;     /* an older journal only makes a resume send more again */
+    }
+    memset (&jnl, 0, sizeof(jnl));
+    memcpy (jnl.magic, JOURNAL_MAGIC, sizeof(jnl.magic));
+    jnl.er_addr = s_uds.er_addr;
+    jnl.er_size = s_uds.er_size;
+    jnl.dl_recv = s_uds.dl_recv;
+    jnl.dl_crc = s_uds.dl_crc;
+    if (s_uds.vfy_alg != NULL)
+    {
+        jnl.vfy_id = s_uds.vfy_alg->id;
+        jnl.vfy = s_uds.vfy;
+    }
+    jnl.dl_sha = s_uds.dl_sha;
+    jnl.crc = make_crc32(0xFFFFFFFF, &jnl, offsetof(uds_journal_t, crc));
+
+    /* out.dat first, after a crash the journal must not claim bytes the disk does not hold */
+    if ((outFd >= 0) && (fdatasync (outFd) != 0))
+    {
+        return;
+    }
+    fp = fopen(JOURNAL_TMP_FILE, "wb");
+    if (fp == NULL)
+    {
+        return;
+    }
+    ok = (fwrite (&jnl, 1, sizeof(jnl), fp) == sizeof(jnl)) && (fflush (fp) == 0) && (fsync (fileno (fp)) == 0);
+    fclose (fp);
+    if (!ok || (rename (JOURNAL_TMP_FILE, JOURNAL_FILE) != 0))
+    {
+        unlink (JOURNAL_TMP_FILE);
+        return;
+    }
+    dir = open (".", O_RDONLY | O_DIRECTORY);
+    if (dir >= 0)
+    {
+        fsync (dir);
+        close (dir);
+    }
+    s_jnl_recv = s_uds.dl_recv;
+}
+
+/* pick up the download a previous run left, out.dat has to hold everything the journal committed */
+static void srv_journal_load (void)
+{
+    uds_journal_t jnl;
+    const verify_alg_t *alg = NULL;
+    FILE *fp;
+    long end = -1;
+
+    fp = fopen(JOURNAL_FILE, "rb");
+    if (fp == NULL)
+    {
+        return;
+    }
+    if (fread (&jnl, 1, sizeof(jnl), fp) != sizeof(jnl))
+    {
+        fclose (fp);
+        c_printf ("journal: %s short, ignored\n", JOURNAL_FILE);
+        return;
+    }
+    fclose (fp);
+    fp = fopen("out.dat", "rb");
+    if ((fp != NULL) && (fseek (fp, 0, SEEK_END) == 0))
+    {
+        end = ftell (fp);
+    }
+    if (fp != NULL)
+    {
+        fclose (fp);
+    }
+    if (jnl.vfy_id != 0)
+    {
+        alg = verify_find (jnl.vfy_id);
+    }
+    if ((memcmp (jnl.magic, JOURNAL_MAGIC, sizeof(jnl.magic)) != 0) ||
+        (jnl.crc != make_crc32(0xFFFFFFFF, &jnl, offsetof(uds_journal_t, crc))) ||
+        (jnl.er_addr < s_flash_base) || (jnl.er_size == 0) || (jnl.dl_recv > jnl.er_size) ||
+        ((jnl.vfy_id != 0) && (alg == NULL)) ||
+        (end < (long)(jnl.er_addr - s_flash_base) + (long)jnl.er_size))
+    {
+        c_printf ("journal: %s ignored\n", JOURNAL_FILE);
+        return;
+    }
+    s_uds.er_addr = jnl.er_addr;
+    s_uds.er_size = jnl.er_size;
+    s_uds.dl_addr = jnl.er_addr;
+    s_uds.dl_recv = jnl.dl_recv;
+    s_uds.dl_crc = jnl.dl_crc;
+    s_uds.vfy_alg = alg;
+    s_uds.vfy = jnl.vfy;
+    s_uds.dl_sha = jnl.dl_sha;
+    s_jnl_recv = jnl.dl_recv;
+    c_printf ("journal: 0x%08X, %u of %u bytes committed\n", jnl.er_addr, jnl.dl_recv, jnl.er_size);
+}
+
+/* true when [addr, addr + size) continues the current verify region inside the erased area */
+static int srv_verify_continues (uint32_t addr, uint32_t size)
+{
+    return (s_uds.er_size != 0) && (s_uds.dl_addr == s_uds.er_addr) &&
+           (addr >= s_uds.dl_addr + s_uds.dl_recv) &&
+           ((uint64_t)addr + size <= (uint64_t)s_uds.er_addr + s_uds.er_size);
+}
+
+/* bring the verify region up to end with what the flash holds, the blocks the client did not send */
+static int srv_verify_fill (uint32_t end)
+{
+    static uint8_t buf[64 * 1024];
+    uint32_t pos, len;
+    FILE *fp;
+
+    pos = s_uds.dl_addr + s_uds.dl_recv;
+    if (pos >= end)
+    {
+        return 0;
+    }
+    c_printf ("verify: 0x%08X..0x%08X not transferred, reading back\n", pos, end);
+    fp = fopen ("out.dat", "rb");
+    if ((fp == NULL) || (fseek (fp, (long)(pos - s_flash_base), SEEK_SET) != 0))
+    {
+        if (fp != NULL)
+        {
+            fclose (fp);
+        }
+        return -1;
+    }
+    for (; pos < end; pos += len)
+    {
+        len = my_min(end - pos, sizeof(buf));
+        if (fread (buf, 1, len, fp) != len)
+        {
+            fclose (fp);
+            return -1;
+        }
+        srv_verify_update (buf, len);
+    }
+    fclose (fp);
+    return 0;
+}
+
+/* erased flash reads as 0xFF */
+static int srv_erase_flash (uint32_t addr, uint32_t size)
+{
+    static uint8_t blank[64 * 1024];
+    uint32_t pos, len;
+
+    s_uds.er_size = 0;
+    unlink (JOURNAL_FILE);      /* it would describe data the erase overwrites */
+    if ((addr < s_flash_base) || (size > 0xFFFFFFFF - addr) || (srv_open_flash () != 0))
+    {
+        return -1;
+    }
+    memset (blank, 0xFF, sizeof(blank));
+    for (pos = 0; pos < size; pos += len)
+    {
+        len = my_min(size - pos, sizeof(blank));
+        if (srv_write_flash (addr + pos, blank, len) != 0)
+        {
+            return -1;
+        }
+    }
+    s_uds.er_addr = addr;
+    s_uds.er_size = size;
+    srv_verify_reset (addr);
+    srv_journal_commit (1);     /* a fresh region, the previous journal is gone */
+    return 0;
+}
+
+/* the installed image from addr is programmed in place, the blocks the client skips keep their data */
+static int srv_patch_flash (uint32_t addr, uint32_t size)
+{
+    if ((addr < s_flash_base) || (size == 0) || (size > 0xFFFFFFFF - addr) ||
+        ((uint64_t)addr - s_flash_base + size > srv_flash_size ()))
+    {
+        c_printf ("patch region 0x%08X, len = %u: nothing installed there\n", addr, size);
+        return -1;
+    }
+    s_uds.flash_new = 0;        /* out.dat is kept, not recreated by the download */
+    if (srv_open_flash () != 0)
+    {
+        return -1;
+    }
+    s_uds.er_addr = addr;
+    s_uds.er_size = size;
+    srv_verify_reset (addr);
+    srv_journal_commit (1);
+    c_printf ("patch region 0x%08X, len = %u\n", addr, size);
+    return 0;
+}
+
+static void srv_routine_control_erase_memory (uint8_t *data, uint32_t size)
 {
     uint8_t msg[3];
     uint32_t file_start_addr, file_size;
@@ -415,18 +947,77 @@ static void srv_routine_control_erase_memory (uint8_t *data, uint16_t size)
     msg[0] = data[2];
     msg[1] = data[3];
     msg[2] = 0; // 0=success, 1=error
+    if (srv_erase_flash (file_start_addr, file_size) != 0)
+    {
+        msg[2] = 1;
+    }
     send_positive_response(msg, 3);
     //send_negative_response(ERROR_REQUEST_CORRECTLY_RECEIVED_RESPONSE_PENDING);
 }
 
-static void srv_routine_control_check_memory (uint8_t *data, uint16_t size)
+/* digest of the current download region, from the inline contexts when possible */
+static int srv_verify_digest (const verify_alg_t *alg, uint8_t *digest)
+{
+    static uint8_t buf[64 * 1024];
+    verify_ctx_t ctx;
+    uint32_t pos, len;
+    FILE *fp;
+
+    if (alg->id == VERIFY_CRC32)
+    {
+        put_u32(digest, s_uds.dl_crc);
+        return 0;
+    }
+    if (alg->id == VERIFY_SHA256)
+    {
+        sha256_final (&s_uds.dl_sha, digest);
+        return 0;
+    }
+    if (alg == s_uds.vfy_alg)
+    {
+        alg->final (&s_uds.vfy, digest);
+        return 0;
+    }
+
+    /* not negotiated before the download, read the stored image back */
+    c_printf ("check memory: %s was not run inline, reading back out.dat\n", alg->name);
+    fp = fopen ("out.dat", "rb");
+    if (fp == NULL)
+    {
+        return -1;
+    }
+    if (fseek (fp, (long)(s_uds.dl_addr - s_flash_base), SEEK_SET) != 0)
+    {
+        fclose (fp);
+        return -1;
+    }
+    alg->init (&ctx);
+    for (pos = 0; pos < s_uds.dl_recv; pos += len)
+    {
+        len = my_min(s_uds.dl_recv - pos, sizeof(buf));
+        if (fread (buf, 1, len, fp) != len)
+        {
+            fclose (fp);
+            return -1;
+        }
+        alg->update (&ctx, buf, len);
+    }
+    fclose (fp);
+    alg->final (&ctx, digest);
+    return 0;
+}
+
+static void srv_routine_control_check_memory (uint8_t *data, uint32_t size)
 {
     uint8_t msg[8];
-    uint32_t mem_addr, mem_size, crc;
-    uint16_t crc_len;
+    uint8_t digest[VERIFY_MAX_DIGEST];
+    const verify_alg_t *alg;
+    const uint8_t *verify;
+    uint32_t mem_addr, mem_size;
+    uint16_t verify_len;
 
     s_uds.sub_func = data[1];
-    if (size != 18)
+    if (size < 14)
     {
         send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
         return;
@@ -434,14 +1025,29 @@ static void srv_routine_control_check_memory (uint8_t *data, uint16_t size)
 
     mem_addr = get_u32(&data[4]);
     mem_size = get_u32(&data[8]);
-    crc_len = get_u16(&data[12]);
-    if (crc_len != 4)
+    verify_len = get_u16(&data[12]);
+    if (size != 14 + verify_len)
     {
         send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
         return;
     }
-    crc = get_u32(&data[14]);
-    c_printf ("check memory: addr = 0x%08X, len = %08X, crc = 0x%08X\n", mem_addr, mem_size, crc);
+    /* verify data length 4 : CRC32, otherwise algorithm id + digest */
+    if (verify_len == 4)
+    {
+        alg = verify_find (VERIFY_CRC32);
+        verify = &data[14];
+    }
+    else
+    {
+        alg = (verify_len > 1) ? verify_find (data[14]) : NULL;
+        verify = &data[15];
+        if ((alg == NULL) || (verify_len != 1 + alg->digest_len))
+        {
+            send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+            return;
+        }
+    }
+    c_printf ("check memory: addr = 0x%08X, len = %08X, %s\n", mem_addr, mem_size, alg->name);
 
     msg[0] = 0x71;
     msg[1] = 0x01;
@@ -449,34 +1055,338 @@ static void srv_routine_control_check_memory (uint8_t *data, uint16_t size)
     msg[3] = 0x00;
 
     msg[4] = 0x00; // 0=success, 1 = error
+    if ((mem_addr == s_uds.dl_addr) && (srv_verify_continues (mem_addr + s_uds.dl_recv, mem_size - s_uds.dl_recv)))
+    {
+        srv_verify_fill (mem_addr + mem_size);     /* erased tail of the region */
+    }
+    if ((mem_addr != s_uds.dl_addr) || (mem_size != s_uds.dl_recv) ||
+        (srv_verify_digest (alg, digest) != 0) || (memcmp (digest, verify, alg->digest_len) != 0))
+    {
+        c_printf ("check memory: fail, written addr = 0x%08X, len = %08X\n", s_uds.dl_addr, s_uds.dl_recv);
+        msg[4] = 0x01;
+    }
     msg[5] = 0x00; // 0=success, 1 = error
     msg[6] = 0x00; // 0=success, 1 = error
     msg[7] = 0x00; // 0=success, 1 = error
     uds_tp_send(msg, 8);
 }
 
-static void srv_routine_control_check_programming_dependency (uint8_t *data, uint16_t size)
+static void srv_routine_control_check_digest (uint8_t *data, uint32_t size)
 {
-    uint8_t msg[8];
+    uint8_t msg[5];
+    uint8_t digest[SHA256_DIGEST_LEN];
 
     s_uds.sub_func = data[1];
-    if (size != 4)
+    if (size != 4 + SHA256_DIGEST_LEN)
     {
         send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
         return;
     }
+    sha256_final (&s_uds.dl_sha, digest);
+    c_printf ("check digest: sha256 over %u bytes\n", s_uds.dl_recv);
+
     msg[0] = 0x71;
     msg[1] = 0x01;
-    msg[2] = 0xFF;
-    msg[3] = 0x01;
+    msg[2] = (uint8_t)(ROUTINE_CHECK_DIGEST >> 8);
+    msg[3] = (uint8_t)(ROUTINE_CHECK_DIGEST & 0xFF);
     msg[4] = 0x00; // 0=success, 1 = error
-    msg[5] = 0x00; // 0=success, 1 = error
-    msg[6] = 0x00; // 0=success, 1 = error
-    msg[7] = 0x00; // 0=success, 1 = error
-    uds_tp_send(msg, 8);
+    if (memcmp (digest, &data[4], SHA256_DIGEST_LEN) != 0)
+    {
+        c_printf ("check digest: fail\n");
+        msg[4] = 0x01;
+    }
+    uds_tp_send(msg, 5);
 }
 
-static void srv_routine_control (uint8_t *data, uint16_t size)
+/* tree over the verify region, read back when the leaves fell out of step (resumed download) */
+static int srv_merkle_sync (void)
+{
+    static uint8_t buf[64 * 1024];
+    uint32_t pos, len;
+    FILE *fp;
+
+    if (s_mk.len == s_uds.dl_recv)
+    {
+        return merkle_build (&s_mk);
+    }
+    c_printf ("merkle: reading back 0x%08X, len = %u\n", s_uds.dl_addr, s_uds.dl_recv);
+    merkle_reset (&s_mk);
+    fp = fopen ("out.dat", "rb");
+    if ((fp == NULL) || (fseek (fp, (long)(s_uds.dl_addr - s_flash_base), SEEK_SET) != 0))
+    {
+        if (fp != NULL)
+        {
+            fclose (fp);
+        }
+        return -1;
+    }
+    for (pos = 0; pos < s_uds.dl_recv; pos += len)
+    {
+        len = my_min(s_uds.dl_recv - pos, sizeof(buf));
+        if ((fread (buf, 1, len, fp) != len) || (merkle_update (&s_mk, buf, len) != 0))
+        {
+            fclose (fp);
+            return -1;
+        }
+    }
+    fclose (fp);
+    return merkle_build (&s_mk);
+}
+
+/* level MERKLE_ROOT_QUERY : region, leaf length, levels and root, otherwise the children of node (level, index) */
+static void srv_routine_control_merkle_node (uint8_t *data, uint32_t size)
+{
+    static uint8_t msg[10 + MERKLE_FANOUT * MERKLE_DIGEST_LEN];
+    const uint64_t *child;
+    uint32_t level, idx, first, n, i;
+
+    s_uds.sub_func = data[1];
+    if (size != 9)
+    {
+        send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+        return;
+    }
+    if (s_uds.dl_recv == 0)
+    {
+        send_negative_response(ERROR_REQUEST_SEQUENCE);
+        return;
+    }
+    if (srv_merkle_sync () != 0)
+    {
+        send_negative_response(ERROR_CONDITIONS_NOT_CORRECT);
+        return;
+    }
+    level = data[4];
+    idx = get_u32(&data[5]);
+    msg[0] = 0x71;
+    msg[1] = 0x01;
+    msg[2] = (uint8_t)(ROUTINE_MERKLE_NODE >> 8);
+    msg[3] = (uint8_t)(ROUTINE_MERKLE_NODE & 0xFF);
+    if (level == MERKLE_ROOT_QUERY)
+    {
+        c_printf ("merkle: 0x%08X, len = %u, %u levels\n", s_uds.dl_addr, s_uds.dl_recv, s_mk.levels);
+        msg[4] = MERKLE_ROOT_QUERY;
+        put_u32(&msg[5], s_uds.dl_addr);
+        put_u32(&msg[9], s_uds.dl_recv);
+        put_u32(&msg[13], MERKLE_LEAF_LEN);
+        msg[17] = (uint8_t)s_mk.levels;
+        put_u64(&msg[18], merkle_level (&s_mk, s_mk.levels - 1)[0]);
+        uds_tp_send(msg, 26);
+        return;
+    }
+    if ((level == 0) || (level >= s_mk.levels) || (idx >= s_mk.cnt[level]))
+    {
+        send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+        return;
+    }
+    child = merkle_level (&s_mk, level - 1);
+    first = idx * MERKLE_FANOUT;
+    n = my_min(s_mk.cnt[level - 1] - first, MERKLE_FANOUT);
+    msg[4] = (uint8_t)level;
+    put_u32(&msg[5], idx);
+    msg[9] = (uint8_t)n;
+    for (i = 0; i < n; i++)
+    {
+        put_u64(&msg[10 + i * MERKLE_DIGEST_LEN], child[first + i]);
+    }
+    uds_tp_send(msg, 10 + n * MERKLE_DIGEST_LEN);
+}
+
+/* listening, the tester connects when it starts its first local copy */
+static void srv_local_listen (void)
+{
+    struct sockaddr_un sa;
+    socklen_t len;
+
+    memset (&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf (&sa.sun_path[1], sizeof(sa.sun_path) - 1, LOCAL_SOCKET_NAME, s_local_id);
+    len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + 1 + strlen (&sa.sun_path[1]));
+    s_local_fd = socket (AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if ((s_local_fd < 0) || (bind (s_local_fd, (struct sockaddr *)&sa, len) != 0) || (listen (s_local_fd, 1) != 0))
+    {
+        c_printf ("local copy: @%s not available, TransferData only\n", &sa.sun_path[1]);
+        if (s_local_fd >= 0)
+        {
+            close (s_local_fd);
+            s_local_fd = -1;
+        }
+    }
+}
+
+/* the file descriptor the tester sent ahead of its request, with the file range it stands for, -1 when none is queued */
+static int srv_local_recv (uint64_t *off, uint32_t *len)
+{
+    uint8_t buf[LOCAL_MSG_LEN];
+    union { struct cmsghdr hdr; char space[CMSG_SPACE(sizeof(int))]; } ctl;
+    struct iovec iov = { buf, sizeof(buf) };
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    ssize_t n;
+    int fd = -1;
+
+    if (s_local_conn < 0)
+    {
+        s_local_conn = accept4 (s_local_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (s_local_conn < 0)
+        {
+            return -1;
+        }
+    }
+    memset (&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.space;
+    msg.msg_controllen = sizeof(ctl.space);
+    n = recvmsg (s_local_conn, &msg, MSG_CMSG_CLOEXEC);
+    if (n <= 0)
+    {
+        if ((n == 0) || (errno != EAGAIN))
+        {
+            close (s_local_conn);   /* the tester went away, the next one is accepted */
+            s_local_conn = -1;
+        }
+        return -1;
+    }
+    cm = CMSG_FIRSTHDR(&msg);
+    if ((cm != NULL) && (cm->cmsg_level == SOL_SOCKET) && (cm->cmsg_type == SCM_RIGHTS))
+    {
+        memcpy (&fd, CMSG_DATA(cm), sizeof(fd));
+    }
+    if ((fd >= 0) && ((n != LOCAL_MSG_LEN) || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC))))
+    {
+        close (fd);
+        fd = -1;
+    }
+    memcpy (off, &buf[0], sizeof(*off));
+    memcpy (len, &buf[8], sizeof(*len));
+    return fd;
+}
+
+/* len bytes of fd from off to the flash at addr, in the kernel, reflinked where the file system shares extents */
+static int srv_local_copy (int fd, uint64_t off, uint32_t addr, uint32_t len)
+{
+    static uint8_t buf[64 * 1024];
+    loff_t src = (loff_t)off;
+    loff_t dst = (loff_t)(addr - s_flash_base);
+    uint32_t left = len, pos, n;
+    ssize_t ret = 0;
+
+    while (left > 0)
+    {
+        ret = copy_file_range (fd, &src, outFd, &dst, left, 0);
+        if (ret <= 0)
+        {
+            break;
+        }
+        left -= (uint32_t)ret;
+    }
+    if ((ret < 0) && ((errno == EXDEV) || (errno == EINVAL) || (errno == EOPNOTSUPP) || (errno == ENOSYS)))
+    {
+        /* older kernels and some file system pairs, sendfile still keeps the bytes out of user space */
+        if (lseek (outFd, dst, SEEK_SET) != dst)
+        {
+            return -1;
+        }
+        while (left > 0)
+        {
+            ret = sendfile (outFd, fd, &src, left);
+            if (ret <= 0)
+            {
+                break;
+            }
+            left -= (uint32_t)ret;
+        }
+    }
+    if (left != 0)
+    {
+        c_printf ("local copy: 0x%08X, %u of %u bytes copied\n", addr, len - left, len);
+        return -1;
+    }
+    /* the running digests see what landed in out.dat, CheckMemory stays a check of the flash */
+    for (pos = 0; pos < len; pos += n)
+    {
+        n = my_min(len - pos, sizeof(buf));
+        if (pread (outFd, buf, n, (off_t)(addr - s_flash_base) + pos) != (ssize_t)n)
+        {
+            return -1;
+        }
+        srv_verify_update (buf, n);
+    }
+    return 0;
+}
+
+/* [31 01 02 03 addr(4) len(4)] : the next len bytes of a plain download, from the file the tester passed */
+static void srv_routine_control_local_copy (uint8_t *data, uint32_t size)
+{
+    uint8_t msg[3];
+    uint64_t file_off = 0;
+    uint32_t addr, len, file_len = 0;
+    int fd;
+
+    s_uds.sub_func = data[1];
+    if (size != 12)
+    {
+        send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+        return;
+    }
+    fd = (s_local_fd >= 0) ? srv_local_recv (&file_off, &file_len) : -1;
+    addr = get_u32(&data[4]);
+    len = get_u32(&data[8]);
+    if (fd < 0)
+    {
+        c_printf ("local copy: no file from the tester\n");
+        send_negative_response(ERROR_CONDITIONS_NOT_CORRECT);
+        return;
+    }
+    if ((outFd < 0) || (upFd >= 0) || (s_uds.dl_comp != 0) || (s_uds.dl_enc != 0) || (file_len != len) ||
+        (addr != s_uds.dl_start + s_uds.dl_off) || (addr != s_uds.dl_addr + s_uds.dl_recv) ||
+        (len > s_uds.dl_size - s_uds.dl_off))
+    {
+        c_printf ("local copy: 0x%08X, len = %u is not the next part of a plain download\n", addr, len);
+        close (fd);
+        send_negative_response(ERROR_REQUEST_SEQUENCE);
+        return;
+    }
+    msg[0] = data[2];
+    msg[1] = data[3];
+    msg[2] = 0;
+    if (srv_local_copy (fd, file_off, addr, len) == 0)
+    {
+        s_uds.dl_off += len;
+        srv_journal_commit (0);
+        c_printf ("local copy: 0x%08X, len = %u, from file offset %llu\n", addr, len, (unsigned long long)file_off);
+    }
+    else
+    {
+        msg[2] = 1;
+    }
+    close (fd);
+    send_positive_response(msg, 3);
+}
+
+static void srv_routine_control_check_programming_dependency (uint8_t *data, uint32_t size)
+{
+    uint8_t msg[8];
+
+    s_uds.sub_func = data[1];
+    if (size != 4)
+    {
+        send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+        return;
+    }
+    msg[0] = 0x71;
+    msg[1] = 0x01;
+    msg[2] = 0xFF;
+    msg[3] = 0x01;
+    msg[4] = 0x00; // 0=success, 1 = error
+    msg[5] = 0x00; // 0=success, 1 = error
+    msg[6] = 0x00; // 0=success, 1 = error
+    msg[7] = 0x00; // 0=success, 1 = error
+    uds_tp_send(msg, 8);
+}
+
+static void srv_routine_control (uint8_t *data, uint32_t size)
 {
     uint16_t routine_id;
 
@@ -493,9 +1403,18 @@ static void srv_routine_control (uint8_t *data, uint16_t size)
                 case ROUTINE_CHECK_MEMORY:
                     srv_routine_control_check_memory (data, size);
                     break;
+                case ROUTINE_CHECK_DIGEST:
+                    srv_routine_control_check_digest (data, size);
+                    break;
                 case ROUTINE_CHECK_PROG_DEPENDENCY:
                     srv_routine_control_check_programming_dependency (data, size);
                     break;
+                case ROUTINE_MERKLE_NODE:
+                    srv_routine_control_merkle_node (data, size);
+                    break;
+                case ROUTINE_LOCAL_COPY:
+                    srv_routine_control_local_copy (data, size);
+                    break;
                 default:
                     send_negative_response(ERROR_SUB_FUNCTION_NOT_SUPPORT);
                     break;
@@ -507,92 +1426,307 @@ static void srv_routine_control (uint8_t *data, uint16_t size)
     }
 }
 
-static void srv_request_download (uint8_t *data, uint16_t size)
+/* decoded TransferData bytes to the flash at the download offset, 0 or the NRC */
+static int srv_program (void *arg, const uint8_t *data, uint32_t len)
+{
+    if (len > s_uds.dl_size - s_uds.dl_off)
+    {
+        c_printf("SERVER: block seq = %u runs past the requested size (0x%08X).\n", s_uds.blk_cnt, s_uds.dl_size);
+        return ERROR_TRANSFER_DATA_SUSPENDED;
+    }
+    /* positioned by the absolute offset, the 8 bit counter wraps 0xFF -> 0x00 on long downloads */
+    if (srv_write_flash (s_uds.dl_start + s_uds.dl_off, data, len) != 0)
+    {
+        return 0x72; // General Programming Failure
+    }
+    srv_verify_update (data, len);
+    s_uds.dl_off += len;
+    return 0;
+}
+
+static void srv_upload_end (void)
+{
+    if (upFd >= 0)
+    {
+        close(upFd);
+        upFd = -1;
+    }
+}
+
+/* maxNumberOfBlockLength, default 0xF02(3842), never more than the transport carries */
+static void send_block_len_response (void)
+{
+    uint8_t msg[6];
+    uint32_t blk_len;
+    uint8_t max_num_of_block_len;
+
+    blk_len = my_min(s_max_block_len, uds_tp_max_len());
+    max_num_of_block_len = (blk_len > 0xFFFF) ? 4 : 2;
+    msg[0] = s_uds.service + 0x40;
+    msg[1] = (uint8_t)(max_num_of_block_len << 4); // length format identifier
+    if (max_num_of_block_len == 4)
+    {
+        put_u32(&msg[2], blk_len);
+    }
+    else
+    {
+        put_u16(&msg[2], (uint16_t)blk_len);
+    }
+    uds_tp_send(msg, 2 + max_num_of_block_len);
+}
+
+static void srv_request_download (uint8_t *data, uint32_t size)
 {
-    uint8_t msg[4];
     uint32_t file_start_addr, file_size;
-    uint8_t max_num_of_block_len = 2;
+    uint8_t enc;
 
     s_uds.sub_func = data[1];
-    if ((size != 11) || (data[1] != 0) || (data[2] != 0x44))
+    if ((size != 11) || (data[2] != 0x44))
     {
         send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
         return;
     }
+    /* dataFormatIdentifier : compression method high nibble, encryption low nibble */
+    enc = data[1] & 0x0F;
+    if (((data[1] >> 4) > DFI_COMPRESSION_LZ) || (enc > DFI_ENCRYPTION_AES256_CTR) ||
+        ((enc != 0) && ((s_aes_len != ((enc == DFI_ENCRYPTION_AES128_CTR) ? 16 : 32)) || !s_uds.nonce_set)))
+    {
+        c_printf ("request download: dataFormatIdentifier 0x%02X not supported%s\n", data[1],
+                  (enc && !s_uds.nonce_set) ? " (no cipher nonce)" : "");
+        send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+        return;
+    }
     file_start_addr = get_u32(&data[3]);
     file_size       = get_u32(&data[7]);
+    if ((file_start_addr < s_flash_base) || (file_size > 0xFFFFFFFF - file_start_addr))
+    {
+        c_printf ("request download: 0x%08X is outside the flash window (base 0x%08X)\n", file_start_addr, s_flash_base);
+        send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+        return;
+    }
+    if (srv_verify_continues (file_start_addr, file_size))
+    {
+        s_uds.flash_new = 0;    /* the erased region, or a journal from an earlier run, is being continued */
+    }
+    srv_upload_end ();
+    if (srv_open_flash () != 0)
+    {
+        send_negative_response(0x72); // General Programming Failure
+        return;
+    }
     s_uds.blk_cnt = 1;
-    c_printf ("request download, file_start_addr = 0x%08X, file_size = 0x%08X\n", file_start_addr, file_size);
+    s_uds.dl_start = file_start_addr;
+    s_uds.dl_size = file_size;
+    s_uds.dl_off = 0;
+    s_uds.dl_blk = 0;
+    s_uds.dl_comp = data[1] >> 4;
+    s_uds.dl_enc = enc;
+    s_uds.dl_rx = 0;
+    lz_stream_init (&s_lz);
+    if (enc != 0)
+    {
+        aes_ctr_start (s_uds.dl_ctr, s_uds.nonce, s_uds.nonce_seq++, file_start_addr);
+    }
+    /* a region after skipped erased blocks extends the verify region, the gap is read back */
+    if (!srv_verify_continues (file_start_addr, file_size) || (srv_verify_fill (file_start_addr) != 0))
+    {
+        srv_verify_reset (file_start_addr);
+    }
+    c_printf ("request download, file_start_addr = 0x%08X, file_size = 0x%08X%s%s\n", file_start_addr, file_size,
+              s_uds.dl_comp ? ", compressed" : "", enc ? ", encrypted" : "");
+    send_block_len_response ();
+}
 
-    /***********************************************/
-    msg[0] = s_uds.service + 0x40;
-    msg[1] = (uint8_t)(max_num_of_block_len << 4); // length format identifier
+/* the stored image back to the client, one block per TransferData request, the same block length as a download */
+static void srv_request_upload (uint8_t *data, uint32_t size)
+{
+    uint32_t mem_addr, mem_size;
 
-    /* maxNumberOfBlockLength 0xF02(3842) */
-    msg[2] = 0x0F;
-    msg[3] = 0x02;
-    uds_tp_send(msg, 4);
+    s_uds.sub_func = data[1];
+    if ((size != 11) || (data[2] != 0x44))
+    {
+        send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+        return;
+    }
+    mem_addr = get_u32(&data[3]);
+    mem_size = get_u32(&data[7]);
+    if ((data[1] != 0) || (mem_addr < s_flash_base) || (mem_size == 0) ||
+        ((uint64_t)mem_addr - s_flash_base + mem_size > srv_flash_size ()))
+    {
+        c_printf ("request upload: 0x%08X, len = %u, dataFormatIdentifier 0x%02X refused\n", mem_addr, mem_size, data[1]);
+        send_negative_response(ERROR_REQUEST_OUT_OF_RANGE);
+        return;
+    }
+    if (outFd >= 0)
+    {
+        close(outFd);
+        outFd = -1;
+    }
+    srv_upload_end ();
+    upFd = open("out.dat", O_RDONLY);
+    if (upFd < 0)
+    {
+        send_negative_response(ERROR_CONDITIONS_NOT_CORRECT);
+        return;
+    }
+    s_uds.blk_cnt = 1;
+    s_uds.ul_start = mem_addr;
+    s_uds.ul_size = mem_size;
+    s_uds.ul_off = 0;
+    s_uds.ul_blk = 0;
+    c_printf ("request upload, mem_addr = 0x%08X, mem_size = 0x%08X\n", mem_addr, mem_size);
+    send_block_len_response ();
 }
 
-static void srv_transfer_data (uint8_t *data, uint16_t size)
+/* upload direction : the request carries only the counter, the response the next block of the image */
+static void srv_transfer_upload (uint8_t *data, uint32_t size)
 {
+    static uint8_t msg[UDS_TP_MAX_LEN];
     uint8_t seq = data[1];
-    uint8_t *p = &data[2];
+    uint32_t off, len;
+    ssize_t n;
 
-    if (size < 3)
+    if (size != 2)
     {
         send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
         return;
     }
+    if ((s_uds.ul_blk != 0) && (seq == (uint8_t)(s_uds.blk_cnt - 1)))
+    {
+        off = s_uds.ul_off - s_uds.ul_last_len;     /* the response was lost, the same block again */
+        len = s_uds.ul_last_len;
+    }
+    else if ((seq == s_uds.blk_cnt) && (s_uds.ul_off < s_uds.ul_size))
+    {
+        off = s_uds.ul_off;
+        len = my_min(s_uds.ul_size - off, my_min(s_max_block_len, uds_tp_max_len()) - 2);
+    }
+    else
+    {
+        c_printf("SERVER: upload block seq = %u out of sequence (expected %u, %u of %u bytes sent).\n",
+                 seq, s_uds.blk_cnt, s_uds.ul_off, s_uds.ul_size);
+        send_negative_response(ERROR_REQUEST_SEQUENCE);
+        return;
+    }
+    n = pread(upFd, &msg[2], len, (off_t)(s_uds.ul_start - s_flash_base) + off);
+    if (n != (ssize_t)len)
+    {
+        c_printf("SERVER: Error reading out.dat at 0x%08X.\n", s_uds.ul_start + off);
+        send_negative_response(ERROR_CONDITIONS_NOT_CORRECT);
+        return;
+    }
+    if (off == s_uds.ul_off)
+    {
+        s_uds.ul_off += len;
+        s_uds.ul_blk++;
+        s_uds.ul_last_len = len;
+        s_uds.blk_cnt++;
+    }
+    msg[0] = SRV_TRANSFER_DATA + 0x40;
+    msg[1] = seq;
+    uds_tp_send(msg, 2 + len);
+}
 
-    if (seq == 1)
+static void srv_transfer_data (uint8_t *data, uint32_t size)
+{
+    uint8_t seq = data[1];
+    uint8_t *p = &data[2];
+    uint32_t len;
+    int nrc;
+
+    if (upFd >= 0)
     {
-        if (outFile != NULL)
-        {
-            fclose(outFile); // Close if already open (e.g., interrupted transfer)
-            outFile = NULL;
-        }
-        outFile = fopen("out.dat", "wb");
-        if (outFile == NULL)
-        {
-            // perror is not available, use c_printf
-            c_printf("SERVER: Error opening out.dat for writing.\n");
-            send_negative_response(0x72); // General Programming Failure
-            return;
-        }
+        srv_transfer_upload (data, size);
+        return;
     }
-    else if (outFile == NULL)
+    if ((size < 3 + s_uds.tag_len) || (size > my_min(s_max_block_len, uds_tp_max_len())))
     {
-        // This means we missed the first block or an error occurred after opening
-        c_printf("SERVER: outFile is NULL for seq > 1.\n");
+        send_negative_response(ERROR_INCORRECT_MESSAGE_LENGTH_OR_INVALID_FORMAT);
+        return;
+    }
+
+    if (outFd < 0)
+    {
+        // No RequestDownload before, or an error occurred after opening
+        c_printf("SERVER: out.dat is not open, no download in progress.\n");
         send_negative_response(ERROR_REQUEST_SEQUENCE);
         return;
     }
 
+    /* ISO 14229-1, a repeated request whose response was lost is answered again, the block is already written */
+    if ((s_uds.dl_blk != 0) && (seq == (uint8_t)(s_uds.blk_cnt - 1)) && (size - 2 - s_uds.tag_len == s_uds.dl_last_len))
+    {
+        c_printf("SERVER: block seq = %u (#%u) repeated, not written again.\n", seq, s_uds.dl_blk);
+        s_uds.sub_func = seq;
+        send_positive_response(NULL, 0);
+        return;
+    }
+
     if (s_uds.blk_cnt != seq)
     {
         c_printf("SERVER: Sequence error. Expected: %u, Got: %u.\n", s_uds.blk_cnt, seq);
+        /* in a window every later request is refused the same way until the expected one is resent */
         send_negative_response(ERROR_REQUEST_SEQUENCE);
-        // Do not close outFile here, as a new transfer might start
+        // Do not close out.dat here, as a new transfer might start
         return;
     }
 
-    if (fwrite(p, 1, size - 2, outFile) != (size_t)(size - 2))
+    /* a damaged block is refused before it reaches the flash, the client resends it with the same counter */
+    if (s_uds.tag_len != 0)
     {
-        c_printf("SERVER: Error writing to outFile.\n");
-        fclose(outFile);
-        outFile = NULL;
-        send_negative_response(0x72); // General Programming Failure
+        size -= s_uds.tag_len;
+        if (make_crc32(0xFFFFFFFF, p, size - 2) != get_u32(&data[size]))
+        {
+            c_printf("SERVER: block seq = %u, crc trailer mismatch.\n", seq);
+            send_negative_response(ERROR_BLOCK_TAG_MISMATCH);
+            return;
+        }
+    }
+
+    len = size - 2;
+    if (s_uds.dl_enc != 0)
+    {
+        /* in place in the receive buffer, the trailer above covered the ciphertext */
+        aes_ctr_xor (&s_aes, s_uds.dl_ctr, s_uds.dl_rx, p, len);
+    }
+    if (s_uds.dl_comp == 0)
+    {
+        nrc = srv_program (NULL, p, len);
+    }
+    else
+    {
+        /* chunks are written as they complete, a chunk split over blocks waits in s_lz */
+        nrc = lz_stream_feed (&s_lz, p, len, srv_program, NULL);
+        if (nrc < 0)
+        {
+            c_printf("SERVER: block seq = %u, compressed data corrupt.\n", seq);
+            nrc = 0x72;
+        }
+    }
+    if (nrc != 0)
+    {
+        if ((nrc == 0x72) || (s_uds.dl_comp != 0))
+        {
+            /* chunks before the failing one may be written already, the decoder can not take the block again */
+            lz_stream_init (&s_lz);
+            close(outFd);
+            outFd = -1;
+        }
+        send_negative_response((uint8_t)nrc);
         return;
     }
-    fflush(outFile); // Ensure data is written to disk
+    srv_journal_commit (0);     /* whole chunks only, a resumed download starts on a chunk boundary */
 
+    s_uds.dl_rx += len;
+    s_uds.dl_blk++;
+    s_uds.dl_last_len = len;
     s_uds.blk_cnt++;
-    c_printf ("transfer data: seq = %u, data[] = %02X %02X ..., len = %u\n", seq, p[0], p[1], size - 2);
+    s_uds.sub_func = seq;   /* the response echoes the counter, a windowed client matches it to its oldest block */
+    c_printf ("transfer data: seq = %u, data[] = %02X %02X ..., len = %u\n", seq, p[0], p[1], len);
     send_positive_response(NULL, 0);
 }
 
-static void srv_req_transfer_exit (uint8_t *data, uint16_t size)
+static void srv_req_transfer_exit (uint8_t *data, uint32_t size)
 {
     // s_uds.sub_func = data[1]; // No sub-function for RequestTransferExit, and data[1] is out of bounds if size is 1.
                                 // For this service, sub_func is often ignored or considered 0.
@@ -602,10 +1736,26 @@ static void srv_req_transfer_exit (uint8_t *data, uint16_t size)
         return;
     }
 
-    if (outFile != NULL)
+    if (upFd >= 0)
     {
-        fclose(outFile);
-        outFile = NULL;
+        c_printf("SERVER: upload ended, %u of %u bytes sent.\n", s_uds.ul_off, s_uds.ul_size);
+        srv_upload_end ();
+        send_positive_response(NULL, 0);
+        return;
+    }
+
+    if ((s_uds.dl_comp != 0) && !lz_stream_idle (&s_lz))
+    {
+        c_printf("SERVER: compressed download ended inside a chunk.\n");
+        send_negative_response(ERROR_REQUEST_SEQUENCE);
+        return;
+    }
+
+    if (outFd >= 0)
+    {
+        srv_journal_commit (1);     /* the whole region, not only the last JOURNAL_SYNC_LEN step */
+        close(outFd);
+        outFd = -1;
     }
 
     send_positive_response(NULL, 0); // Send positive response (SID + 0x40)
@@ -617,12 +1767,14 @@ static void srv_req_transfer_exit (uint8_t *data, uint16_t size)
       o  |  o  |  o  |  0x3E Tester Present
       o  |  o  |  o  |  0x10 Session Control
       o  |  o  |  o  |  0x11 ECU Reset
-      o  |     |     |  0x22 Read DID
+      o  |  o  |  o  |  0x22 Read DID (software version / transfer journal / block hash)
          |  o  |     |  0x85 DTC Setting
          |  o  |     |  0x28 Communication Control
+         |  o  |  o  |  0x2E Write DID (verification algorithm / transfer window / block crc / cipher nonce / patch region)
          |  o  |  o  |  0x27 Security Access (Seed / Key)
-         |  o  |  o  |  0x31 Routine control (Erase Memory / Check Memory / Check Programming Dependency)
+         |  o  |  o  |  0x31 Routine control (Erase Memory / Check Memory / Check Digest / Local Copy / Check Programming Dependency)
          |     |  o  |  0x34 Request Download
+         |     |  o  |  0x35 Request Upload (readback of the stored image)
          |     |  o  |  0x36 Transfer Data
          |     |  o  |  0x37 Request Transfer Exit
 
@@ -639,16 +1791,19 @@ step
  10  SecureAccess (request seed)
  11  SecureAccess (send key)
  12  Erase Memory (file start addr(0x1D000000), size(x))
- 13  RequestDownload (file start addr(0x1D000000), size(x))
+ 13  RequestDownload (dataFormatIdentifier compression(0/1) << 4 | encryption(0/1/2), file start addr(0x1D000000), size(x))
  14  TransferData (data)
+ 14a LocalCopy (31 01 02 03, addr, len), instead of TransferData, the image fd comes over the local socket
  15  RequestTransferExit
+ 15a RequestUpload / TransferData / RequestTransferExit (readback, same block length)
  16  CheckMemory (mem addr(0x1D000000), mem size(x), verify data len=4, verify data(x))
+ 16a CheckDigest (31 01 02 01, sha256(32))
  17  CheckProgrammingDependency(31 01 FF 01)
  18  Extended session
  19  ECU Reset
 */
 
-static int check_session (uint8_t *data, uint16_t size)
+static int check_session (uint8_t *data, uint32_t size)
 {
     switch (s_uds.service)
     {
@@ -661,8 +1816,10 @@ static int check_session (uint8_t *data, uint16_t size)
         case SRV_SECURITY_ACCESS:
         case SRV_CONTROL_DTC:
         case SRV_COMM_CONTROL:
+        case SRV_WRITE_DID:
         case SRV_ROUTINE_CONTROL:
         case SRV_REQUEST_DOWNLOAD:
+        case SRV_REQUEST_UPLOAD:
         case SRV_TRANSFER_DATA:
         case SRV_REQ_TRANSFER_EXIT:
             if (s_uds.session == SESSION_DEFAULT)
@@ -681,12 +1838,13 @@ c_printf ("%s, %d\n", __FILE__, __LINE__);
     return 0;
 }
 
-static int check_security (uint8_t *data, uint16_t size)
+static int check_security (uint8_t *data, uint32_t size)
 {
     switch (s_uds.service)
     {
         case SRV_ROUTINE_CONTROL:
         case SRV_REQUEST_DOWNLOAD:
+        case SRV_REQUEST_UPLOAD:
         case SRV_TRANSFER_DATA:
         case SRV_REQ_TRANSFER_EXIT:
             if (s_uds.secure == 0)
@@ -702,7 +1860,7 @@ c_printf ("%s, %d\n", __FILE__, __LINE__);
     return 0;
 }
 
-static int check_message (uint8_t *data, uint16_t size)
+static int check_message (uint8_t *data, uint32_t size)
 {
     if (check_session (data, size) == 0)
     {
@@ -715,7 +1873,7 @@ static int check_message (uint8_t *data, uint16_t size)
 
 }
 
-void uds_parse(uint8_t *data, uint16_t size)
+void uds_parse(uint8_t *data, uint32_t size)
 {
     session_timeout_check ();
     s_uds.service = data[0];
@@ -735,6 +1893,10 @@ void uds_parse(uint8_t *data, uint16_t size)
                 srv_read_did (data, size);
                 break;
 
+            case SRV_WRITE_DID:
+                srv_write_did (data, size);
+                break;
+
             case SRV_SECURITY_ACCESS:
                 srv_security_access (data, size);
                 break;
@@ -760,6 +1922,10 @@ void uds_parse(uint8_t *data, uint16_t size)
                 srv_request_download (data, size);
                 break;
 
+            case SRV_REQUEST_UPLOAD:
+                srv_request_upload (data, size);
+                break;
+
             case SRV_TRANSFER_DATA:
                 srv_transfer_data (data, size);
                 break;
@@ -777,17 +1943,48 @@ void uds_parse(uint8_t *data, uint16_t size)
 
 void uds_poll (void)
 {
-    static uint8_t buf[4096];
-    uint16_t len;
+    static uint8_t buf[UDS_TP_MAX_LEN];
+    int len;
 
-    len = uds_tp_receive(buf);
-    if (len > 0)
+    /* a windowed client may have queued several requests, they are answered in order */
+    while ((len = uds_tp_receive(buf)) > 0)
     {
         uds_parse(buf, len);
     }
 }
 
+void uds_set_flash_base (uint32_t addr)
+{
+    s_flash_base = addr;
+}
+
+void uds_set_max_block_len (uint32_t len)
+{
+    s_max_block_len = len;
+}
+
+/* copy downloads from the image file of tester pid, ROUTINE_LOCAL_COPY */
+void uds_set_local (int pid)
+{
+    s_local_id = pid;
+}
+
+int uds_set_aes_key (const uint8_t *key, uint32_t len)
+{
+    if (aes_set_key (&s_aes, key, len) != 0)
+    {
+        return -1;
+    }
+    s_aes_len = len;
+    return 0;
+}
+
 void uds_init (void)
 {
     uds_hal_init();
+    srv_journal_load ();
+    if (s_local_id >= 0)
+    {
+        srv_local_listen ();
+    }
 }
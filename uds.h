@@ -5,7 +5,11 @@
 #include "uds_hal.h"
 
 void uds_init (void);
-void uds_parse(uint8_t *data, uint16_t size);
+void uds_parse(uint8_t *data, uint32_t size);
 void uds_poll (void);
+void uds_set_flash_base (uint32_t addr);
+void uds_set_max_block_len (uint32_t len);
+int uds_set_aes_key (const uint8_t *key, uint32_t len);
+void uds_set_local (int pid);
 
 #endif
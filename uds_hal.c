@@ -1,14 +1,105 @@
+#define _GNU_SOURCE     /* memfd_create() */
 #include <inttypes.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <stdarg.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "util.h"
 #include "uds_hal.h"
+#include "isotp.h"
+#include "doip.h"
 
-static uint8_t tp_buf_from_server[4096];
-static uint8_t tp_buf_from_client[4096];
-static uint16_t tp_len_from_server;
-static uint16_t tp_len_from_client;
+#define TP_CACHE_LINE       64
+#define TP_FRAME_LEN(n)     ((4 + (n) + 3) & ~3u)   /* length word + payload, kept 4 byte aligned */
+#define TP_FULL_WAIT_MS     1000    /* a sender waits this long for the receiver before it gives up */
+#define CAN_ID_CLIENT       0x7E0   /* physical requests, tester to ECU */
+#define CAN_ID_SERVER       0x7E8   /* responses, ECU to tester */
+#define TP_SHM_MAGIC        0x55445349  /* "UDSI" */
+
+_Static_assert((UDS_TP_RING_LEN & (UDS_TP_RING_LEN - 1)) == 0, "UDS_TP_RING_LEN must be a power of two");
+_Static_assert(UDS_TP_RING_LEN >= UDS_TP_QUEUE_DEPTH * TP_FRAME_LEN(UDS_TP_MAX_LEN), "ring too small for the window");
+
+/*
+    lock-free single producer / single consumer ring of variable length frames, one per direction
+    head and tail run freely and are masked on access, each side caches the other's index on its own line
+*/
+typedef struct
+{
+    uint32_t tail __attribute__((aligned(TP_CACHE_LINE)));     /* producer line */
+    uint32_t head_cache;
+    uint32_t head __attribute__((aligned(TP_CACHE_LINE)));     /* consumer line */
+    uint32_t tail_cache;
+    uint32_t waiting;               /* the consumer sleeps on the tail futex, the producer has to wake it */
+    uint8_t  buf[UDS_TP_RING_LEN] __attribute__((aligned(TP_CACHE_LINE)));
+} tp_ring_t;
+
+static tp_ring_t tp_from_server;
+static tp_ring_t tp_from_client;
+
+/*
+    tester and ECU in separate processes : both rings live in a memfd the tester creates and the server
+    inherits, frames cross without a syscall, a futex only wakes a consumer that went to sleep
+*/
+typedef struct
+{
+    uint32_t magic;
+    uint32_t ring_len;              /* both executables were built with the same UDS_TP_RING_LEN */
+    uint32_t closed;                /* the tester is done, the server exits */
+    tp_ring_t from_server;
+    tp_ring_t from_client;
+} tp_shm_t;
+
+static tp_ring_t *s_from_server = &tp_from_server;
+static tp_ring_t *s_from_client = &tp_from_client;
+static tp_shm_t *s_shm;
+static int s_shm_server;            /* this process is the ECU side of s_shm */
+static pid_t s_server_pid;
+
+/*
+    ISO-TP mode : the message rings above queue each side's outgoing messages for its ISO-TP sender,
+    the frames travel on a virtual CAN bus made of two more rings
+*/
+typedef struct
+{
+    tp_ring_t *out;                 /* messages waiting for the sender */
+    tp_ring_t *bus_rx;              /* frames from the other node */
+    isotp_link_t link;
+    uint8_t  tx_msg[UDS_TP_MAX_LEN];    /* message being segmented */
+    uint8_t  rx_msg[UDS_TP_MAX_LEN];    /* message being reassembled */
+} tp_node_t;
+
+static int s_isotp;
+static isotp_cfg_t s_isotp_cfg;
+static uint32_t s_isotp_tm;
+static tp_ring_t can_from_server;
+static tp_ring_t can_from_client;
+static tp_node_t tp_server;
+static tp_node_t tp_client;
+
+/* DoIP mode : both sides talk over a TCP connection on 127.0.0.1, the message rings are not used */
+static int s_doip;
+static uint16_t s_doip_port;
+static int s_doip_listen = -1;
+static uint32_t s_doip_tm;
+static doip_conn_t doip_entity;
+static doip_conn_t doip_tester;
+
+#ifdef UDS_FAULT_TEST
+/* test build only : one TransferData request of the tester is damaged or lost on the way */
+static uint32_t s_fault_blk;        /* 1 based, 0 = off */
+static int s_fault_drop;
+static uint32_t s_fault_cnt;
+static uint8_t s_fault_msg[UDS_TP_MAX_LEN];
+#endif
 
 void c_printf (const char *format, ...)
 {
@@ -19,18 +110,172 @@ void c_printf (const char *format, ...)
     va_end (argp);
 }
 
-int uds_tp_send(uint8_t *payload, uint16_t size)
+/* len bytes at the free running position pos, split where the ring wraps */
+static void ring_write (tp_ring_t *r, uint32_t pos, const void *data, uint32_t len)
+{
+    uint32_t off = pos & (UDS_TP_RING_LEN - 1);
+    uint32_t n = my_min(len, UDS_TP_RING_LEN - off);
+
+    memcpy (&r->buf[off], data, n);
+    memcpy (r->buf, (const uint8_t *)data + n, len - n);
+}
+
+static void ring_read (const tp_ring_t *r, uint32_t pos, void *data, uint32_t len)
+{
+    uint32_t off = pos & (UDS_TP_RING_LEN - 1);
+    uint32_t n = my_min(len, UDS_TP_RING_LEN - off);
+
+    memcpy (data, &r->buf[off], n);
+    memcpy ((uint8_t *)data + n, r->buf, len - n);
+}
+
+/* producer side, -1 while the receiver has not made room */
+static int tp_put (tp_ring_t *r, const uint8_t *payload, uint32_t size)
+{
+    uint32_t tail = r->tail;
+    uint32_t need = TP_FRAME_LEN(size);
+
+    if (UDS_TP_RING_LEN - (tail - r->head_cache) < need)
+    {
+        r->head_cache = __atomic_load_n (&r->head, __ATOMIC_ACQUIRE);
+        if (UDS_TP_RING_LEN - (tail - r->head_cache) < need)
+        {
+            return -1;
+        }
+    }
+    ring_write (r, tail, &size, 4);
+    ring_write (r, tail + 4, payload, size);
+    __atomic_store_n (&r->tail, tail + need, __ATOMIC_SEQ_CST);     /* the frame is visible only once complete */
+    if (__atomic_load_n (&r->waiting, __ATOMIC_SEQ_CST))
+    {
+        syscall (SYS_futex, &r->tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+    }
+    return 0;
+}
+
+/* consumer side, 0 when no frame is waiting */
+static int tp_get (tp_ring_t *r, uint8_t *payload)
+{
+    uint32_t head = r->head;
+    uint32_t len;
+
+    if (head == r->tail_cache)
+    {
+        r->tail_cache = __atomic_load_n (&r->tail, __ATOMIC_ACQUIRE);
+        if (head == r->tail_cache)
+        {
+            return 0;
+        }
+    }
+    ring_read (r, head, &len, 4);
+    ring_read (r, head + 4, payload, len);
+    __atomic_store_n (&r->head, head + TP_FRAME_LEN(len), __ATOMIC_RELEASE);
+    return len;
+}
+
+/* isotp_can_tx_t of the virtual bus, a frame is its id and length words and the data on the bus */
+static int can_put (void *arg, const can_frame_t *frame)
+{
+    return tp_put (arg, (const uint8_t *)frame, offsetof(can_frame_t, data) + frame->len);
+}
+
+/* keeps the sender busy with the queued messages as far as flow control allows */
+static void tp_node_pump (tp_node_t *n)
+{
+    int len;
+
+    for (;;)
+    {
+        isotp_poll (&n->link);
+        if (!isotp_tx_idle (&n->link) || ((len = tp_get (n->out, n->tx_msg)) <= 0))
+        {
+            break;
+        }
+        isotp_send (&n->link, n->tx_msg, len);
+    }
+}
+
+/* frames from the bus until a message is complete, 0 when the bus runs dry first */
+static int tp_node_receive (tp_node_t *n, uint8_t *payload)
+{
+    can_frame_t frame;
+    int len;
+
+    for (;;)
+    {
+        tp_node_pump (n);
+        if (tp_get (n->bus_rx, (uint8_t *)&frame) <= 0)
+        {
+            return 0;
+        }
+        len = isotp_on_frame (&n->link, &frame);
+        if (len > 0)
+        {
+            memcpy (payload, n->rx_msg, len);
+            return len;
+        }
+    }
+}
+
+/* consumer side, sleeps until the producer publishes a frame or ms pass */
+static void tp_wait (tp_ring_t *r, uint32_t ms)
+{
+    struct timespec ts;
+    uint32_t head = r->head;
+
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000 * 1000;
+    __atomic_store_n (&r->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n (&r->tail, __ATOMIC_SEQ_CST) == head)
+    {
+        syscall (SYS_futex, &r->tail, FUTEX_WAIT, head, &ts, NULL, 0);
+    }
+    __atomic_store_n (&r->waiting, 0, __ATOMIC_RELAXED);
+}
+
+/* a full ring holds the sender back until the receiver drains it, frames are never dropped */
+static int tp_send (tp_ring_t *r, const uint8_t *payload, uint32_t size)
 {
-    if (tp_len_from_server != 0)
+    uint32_t tm = os_get_tick();
+
+    while (tp_put (r, payload, size) != 0)
+    {
+        if ((os_get_tick() - tm) >= TP_FULL_WAIT_MS)
+        {
+            return -1;
+        }
+        sched_yield ();
+    }
+    return 0;
+}
+
+int uds_tp_send(uint8_t *payload, uint32_t size)
+{
+    if (size > UDS_TP_MAX_LEN)
+    {
+        printf ("uds_tp_send_server(), too long (%u)\n", size);
+        return -1;
+    }
+    if (s_doip)
+    {
+        if (doip_send (&doip_entity, payload, size) != 0)
+        {
+            printf ("uds_tp_send_server(), not connected\n");
+            return -1;
+        }
+    }
+    else if (tp_send (s_from_server, payload, size) != 0)
     {
         printf ("uds_tp_send_server(), full\n");
-        return 0;
+        return -1;
+    }
+    if (s_isotp)
+    {
+        tp_node_pump (&tp_server);
     }
-    memcpy (tp_buf_from_server, payload, size);
-    tp_len_from_server = size;
 
 {
-    uint16_t i;
+    uint32_t i;
 
     c_printf ("TP Tx:");
     for (i = 0; i < size; i++)
@@ -45,38 +290,100 @@ int uds_tp_send(uint8_t *payload, uint16_t size)
 
 int uds_tp_receive(uint8_t *payload)
 {
-    uint16_t len = tp_len_from_client;
+    int fd;
 
-    if (len > 0)
+    if (s_doip)
     {
-        memcpy (payload, tp_buf_from_client, len);
-        tp_len_from_client = 0;;
+        if (doip_entity.fd < 0)
+        {
+            fd = doip_accept (s_doip_listen);
+            if ((fd < 0) || (doip_conn_init (&doip_entity, fd, 1, DOIP_ADDR_ENTITY, DOIP_ADDR_TESTER, UDS_TP_MAX_LEN) != 0))
+            {
+                return 0;
+            }
+        }
+        return doip_receive (&doip_entity, payload);
     }
-    return len;
+    if (s_isotp)
+    {
+        return tp_node_receive (&tp_server, payload);
+    }
+    return tp_get (s_from_client, payload);
 }
 
-int uds_tp_send_client(uint8_t *payload, uint16_t size)
+int uds_tp_send_client(uint8_t *payload, uint32_t size)
 {
-    if (tp_len_from_client != 0)
+    if (size > UDS_TP_MAX_LEN)
     {
-        printf ("uds_tp_send_client(), full\n");
+        printf ("uds_tp_send_client(), too long (%u)\n", size);
+        return -1;
+    }
+#ifdef UDS_FAULT_TEST
+    if ((s_fault_blk != 0) && (size > 2) && (payload[0] == 0x36) && (++s_fault_cnt == s_fault_blk))
+    {
+        printf ("fault: TransferData #%u, block seq = %u %s\n", s_fault_cnt, payload[1], s_fault_drop ? "dropped" : "damaged");
+        if (s_fault_drop)
+        {
+            return 0;
+        }
+        /* the caller's buffer may be the read-only image mapping */
+        memcpy (s_fault_msg, payload, size);
+        s_fault_msg[2] ^= 0x01;
+        payload = s_fault_msg;
+    }
+#endif
+    if (s_doip)
+    {
+        if (doip_send (&doip_tester, payload, size) != 0)
+        {
+            printf ("uds_tp_send_client(), not connected\n");
+            return -1;
+        }
         return 0;
     }
-    memcpy (tp_buf_from_client, payload, size);
-    tp_len_from_client = size;
+    if (tp_send (s_from_client, payload, size) != 0)
+    {
+        printf ("uds_tp_send_client(), full\n");
+        return -1;
+    }
+    if (s_isotp)
+    {
+        tp_node_pump (&tp_client);
+    }
     return 0;
 }
 
 int uds_tp_receive_client(uint8_t *payload)
 {
-    uint16_t len = tp_len_from_server;
+    if (s_doip)
+    {
+        return doip_receive (&doip_tester, payload);
+    }
+    if (s_isotp)
+    {
+        return tp_node_receive (&tp_client, payload);
+    }
+    return tp_get (s_from_server, payload);
+}
 
-    if (len > 0)
+/* a request is still being sent, N_USData.con has not come for it, P2 starts once it has */
+int uds_tp_busy_client(void)
+{
+    if (s_doip)
     {
-        memcpy (payload, tp_buf_from_server, len);
-        tp_len_from_server = 0;;
+        return doip_tester.tx_len != 0;
     }
-    return len;
+    if (s_isotp)
+    {
+        return !isotp_tx_idle (&tp_client.link) ||
+               (__atomic_load_n (&s_from_client->tail, __ATOMIC_ACQUIRE) != s_from_client->head);
+    }
+    return 0;
+}
+
+uint32_t uds_tp_max_len(void)
+{
+    return UDS_TP_MAX_LEN;
 }
 
 uint32_t uds_get_ms(void)
@@ -84,6 +391,209 @@ uint32_t uds_get_ms(void)
     return os_get_tick();
 }
 
+/* before uds_init(), tx_dl 8 or 64, bs and stmin are what both receivers ask for */
+int uds_hal_set_isotp (uint32_t tx_dl, uint8_t bs, uint8_t stmin)
+{
+    if ((tx_dl != ISOTP_CAN_DL) && (tx_dl != ISOTP_CANFD_DL))
+    {
+        return -1;
+    }
+    s_isotp_cfg.tx_dl = tx_dl;
+    s_isotp_cfg.bs = bs;
+    s_isotp_cfg.stmin = stmin;
+    s_isotp = 1;
+    return 0;
+}
+
+#ifdef UDS_FAULT_TEST
+/* n-th TransferData request of the tester, its first data byte is flipped or the request is not sent */
+void uds_hal_set_fault (int drop, uint32_t n)
+{
+    s_fault_drop = drop;
+    s_fault_blk = n;
+    s_fault_cnt = 0;
+}
+#endif
+
+/* before uds_init(), port 0 takes any free port */
+void uds_hal_set_doip (uint16_t port)
+{
+    s_doip_port = port;
+    s_doip = 1;
+}
+
+static void doip_report (const char *name, const doip_conn_t *c)
+{
+    const doip_stats_t *st = &c->stats;
+
+    printf ("doip: %s 0x%04X: %" PRIu64 " diagnostic messages, %" PRIu64 " bytes in %" PRIu64 " send calls, %" PRIu64 " bytes queued, %" PRIu64 " acks\n",
+            name, c->sa, st->msgs, st->bytes, st->calls, st->queued, st->acks);
+}
+
+static void isotp_report (const char *name, const isotp_link_t *link)
+{
+    const isotp_stats_t *st = &link->stats;
+
+    printf ("isotp: %s 0x%03X: SF %u, FF %u, CF %u, FC %u, %" PRIu64 " message bytes in %" PRIu64 " bus bytes (%.1f%%)\n",
+            name, link->tx_id, st->sf, st->ff, st->cf, st->fc, st->msg_bytes, st->bus_bytes,
+            (st->bus_bytes != 0) ? 100.0 * (double)st->msg_bytes / (double)st->bus_bytes : 0.0);
+}
+
+/* frame counts and bus efficiency of both directions */
+void uds_hal_report (void)
+{
+    if (s_doip)
+    {
+        printf ("doip: 127.0.0.1:%u, %u ms\n", s_doip_port, os_get_tick() - s_doip_tm);
+        doip_report ("tester", &doip_tester);
+        doip_report ("entity", &doip_entity);
+    }
+    if (!s_isotp)
+    {
+        return;
+    }
+    printf ("isotp: tx_dl %u, bs %u, stmin 0x%02X, %u ms\n", s_isotp_cfg.tx_dl, s_isotp_cfg.bs, s_isotp_cfg.stmin,
+            os_get_tick() - s_isotp_tm);
+    isotp_report ("client", &tp_client.link);
+    isotp_report ("server", &tp_server.link);
+}
+
+static tp_shm_t *shm_map (int fd)
+{
+    tp_shm_t *shm = mmap (NULL, sizeof(tp_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+    return (shm != MAP_FAILED) ? shm : NULL;
+}
+
+/* tester side, before uds_hal_init() : the rings go to a memfd and cmd runs with "-m fd" appended */
+int uds_hal_spawn_server (const char *cmd)
+{
+    char line[1024];
+    pid_t pid;
+    int fd;
+
+    fd = memfd_create ("uds_rings", 0);
+    if ((fd < 0) || (ftruncate (fd, sizeof(tp_shm_t)) != 0) || ((s_shm = shm_map (fd)) == NULL))
+    {
+        perror ("ipc: memfd");
+        return -1;
+    }
+    s_shm->magic = TP_SHM_MAGIC;
+    s_shm->ring_len = UDS_TP_RING_LEN;
+    snprintf (line, sizeof(line), "exec %s -m %d", cmd, fd);
+    fflush (stdout);
+    pid = fork ();
+    if (pid == 0)
+    {
+        prctl (PR_SET_PDEATHSIG, SIGTERM);
+        execl ("/bin/sh", "sh", "-c", line, (char *)NULL);
+        _exit (127);
+    }
+    close (fd);
+    if (pid < 0)
+    {
+        perror ("ipc: fork");
+        return -1;
+    }
+    s_server_pid = pid;
+    s_from_server = &s_shm->from_server;
+    s_from_client = &s_shm->from_client;
+    return 0;
+}
+
+/* server side, the memfd the tester passed */
+int uds_hal_attach (int fd)
+{
+    struct stat st;
+
+    if ((fstat (fd, &st) != 0) || (st.st_size < (off_t)sizeof(tp_shm_t)) || ((s_shm = shm_map (fd)) == NULL))
+    {
+        printf ("ipc: fd %d is not a ring memfd\n", fd);
+        return -1;
+    }
+    close (fd);
+    if ((s_shm->magic != TP_SHM_MAGIC) || (s_shm->ring_len != UDS_TP_RING_LEN))
+    {
+        printf ("ipc: ring layout differs, rebuild both executables\n");
+        return -1;
+    }
+    s_shm_server = 1;
+    s_from_server = &s_shm->from_server;
+    s_from_client = &s_shm->from_client;
+    return 0;
+}
+
+/* idle time of a poll loop, cut short by a frame for this side once the rings are shared */
+void uds_hal_wait (uint32_t ms)
+{
+    if (s_shm == NULL)
+    {
+        os_delay (ms);
+        return;
+    }
+    tp_wait (s_shm_server ? s_from_client : s_from_server, ms);
+}
+
+/* server side, the tester has finished */
+int uds_hal_closed (void)
+{
+    return (s_shm != NULL) && __atomic_load_n (&s_shm->closed, __ATOMIC_SEQ_CST);
+}
+
+/* tester side, tells the server to exit and waits for it */
+void uds_hal_close (void)
+{
+    int status;
+
+    if ((s_shm == NULL) || s_shm_server)
+    {
+        return;
+    }
+    __atomic_store_n (&s_shm->closed, 1, __ATOMIC_SEQ_CST);
+    syscall (SYS_futex, &s_shm->from_client.tail, FUTEX_WAKE, 1, NULL, NULL, 0);
+    if (waitpid (s_server_pid, &status, 0) == s_server_pid)
+    {
+        printf ("ipc: server %d exited, status %d\n", (int)s_server_pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    }
+}
+
+/* the tester connects at once and asks for routing activation, the entity accepts from uds_tp_receive() */
+static int doip_init (void)
+{
+    int fd;
+
+    s_doip_listen = doip_listen (&s_doip_port);
+    if (s_doip_listen < 0)
+    {
+        return -1;
+    }
+    doip_entity.fd = -1;
+    fd = doip_connect (s_doip_port);
+    if ((fd < 0) || (doip_conn_init (&doip_tester, fd, 0, DOIP_ADDR_TESTER, DOIP_ADDR_ENTITY, UDS_TP_MAX_LEN) != 0))
+    {
+        return -1;
+    }
+    s_doip_tm = os_get_tick();
+    return doip_activate (&doip_tester);
+}
+
 void uds_hal_init (void)
 {
+    if (s_doip && (doip_init () != 0))
+    {
+        printf ("doip: no connection on port %u\n", s_doip_port);
+    }
+    if (!s_isotp)
+    {
+        return;
+    }
+    tp_client.out = s_from_client;
+    tp_client.bus_rx = &can_from_server;
+    isotp_init (&tp_client.link, &s_isotp_cfg, CAN_ID_CLIENT, CAN_ID_SERVER, can_put, &can_from_client,
+                tp_client.rx_msg, sizeof(tp_client.rx_msg));
+    tp_server.out = s_from_server;
+    tp_server.bus_rx = &can_from_client;
+    isotp_init (&tp_server.link, &s_isotp_cfg, CAN_ID_SERVER, CAN_ID_CLIENT, can_put, &can_from_server,
+                tp_server.rx_msg, sizeof(tp_server.rx_msg));
+    s_isotp_tm = os_get_tick();
 }
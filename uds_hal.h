@@ -7,12 +7,40 @@
 
 #include <inttypes.h>
 
-int uds_tp_send(uint8_t *payload, uint16_t size);
+/* largest UDS message the transport carries, ISO-TP uses the escaped first frame above 4095 */
+#ifndef UDS_TP_MAX_LEN
+#define UDS_TP_MAX_LEN  (64 * 1024)
+#endif
+
+/* requests a client may keep outstanding, every direction holds at least this many frames of UDS_TP_MAX_LEN */
+#ifndef UDS_TP_QUEUE_DEPTH
+#define UDS_TP_QUEUE_DEPTH  32
+#endif
+
+/* bytes of frames a direction holds, a power of two */
+#ifndef UDS_TP_RING_LEN
+#define UDS_TP_RING_LEN     (4 * 1024 * 1024)
+#endif
+
+int uds_tp_send(uint8_t *payload, uint32_t size);
 int uds_tp_receive(uint8_t *payload);
+uint32_t uds_tp_max_len(void);
 uint32_t uds_get_ms(void);
 void uds_hal_init (void);
-int uds_tp_send_client(uint8_t *payload, uint16_t size);
+int uds_hal_set_isotp (uint32_t tx_dl, uint8_t bs, uint8_t stmin);
+void uds_hal_set_doip (uint16_t port);
+#ifdef UDS_FAULT_TEST
+void uds_hal_set_fault (int drop, uint32_t n);
+#endif
+void uds_hal_report (void);
+int uds_hal_spawn_server (const char *cmd);
+int uds_hal_attach (int fd);
+void uds_hal_wait (uint32_t ms);
+int uds_hal_closed (void);
+void uds_hal_close (void);
+int uds_tp_send_client(uint8_t *payload, uint32_t size);
 int uds_tp_receive_client(uint8_t *payload);
+int uds_tp_busy_client(void);
 
 #ifdef __cplusplus
     }
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "uds.h"
+#include "uds_hal.h"
+#include "util.h"
+
+#define SERVER_IDLE_MS      10      /* longest sleep between polls, a frame from the tester ends it early */
+
+static void usage (char *name)
+{
+    printf ("usage: %s -m fd [-l] [-K key] [-B base] [-L len]\n", name);
+    printf ("  the simulated ECU alone, started by 'uds_fw_update -X' which appends -m\n");
+    printf ("  -m    memfd holding the frame rings\n");
+    printf ("  -l    copy downloads from the image file the tester passes over a unix socket\n");
+    printf ("  -K    pre-shared AES-CTR key, 32 or 64 hex digits, the same as the tester's\n");
+    printf ("  -B    flash address stored at offset 0 of out.dat (default 0x1D0000)\n");
+    printf ("  -L    maxNumberOfBlockLength (default 3842)\n");
+}
+
+int main (int argc, char *argv[])
+{
+    uint8_t key[32];
+    int c, key_len, fd = -1;
+
+    while ((c = getopt(argc, argv, "m:lK:B:L:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'm':
+                fd = (int)strtol (optarg, NULL, 0);
+                break;
+            case 'l':
+                uds_set_local ((int)getppid ());    /* the tester that started this process */
+                break;
+            case 'K':
+                key_len = parse_hex (optarg, key, sizeof(key));
+                if ((key_len < 0) || (uds_set_aes_key (key, key_len) != 0))
+                {
+                    printf ("key must be 32 or 64 hex digits\n");
+                    return 1;
+                }
+                break;
+            case 'B':
+                uds_set_flash_base ((uint32_t)strtoul (optarg, NULL, 0));
+                break;
+            case 'L':
+                uds_set_max_block_len ((uint32_t)strtoul (optarg, NULL, 0));
+                break;
+            default:
+                usage (argv[0]);
+                return 1;
+        }
+    }
+    if ((fd < 0) || (uds_hal_attach (fd) != 0))
+    {
+        usage (argv[0]);
+        return 1;
+    }
+
+    uds_init ();
+    while (!uds_hal_closed ())
+    {
+        uds_poll ();
+        uds_hal_wait (SERVER_IDLE_MS);
+    }
+    return 0;
+}
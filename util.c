@@ -1,7 +1,15 @@
+#include <stdio.h>
 #include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <string.h>
 #include "util.h"
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32_HAVE_CLMUL
+#endif
+
 const uint32_t g_crc32_table[256] =
 {
     0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9, 0x130476dc, 0x17c56b6b, 0x1a864db2, 0x1e475005,
@@ -38,10 +46,19 @@ const uint32_t g_crc32_table[256] =
     0xafb010b1, 0xab710d06, 0xa6322bdf, 0xa2f33668, 0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
 
-uint32_t make_crc32(uint32_t crc, const void *buf, uint32_t len)
+#define CRC32_POLY  0x04C11DB7
+
+typedef uint32_t (*crc32_kernel_t)(uint32_t crc, const uint8_t *data, uint32_t len);
+
+/* g_crc32_slice[k][b] : crc of byte b followed by k zero bytes, g_crc32_slice[0] == g_crc32_table */
+static uint32_t g_crc32_slice[16][256];
+static crc32_kernel_t s_crc32_kernel;
+static const char *s_crc32_kernel_name;
+static pthread_once_t s_crc32_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32_bytewise(uint32_t crc, const uint8_t *data, uint32_t len)
 {
     uint32_t i;
-    const uint8_t *data = buf;
 
     for (i = 0; i < len; i++)
     {
@@ -50,6 +67,457 @@ uint32_t make_crc32(uint32_t crc, const void *buf, uint32_t len)
     return crc;
 }
 
+static uint32_t crc32_slice16(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+    while (len >= 16)
+    {
+        crc = g_crc32_slice[15][data[0] ^ (crc >> 24)] ^
+              g_crc32_slice[14][data[1] ^ ((crc >> 16) & 0xff)] ^
+              g_crc32_slice[13][data[2] ^ ((crc >> 8) & 0xff)] ^
+              g_crc32_slice[12][data[3] ^ (crc & 0xff)] ^
+              g_crc32_slice[11][data[4]]  ^ g_crc32_slice[10][data[5]] ^
+              g_crc32_slice[9][data[6]]   ^ g_crc32_slice[8][data[7]] ^
+              g_crc32_slice[7][data[8]]   ^ g_crc32_slice[6][data[9]] ^
+              g_crc32_slice[5][data[10]]  ^ g_crc32_slice[4][data[11]] ^
+              g_crc32_slice[3][data[12]]  ^ g_crc32_slice[2][data[13]] ^
+              g_crc32_slice[1][data[14]]  ^ g_crc32_slice[0][data[15]];
+        data += 16;
+        len -= 16;
+    }
+    return crc32_bytewise(crc, data, len);
+}
+
+/* a(x) * b(x) mod P(x), bit n = coefficient of x^n */
+static uint32_t crc32_mulmod(uint32_t a, uint32_t b)
+{
+    uint32_t r = 0;
+    int i;
+
+    for (i = 31; i >= 0; i--)
+    {
+        r = (r << 1) ^ ((r & 0x80000000) ? CRC32_POLY : 0);
+        if ((b >> i) & 1)
+        {
+            r ^= a;
+        }
+    }
+    return r;
+}
+
+/* x^n mod P(x) */
+static uint32_t crc32_xpow(uint64_t n)
+{
+    uint32_t r = 1, base = 2;
+
+    while (n != 0)
+    {
+        if (n & 1)
+        {
+            r = crc32_mulmod(r, base);
+        }
+        base = crc32_mulmod(base, base);
+        n >>= 1;
+    }
+    return r;
+}
+
+#ifdef CRC32_HAVE_CLMUL
+/*
+    Folding over 128 bit lanes (Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ").
+    The CRC is not reflected, so every lane is byte swapped and carry-less products need no shift.
+    A lane X = Xh * x^64 + Xl is moved forward by D bits as Xh * (x^(D+64) mod P) ^ Xl * (x^D mod P),
+    which is congruent modulo P.  The remaining 128 bit lane and the tail are reduced with the table.
+*/
+static __m128i s_crc32_k512;    /* x^576 mod P : x^512 mod P */
+static __m128i s_crc32_k128;    /* x^192 mod P : x^128 mod P */
+
+__attribute__((target("pclmul,ssse3")))
+static inline __m128i crc32_fold(__m128i x, __m128i k, __m128i next)
+{
+    return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x11), _mm_clmulepi64_si128(x, k, 0x00)), next);
+}
+
+__attribute__((target("pclmul,ssse3")))
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *data, uint32_t len)
+{
+    const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i x0, x1, x2, x3;
+    uint8_t tmp[16];
+
+    if (len < 128)
+    {
+        return crc32_slice16(crc, data, len);
+    }
+
+    /* crc(init, M) == crc(0, M ^ init), init xored into the first 4 bytes */
+    x0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), bswap);
+    x1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap);
+    x2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap);
+    x3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap);
+    x0 = _mm_xor_si128(x0, _mm_set_epi32((int)crc, 0, 0, 0));
+    data += 64;
+    len -= 64;
+
+    while (len >= 64)
+    {
+        x0 = crc32_fold(x0, s_crc32_k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 0)), bswap));
+        x1 = crc32_fold(x1, s_crc32_k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 16)), bswap));
+        x2 = crc32_fold(x2, s_crc32_k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 32)), bswap));
+        x3 = crc32_fold(x3, s_crc32_k512, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + 48)), bswap));
+        data += 64;
+        len -= 64;
+    }
+
+    x0 = crc32_fold(x0, s_crc32_k128, x1);
+    x0 = crc32_fold(x0, s_crc32_k128, x2);
+    x0 = crc32_fold(x0, s_crc32_k128, x3);
+    while (len >= 16)
+    {
+        x0 = crc32_fold(x0, s_crc32_k128, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)data), bswap));
+        data += 16;
+        len -= 16;
+    }
+
+    _mm_storeu_si128((__m128i *)tmp, _mm_shuffle_epi8(x0, bswap));
+    crc = crc32_slice16(0, tmp, sizeof(tmp));
+    return crc32_slice16(crc, data, len);
+}
+#endif
+
+static void crc32_init (void)
+{
+    int i, k;
+
+    for (i = 0; i < 256; i++)
+    {
+        g_crc32_slice[0][i] = g_crc32_table[i];
+    }
+    for (k = 1; k < 16; k++)
+    {
+        for (i = 0; i < 256; i++)
+        {
+            uint32_t c = g_crc32_slice[k - 1][i];
+
+            g_crc32_slice[k][i] = (c << 8) ^ g_crc32_table[c >> 24];
+        }
+    }
+
+    s_crc32_kernel = crc32_slice16;
+    s_crc32_kernel_name = "slice16";
+#ifdef CRC32_HAVE_CLMUL
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+    {
+        s_crc32_k512 = _mm_set_epi64x(crc32_xpow(576), crc32_xpow(512));
+        s_crc32_k128 = _mm_set_epi64x(crc32_xpow(192), crc32_xpow(128));
+        s_crc32_kernel = crc32_clmul;
+        s_crc32_kernel_name = "pclmul";
+    }
+#endif
+}
+
+const char *crc32_kernel_name (void)
+{
+    pthread_once(&s_crc32_once, crc32_init);
+    return s_crc32_kernel_name;
+}
+
+/* non-reflected CRC32 (poly 0x04C11DB7), no final xor */
+uint32_t make_crc32(uint32_t crc, const void *buf, uint32_t len)
+{
+    pthread_once(&s_crc32_once, crc32_init);
+    return s_crc32_kernel(crc, buf, len);
+}
+
+/* crc(crc1, A + B) from crc1 = crc(init, A) and crc2 = crc(0, B) */
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint32_t len2)
+{
+    return crc32_mulmod(crc1, crc32_xpow((uint64_t)len2 * 8)) ^ crc2;
+}
+
+#define CRC32_MT_MAX_THREADS    64
+#define CRC32_MT_MIN_CHUNK      (1024 * 1024)
+
+typedef struct
+{
+    pthread_t th;
+    int started;
+    const uint8_t *data;
+    uint32_t len;
+    uint32_t crc;
+} crc32_job_t;
+
+static void *crc32_worker(void *arg)
+{
+    crc32_job_t *job = arg;
+
+    job->crc = make_crc32(job->crc, job->data, job->len);
+    return NULL;
+}
+
+/* same result as make_crc32(), the buffer is split over threads workers, 0 = one per online cpu */
+uint32_t make_crc32_mt(uint32_t crc, const void *buf, uint32_t len, int threads)
+{
+    crc32_job_t job[CRC32_MT_MAX_THREADS];
+    const uint8_t *data = buf;
+    uint32_t chunk;
+    int i, n = threads;
+
+    if (n <= 0)
+    {
+        n = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    n = my_min(n, CRC32_MT_MAX_THREADS);
+    n = my_min(n, (int)(len / CRC32_MT_MIN_CHUNK));
+    if (n <= 1)
+    {
+        return make_crc32(crc, buf, len);
+    }
+
+    chunk = (len / n) & ~63u;
+    for (i = 0; i < n; i++)
+    {
+        job[i].data = data + (size_t)chunk * i;
+        job[i].len = (i == n - 1) ? (len - chunk * i) : chunk;
+        job[i].crc = (i == 0) ? crc : 0;
+        job[i].started = (i > 0) && (pthread_create(&job[i].th, NULL, crc32_worker, &job[i]) == 0);
+        if ((i > 0) && !job[i].started)
+        {
+            crc32_worker(&job[i]);
+        }
+    }
+    crc32_worker(&job[0]);
+
+    crc = job[0].crc;
+    for (i = 1; i < n; i++)
+    {
+        if (job[i].started)
+        {
+            pthread_join(job[i].th, NULL);
+        }
+        crc = crc32_combine(crc, job[i].crc, job[i].len);
+    }
+    return crc;
+}
+
+
+typedef uint32_t (*mem_span_kernel_t)(const uint8_t *data, uint32_t len, uint8_t val);
+
+static mem_span_kernel_t s_mem_span_kernel;
+static pthread_once_t s_mem_span_once = PTHREAD_ONCE_INIT;
+
+static uint32_t mem_span_word(const uint8_t *data, uint32_t len, uint8_t val)
+{
+    uint64_t pat = 0x0101010101010101ULL * val;
+    uint64_t w;
+    uint32_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        memcpy(&w, data + i, 8);
+        if (w != pat)
+        {
+            break;
+        }
+    }
+    while ((i < len) && (data[i] == val))
+    {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint32_t mem_span_sse2(const uint8_t *data, uint32_t len, uint8_t val)
+{
+    __m128i v = _mm_set1_epi8((char)val);
+    uint32_t i = 0, mask;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), v);
+        __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 16)), v);
+        __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 32)), v);
+        __m128i d = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i + 48)), v);
+
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), _mm_and_si128(c, d))) != 0xFFFF)
+        {
+            break;
+        }
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(data + i)), v));
+        if (mask != 0xFFFF)
+        {
+            return i + (uint32_t)__builtin_ctz(~mask);
+        }
+    }
+    return i + mem_span_word(data + i, len - i, val);
+}
+
+__attribute__((target("avx2")))
+static uint32_t mem_span_avx2(const uint8_t *data, uint32_t len, uint8_t val)
+{
+    __m256i v = _mm256_set1_epi8((char)val);
+    uint32_t i = 0, mask;
+
+    for (; i + 128 <= len; i += 128)
+    {
+        __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), v);
+        __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 32)), v);
+        __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 64)), v);
+        __m256i d = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i + 96)), v);
+
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), _mm256_and_si256(c, d))) != 0xFFFFFFFF)
+        {
+            break;
+        }
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(data + i)), v));
+        if (mask != 0xFFFFFFFF)
+        {
+            return i + (uint32_t)__builtin_ctz(~mask);
+        }
+    }
+    return i + mem_span_sse2(data + i, len - i, val);
+}
+#endif
+
+static void mem_span_init (void)
+{
+    s_mem_span_kernel = mem_span_word;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        s_mem_span_kernel = mem_span_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        s_mem_span_kernel = mem_span_sse2;
+    }
+#endif
+}
+
+/* number of leading bytes equal to val, e.g. the erased (0xFF) run at the start of buf */
+uint32_t mem_span(const void *buf, uint32_t len, uint8_t val)
+{
+    pthread_once(&s_mem_span_once, mem_span_init);
+    return s_mem_span_kernel(buf, len, val);
+}
+
+typedef uint32_t (*mem_diff_kernel_t)(const uint8_t *a, const uint8_t *b, uint32_t len);
+
+static mem_diff_kernel_t s_mem_diff_kernel;
+static pthread_once_t s_mem_diff_once = PTHREAD_ONCE_INIT;
+
+static uint32_t mem_diff_word(const uint8_t *a, const uint8_t *b, uint32_t len)
+{
+    uint64_t x, y;
+    uint32_t i = 0;
+
+    for (; i + 8 <= len; i += 8)
+    {
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y)
+        {
+            break;
+        }
+    }
+    while ((i < len) && (a[i] == b[i]))
+    {
+        i++;
+    }
+    return i;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static uint32_t mem_diff_sse2(const uint8_t *a, const uint8_t *b, uint32_t len)
+{
+    uint32_t i = 0, mask;
+
+    for (; i + 64 <= len; i += 64)
+    {
+        __m128i c0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)), _mm_loadu_si128((const __m128i *)(b + i)));
+        __m128i c1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 16)), _mm_loadu_si128((const __m128i *)(b + i + 16)));
+        __m128i c2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 32)), _mm_loadu_si128((const __m128i *)(b + i + 32)));
+        __m128i c3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i + 48)), _mm_loadu_si128((const __m128i *)(b + i + 48)));
+
+        if (_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(c0, c1), _mm_and_si128(c2, c3))) != 0xFFFF)
+        {
+            break;
+        }
+    }
+    for (; i + 16 <= len; i += 16)
+    {
+        mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(a + i)),
+                                                          _mm_loadu_si128((const __m128i *)(b + i))));
+        if (mask != 0xFFFF)
+        {
+            return i + (uint32_t)__builtin_ctz(~mask);
+        }
+    }
+    return i + mem_diff_word(a + i, b + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static uint32_t mem_diff_avx2(const uint8_t *a, const uint8_t *b, uint32_t len)
+{
+    uint32_t i = 0, mask;
+
+    for (; i + 128 <= len; i += 128)
+    {
+        __m256i c0 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i c1 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 32)), _mm256_loadu_si256((const __m256i *)(b + i + 32)));
+        __m256i c2 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 64)), _mm256_loadu_si256((const __m256i *)(b + i + 64)));
+        __m256i c3 = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i + 96)), _mm256_loadu_si256((const __m256i *)(b + i + 96)));
+
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(c0, c1), _mm256_and_si256(c2, c3))) != 0xFFFFFFFF)
+        {
+            break;
+        }
+    }
+    for (; i + 32 <= len; i += 32)
+    {
+        mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                                                _mm256_loadu_si256((const __m256i *)(b + i))));
+        if (mask != 0xFFFFFFFF)
+        {
+            return i + (uint32_t)__builtin_ctz(~mask);
+        }
+    }
+    return i + mem_diff_sse2(a + i, b + i, len - i);
+}
+#endif
+
+static void mem_diff_init (void)
+{
+    s_mem_diff_kernel = mem_diff_word;
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        s_mem_diff_kernel = mem_diff_avx2;
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        s_mem_diff_kernel = mem_diff_sse2;
+    }
+#endif
+}
+
+/* offset of the first byte where a and b differ, len when they are equal */
+uint32_t mem_diff(const void *a, const void *b, uint32_t len)
+{
+    pthread_once(&s_mem_diff_once, mem_diff_init);
+    return s_mem_diff_kernel(a, b, len);
+}
 
 uint32_t os_get_tick (void)
 {
@@ -118,6 +586,23 @@ void put_u64(void *p, uint64_t val)
 
 
 
+/* hex string to at most max bytes, the byte count or -1 */
+int parse_hex (const char *str, uint8_t *buf, int max)
+{
+    unsigned int val;
+    int n;
+
+    for (n = 0; (str[0] != '\0') && (n < max); n++, str += 2)
+    {
+        if ((str[1] == '\0') || (sscanf (str, "%2x", &val) != 1))
+        {
+            return -1;
+        }
+        buf[n] = (uint8_t)val;
+    }
+    return (str[0] == '\0') ? n : -1;
+}
+
 #if 0
 #include <conio.h>
 #include <stdio.h>
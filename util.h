@@ -18,6 +18,12 @@ void put_u16(void *p, uint16_t val);
 void put_u32(void *p, uint32_t val);
 void put_u64(void *p, uint64_t val);
 uint32_t make_crc32(uint32_t crc, const void *buf, uint32_t len);
+const char *crc32_kernel_name (void);
+uint32_t crc32_combine(uint32_t crc1, uint32_t crc2, uint32_t len2);
+uint32_t make_crc32_mt(uint32_t crc, const void *buf, uint32_t len, int threads);
+uint32_t mem_span(const void *buf, uint32_t len, uint8_t val);
+uint32_t mem_diff(const void *a, const void *b, uint32_t len);
+int parse_hex (const char *str, uint8_t *buf, int max);
 
 #if 0
 #ifdef _WIN32
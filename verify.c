@@ -0,0 +1,328 @@
+#include <string.h>
+#include <pthread.h>
+#include "util.h"
+#include "verify.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CRC32C_HAVE_SSE42
+#endif
+
+/***********************************************************************************/
+/* CRC32C (Castagnoli, reflected 0x82F63B78) */
+
+#define CRC32C_POLY_REV 0x82F63B78
+
+typedef uint32_t (*crc32c_kernel_t)(uint32_t crc, const uint8_t *data, uint32_t len);
+
+static uint32_t s_crc32c_table[256];
+static crc32c_kernel_t s_crc32c_kernel;
+static pthread_once_t s_crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t crc32c_bytewise (uint32_t crc, const uint8_t *data, uint32_t len)
+{
+    while (len--)
+    {
+        crc = (crc >> 8) ^ s_crc32c_table[(crc ^ *data++) & 0xff];
+    }
+    return crc;
+}
+
+#ifdef CRC32C_HAVE_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42 (uint32_t crc, const uint8_t *data, uint32_t len)
+{
+#ifdef __x86_64__
+    uint64_t c = crc, v;
+
+    while (len >= 8)
+    {
+        memcpy (&v, data, 8);
+        c = _mm_crc32_u64 (c, v);
+        data += 8;
+        len -= 8;
+    }
+    crc = (uint32_t)c;
+#endif
+    while (len--)
+    {
+        crc = _mm_crc32_u8 (crc, *data++);
+    }
+    return crc;
+}
+#endif
+
+static void crc32c_init (void)
+{
+    uint32_t i, j, c;
+
+    for (i = 0; i < 256; i++)
+    {
+        c = i;
+        for (j = 0; j < 8; j++)
+        {
+            c = (c >> 1) ^ ((c & 1) ? CRC32C_POLY_REV : 0);
+        }
+        s_crc32c_table[i] = c;
+    }
+    s_crc32c_kernel = crc32c_bytewise;
+#ifdef CRC32C_HAVE_SSE42
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2"))
+    {
+        s_crc32c_kernel = crc32c_sse42;
+    }
+#endif
+}
+
+/* raw register update, start with 0xFFFFFFFF and invert the result */
+uint32_t make_crc32c (uint32_t crc, const void *buf, uint32_t len)
+{
+    pthread_once(&s_crc32c_once, crc32c_init);
+    return s_crc32c_kernel(crc, buf, len);
+}
+
+/***********************************************************************************/
+/* XXH64 */
+
+#define XXH_P1  0x9E3779B185EBCA87ULL
+#define XXH_P2  0xC2B2AE3D27D4EB4FULL
+#define XXH_P3  0x165667B19E3779F9ULL
+#define XXH_P4  0x85EBCA77C2B2AE63ULL
+#define XXH_P5  0x27D4EB2F165667C5ULL
+
+static inline uint64_t xxh_rotl (uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t xxh_read64 (const uint8_t *p)
+{
+    return (uint64_t)p[0] | ((uint64_t)p[1] << 8) | ((uint64_t)p[2] << 16) | ((uint64_t)p[3] << 24) |
+           ((uint64_t)p[4] << 32) | ((uint64_t)p[5] << 40) | ((uint64_t)p[6] << 48) | ((uint64_t)p[7] << 56);
+}
+
+static inline uint32_t xxh_read32 (const uint8_t *p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t xxh_round (uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    acc = xxh_rotl(acc, 31);
+    return acc * XXH_P1;
+}
+
+static inline uint64_t xxh_merge (uint64_t acc, uint64_t val)
+{
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+void xxh64_init (xxh64_ctx_t *ctx, uint64_t seed)
+{
+    memset (ctx, 0, sizeof(*ctx));
+    ctx->v[0] = seed + XXH_P1 + XXH_P2;
+    ctx->v[1] = seed + XXH_P2;
+    ctx->v[2] = seed;
+    ctx->v[3] = seed - XXH_P1;
+}
+
+static const uint8_t *xxh64_stripes (uint64_t *v, const uint8_t *p, uint32_t len)
+{
+    uint64_t v0 = v[0], v1 = v[1], v2 = v[2], v3 = v[3];
+    const uint8_t *end = p + (len & ~31u);
+
+    while (p < end)
+    {
+        v0 = xxh_round(v0, xxh_read64(p));
+        v1 = xxh_round(v1, xxh_read64(p + 8));
+        v2 = xxh_round(v2, xxh_read64(p + 16));
+        v3 = xxh_round(v3, xxh_read64(p + 24));
+        p += 32;
+    }
+    v[0] = v0;
+    v[1] = v1;
+    v[2] = v2;
+    v[3] = v3;
+    return p;
+}
+
+void xxh64_update (xxh64_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    const uint8_t *p = buf;
+    uint32_t n;
+
+    ctx->total += len;
+    if (ctx->mem_len > 0)
+    {
+        n = my_min(len, 32 - ctx->mem_len);
+        memcpy (ctx->mem + ctx->mem_len, p, n);
+        ctx->mem_len += n;
+        p += n;
+        len -= n;
+        if (ctx->mem_len < 32)
+        {
+            return;
+        }
+        xxh64_stripes (ctx->v, ctx->mem, 32);
+        ctx->mem_len = 0;
+    }
+    n = len & ~31u;
+    p = xxh64_stripes (ctx->v, p, n);
+    len -= n;
+    memcpy (ctx->mem, p, len);
+    ctx->mem_len = len;
+}
+
+uint64_t xxh64_final (const xxh64_ctx_t *ctx)
+{
+    const uint8_t *p = ctx->mem;
+    uint32_t len = ctx->mem_len;
+    uint64_t h;
+
+    if (ctx->total >= 32)
+    {
+        h = xxh_rotl(ctx->v[0], 1) + xxh_rotl(ctx->v[1], 7) + xxh_rotl(ctx->v[2], 12) + xxh_rotl(ctx->v[3], 18);
+        h = xxh_merge(h, ctx->v[0]);
+        h = xxh_merge(h, ctx->v[1]);
+        h = xxh_merge(h, ctx->v[2]);
+        h = xxh_merge(h, ctx->v[3]);
+    }
+    else
+    {
+        h = ctx->v[2] + XXH_P5; /* v[2] == seed */
+    }
+    h += ctx->total;
+
+    while (len >= 8)
+    {
+        h ^= xxh_round(0, xxh_read64(p));
+        h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+        len -= 8;
+    }
+    if (len >= 4)
+    {
+        h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+        h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        len -= 4;
+    }
+    while (len--)
+    {
+        h ^= (*p++) * XXH_P5;
+        h = xxh_rotl(h, 11) * XXH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+uint64_t xxh64 (const void *buf, uint32_t len, uint64_t seed)
+{
+    xxh64_ctx_t ctx;
+
+    xxh64_init (&ctx, seed);
+    xxh64_update (&ctx, buf, len);
+    return xxh64_final (&ctx);
+}
+
+/***********************************************************************************/
+/* registry */
+
+static void crc32_vfy_init (verify_ctx_t *ctx)
+{
+    ctx->crc = 0xFFFFFFFF;
+}
+
+static void crc32_vfy_update (verify_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    ctx->crc = make_crc32(ctx->crc, buf, len);
+}
+
+static void crc32_vfy_final (const verify_ctx_t *ctx, uint8_t *digest)
+{
+    put_u32(digest, ctx->crc);
+}
+
+static void crc32c_vfy_update (verify_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    ctx->crc = make_crc32c(ctx->crc, buf, len);
+}
+
+static void crc32c_vfy_final (const verify_ctx_t *ctx, uint8_t *digest)
+{
+    put_u32(digest, ~ctx->crc);
+}
+
+static void xxh64_vfy_init (verify_ctx_t *ctx)
+{
+    xxh64_init (&ctx->xxh64, 0);
+}
+
+static void xxh64_vfy_update (verify_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    xxh64_update (&ctx->xxh64, buf, len);
+}
+
+static void xxh64_vfy_final (const verify_ctx_t *ctx, uint8_t *digest)
+{
+    put_u64(digest, xxh64_final (&ctx->xxh64));
+}
+
+static void sha256_vfy_init (verify_ctx_t *ctx)
+{
+    sha256_init (&ctx->sha256);
+}
+
+static void sha256_vfy_update (verify_ctx_t *ctx, const void *buf, uint32_t len)
+{
+    sha256_update (&ctx->sha256, buf, len);
+}
+
+static void sha256_vfy_final (const verify_ctx_t *ctx, uint8_t *digest)
+{
+    sha256_final (&ctx->sha256, digest);
+}
+
+static const verify_alg_t s_verify_alg[] =
+{
+    { VERIFY_CRC32,  4, "crc32",  crc32_vfy_init, crc32_vfy_update,  crc32_vfy_final  },
+    { VERIFY_CRC32C, 4, "crc32c", crc32_vfy_init, crc32c_vfy_update, crc32c_vfy_final },
+    { VERIFY_XXH64,  8, "xxh64",  xxh64_vfy_init, xxh64_vfy_update,  xxh64_vfy_final  },
+    { VERIFY_SHA256, SHA256_DIGEST_LEN, "sha256", sha256_vfy_init, sha256_vfy_update, sha256_vfy_final },
+};
+
+const verify_alg_t *verify_find (uint8_t id)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(s_verify_alg) / sizeof(s_verify_alg[0]); i++)
+    {
+        if (s_verify_alg[i].id == id)
+        {
+            return &s_verify_alg[i];
+        }
+    }
+    return NULL;
+}
+
+const verify_alg_t *verify_find_name (const char *name)
+{
+    uint32_t i;
+
+    for (i = 0; i < sizeof(s_verify_alg) / sizeof(s_verify_alg[0]); i++)
+    {
+        if (strcmp (s_verify_alg[i].name, name) == 0)
+        {
+            return &s_verify_alg[i];
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,61 @@
+#ifndef _VERIFY_H_
+#define _VERIFY_H_
+
+#ifdef __cplusplus
+    extern "C" {
+#endif
+
+#include <inttypes.h>
+#include "sha256.h"
+
+/*
+    CheckMemory (0x0200) verification algorithms
+    verify data length 4 is the legacy CRC32, otherwise verify data = algorithm id + digest
+*/
+#define VERIFY_CRC32        0x01
+#define VERIFY_CRC32C       0x02
+#define VERIFY_XXH64        0x03
+#define VERIFY_SHA256       0x04
+
+#define VERIFY_MAX_DIGEST   32
+
+typedef struct
+{
+    uint64_t total;
+    uint64_t v[4];
+    uint8_t  mem[32];
+    uint32_t mem_len;
+} xxh64_ctx_t;
+
+/* plain data only, a context can be copied or saved as is */
+typedef union
+{
+    uint32_t crc;
+    xxh64_ctx_t xxh64;
+    sha256_ctx_t sha256;
+} verify_ctx_t;
+
+typedef struct
+{
+    uint8_t id;
+    uint8_t digest_len;
+    const char *name;
+    void (*init)(verify_ctx_t *ctx);
+    void (*update)(verify_ctx_t *ctx, const void *buf, uint32_t len);
+    void (*final)(const verify_ctx_t *ctx, uint8_t *digest);
+} verify_alg_t;
+
+const verify_alg_t *verify_find (uint8_t id);
+const verify_alg_t *verify_find_name (const char *name);
+
+uint32_t make_crc32c (uint32_t crc, const void *buf, uint32_t len);
+void xxh64_init (xxh64_ctx_t *ctx, uint64_t seed);
+void xxh64_update (xxh64_ctx_t *ctx, const void *buf, uint32_t len);
+uint64_t xxh64_final (const xxh64_ctx_t *ctx);
+uint64_t xxh64 (const void *buf, uint32_t len, uint64_t seed);
+
+#ifdef __cplusplus
+    }
+#endif
+
+#endif